@@ -0,0 +1,226 @@
+using namespace std;
+#include "jlog.hpp"
+#include "syncClass.hpp"
+#include "syncBase.hpp"
+#include <algorithm>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//! \file syncBase.cc
+//! \brief SyncBase class implementation.
+
+//! With --base each value of a pair of books is merged three-way against
+//! the values the pair had after the last merge. A value changed on one
+//! side only is copied to the other side, lower or not, so that a rating
+//! lowered on the device is kept. A value changed on both sides, or a pair
+//! merged for the first time, gets the higher value as in -d both.
+
+//! Compare the Calibre book ids of two snapshot entries.
+static bool baseLess (const BaseEntry& a, const BaseEntry& b)
+{
+	return a.calId < b.calId;
+}
+
+//! SyncBase constructor.
+SyncBase::SyncBase (void) : mapAddr (0), mapSize (0), entries (0), count (0),
+	key (0), fromCalibre (0), fromReader (0), conflicts (0), noBase (0)
+{
+}
+
+//! SyncBase destructor, unmaps the file.
+SyncBase::~SyncBase ()
+{
+	if (mapAddr != 0)
+	{
+		munmap (mapAddr, mapSize);
+	}
+}
+
+//! \fn int SyncBase::openBase (const char *fName, string stateVal)
+//! \brief Map the snapshot of the last merge.
+//! A missing file, or one written for another state column, is not an
+//! error, the first merge raises the lower values.
+int SyncBase::openBase (const char *fName, string stateVal)
+{
+	key = 2166136261U;
+	for (string::iterator c = stateVal.begin (); c != stateVal.end (); ++c)
+	{
+		key = (key ^ (unsigned char) *c) * 16777619U;
+	}
+
+	int fd = open (fName, O_RDONLY);
+	if (fd < 0)
+	{
+		jLOG ("No base snapshot in [" << fName << "], raising the lower"
+			<< " values.");
+		return SUCCESS;
+	}
+
+	struct stat st;
+	if ((fstat (fd, &st) != 0) || (st.st_size < (off_t) sizeof (BaseHeader)))
+	{
+		jWARN ("Invalid base snapshot [" << fName << "], not used.");
+		close (fd);
+		return SUCCESS;
+	}
+
+	mapSize = st.st_size;
+	mapAddr = mmap (0, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (mapAddr == MAP_FAILED)
+	{
+		jERR ("Unable to map the base snapshot [" << fName << "]");
+		mapAddr = 0;
+		return FAIL;
+	}
+
+	const BaseHeader *header = (const BaseHeader *) mapAddr;
+	if ((memcmp (header->magic, BASE_MAGIC, sizeof (header->magic)) != 0)
+		|| (mapSize != sizeof (BaseHeader)
+			+ header->count * sizeof (BaseEntry)))
+	{
+		jWARN ("Invalid base snapshot [" << fName << "], not used.");
+		return SUCCESS;
+	}
+	if (header->key != key)
+	{
+		jWARN ("Base snapshot [" << fName << "] is not for the state column ["
+			<< stateVal << "], not used.");
+		return SUCCESS;
+	}
+
+	entries = (const BaseEntry *) (header + 1);
+	count = header->count;
+	jLOG ("Mapped the base snapshot of " << count << " books from ["
+		<< fName << "]");
+	return SUCCESS;
+}
+
+//! \fn const BaseEntry *SyncBase::findPair (int calId, int rdrId)
+//! \brief Find the snapshot of a pair of books.
+//! \return The entry, 0 if the Calibre book is not in the snapshot or was
+//! merged with another Reader book.
+const BaseEntry *SyncBase::findPair (int calId, int rdrId)
+{
+	BaseEntry k;
+	k.calId = calId;
+
+	const BaseEntry *e = lower_bound (entries, entries + count, k, baseLess);
+	if ((e == entries + count) || (e->calId != calId) || (e->rdrId != rdrId))
+	{
+		return 0;
+	}
+	return e;
+}
+
+//! \fn int SyncBase::resolve (int cVal, int rVal, int cBase, int rBase,
+//! bool hasBase)
+//! \brief Resolve a value of a pair of books.
+//! \param [in] cVal, rVal The Calibre and Reader values.
+//! \param [in] cBase, rBase The values after the last merge.
+//! \param [in] hasBase false if the pair is not in the snapshot.
+//! \return The merged value, cVal or rVal.
+int SyncBase::resolve (int cVal, int rVal, int cBase, int rBase,
+	bool hasBase)
+{
+	if (cVal == rVal)
+	{
+		return cVal;
+	}
+	if (hasBase != true)
+	{
+		noBase++;
+		return (cVal > rVal) ? cVal : rVal;
+	}
+
+	bool cChanged = (cVal != cBase);
+	bool rChanged = (rVal != rBase);
+	if ((cChanged == true) && (rChanged != true))
+	{
+		fromCalibre++;
+		return cVal;
+	}
+	if ((rChanged == true) && (cChanged != true))
+	{
+		fromReader++;
+		return rVal;
+	}
+	if (cChanged == true)
+	{
+		conflicts++;
+		return (cVal > rVal) ? cVal : rVal;
+	}
+
+	// Neither side has changed, the other side could not store the value.
+	return cVal;
+}
+
+//! \fn void SyncBase::addPair (BaseEntry& entry)
+//! \brief Record the values of a pair of books after the merge.
+void SyncBase::addPair (BaseEntry& entry)
+{
+	merged[entry.calId] = entry;
+	BaseValues& rdr = readers[entry.rdrId];
+	rdr.rating = entry.rRating;
+	rdr.state = entry.rState;
+}
+
+//! \fn int SyncBase::saveBase (const char *fName)
+//! \brief Write the snapshot for the next merge.
+//! The pairs merged in this run are written sorted by Calibre book id
+//! under a temporary name, which is then renamed. The Reader values of each
+//! pair are the values of its Reader book after all the pairs are merged.
+int SyncBase::saveBase (const char *fName)
+{
+	string tmpName = string (fName) + ".tmp";
+	FILE *out = fopen (tmpName.c_str (), "wb");
+	if (out == 0)
+	{
+		jERR ("Unable to open base snapshot file [" << tmpName << "]");
+		return FAIL;
+	}
+
+	BaseHeader header;
+	memset (&header, '\0', sizeof (header));
+	memcpy (header.magic, BASE_MAGIC, sizeof (header.magic));
+	header.key = key;
+	header.count = merged.size ();
+
+	bool ok = (fwrite (&header, sizeof (header), 1, out) == 1);
+	for (map<int, BaseEntry>::iterator i = merged.begin ();
+		ok && (i != merged.end ()); ++i)
+	{
+		BaseEntry& entry = (*i).second;
+		BaseValues& rdr = readers[entry.rdrId];
+		entry.rRating = rdr.rating;
+		entry.rState = rdr.state;
+		ok = (fwrite (&entry, sizeof (BaseEntry), 1, out) == 1);
+	}
+	if ((fclose (out) != 0) || (ok != true))
+	{
+		jERR ("Writing base snapshot file [" << tmpName << "] failed");
+		remove (tmpName.c_str ());
+		return FAIL;
+	}
+	if (rename (tmpName.c_str (), fName) != 0)
+	{
+		jERR ("Unable to rename [" << tmpName << "] to [" << fName << "]");
+		return FAIL;
+	}
+
+	jLOG ("Wrote the base snapshot of " << merged.size () << " books to ["
+		<< fName << "]");
+	return SUCCESS;
+}
+
+//! Display the merge statistics.
+void SyncBase::displayStats (void)
+{
+	jLOG ("Merge : " << fromCalibre << " values changed in Calibre, "
+		<< fromReader << " in Reader, " << conflicts << " on both sides, "
+		<< noBase << " without a base.");
+}
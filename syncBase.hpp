@@ -0,0 +1,127 @@
+#ifndef __SYNCBASE_H
+#define __SYNCBASE_H
+//! \file syncBase.hpp
+//! \brief SyncBase class declaration.
+
+#include <string>
+#include <map>
+#include <unordered_map>
+
+//! Header of the base snapshot file.
+struct BaseHeader
+{
+	//! File type and version, BASE_MAGIC.
+	char magic[8];
+
+	//! Hash of the state column the snapshot was written for.
+	unsigned int key;
+
+	//! Number of entries after the header.
+	unsigned int count;
+};
+
+//! The standard values of a merged pair of books after the last merge.
+struct BaseEntry
+{
+	//! Calibre book id, the entries are sorted by it.
+	int calId;
+
+	//! Reader book id.
+	int rdrId;
+
+	//! Standard rating of the Calibre book.
+	short cRating;
+
+	//! Standard state of the Calibre book.
+	short cState;
+
+	//! Standard rating of the Reader book.
+	short rRating;
+
+	//! Standard state of the Reader book.
+	short rState;
+};
+
+//! The standard values of a Reader book after the merge.
+struct BaseValues
+{
+	//! Standard rating.
+	short rating;
+
+	//! Standard state.
+	short state;
+};
+
+//! File type and version of the base snapshot file.
+#define BASE_MAGIC "SRBASE01"
+
+//! Snapshot of the books at the last three-way merge, see mergeBook.
+//! The snapshot of the last merge is a memory mapped file of fixed width
+//! entries sorted by Calibre book id. The values of each side are kept,
+//! a value one side can not store does not count as a change of the
+//! other side at the next merge.
+class SyncBase
+{
+private :
+	//! The mapped file, 0 if there is none.
+	void *mapAddr;
+
+	//! Size of the mapped file.
+	size_t mapSize;
+
+	//! The entries in the mapped file.
+	const BaseEntry *entries;
+
+	//! Number of entries in the mapped file.
+	size_t count;
+
+	//! Hash of the state column.
+	unsigned int key;
+
+	//! The pairs merged in this run by Calibre book id.
+	map<int, BaseEntry> merged;
+
+	//! The values of the Reader books merged in this run by Reader book id.
+	//! Several Calibre books with the same title are merged with one Reader
+	//! book, the values after the last of them are written for all pairs.
+	unordered_map<int, BaseValues> readers;
+
+	//! Number of values changed in Calibre only.
+	long fromCalibre;
+
+	//! Number of values changed in Reader only.
+	long fromReader;
+
+	//! Number of values changed on both sides, the higher one is kept.
+	long conflicts;
+
+	//! Number of values of pairs not in the snapshot.
+	long noBase;
+
+public :
+	//! SyncBase constructor.
+	SyncBase (void);
+
+	//! SyncBase destructor, unmaps the file.
+	~SyncBase ();
+
+	//! Map the snapshot of the last merge.
+	int openBase (const char *fName, string stateVal);
+
+	//! Find the snapshot of a pair of books.
+	const BaseEntry *findPair (int calId, int rdrId);
+
+	//! Resolve a value of a pair of books.
+	int resolve (int cVal, int rVal, int cBase, int rBase, bool hasBase);
+
+	//! Record the values of a pair of books after the merge.
+	void addPair (BaseEntry& entry);
+
+	//! Write the snapshot for the next merge.
+	int saveBase (const char *fName);
+
+	//! Display the merge statistics.
+	void displayStats (void);
+};
+
+#endif
@@ -10,6 +10,220 @@ int decodeRating (int flags);
 int decodeState (int flags);
 */
 
+//! The standard read states, the index is the standard state.
+static constexpr const char *stdStateNames[STD_STATES] =
+	{"Unread", "To Read", "Reading", "Finished"};
+
+//! Text of a state value that is not known.
+static const string unknownState = "Unknown";
+
+//! \fn constexpr int stdStateSlot (const char *name, size_t len)
+//! \brief Perfect hash of the standard state names.
+//! The length and the first letter tell the names apart, the name is
+//! compared with the one in the slot by stdStateValue.
+//! \return The standard state the name can be, -1 if none.
+static constexpr int stdStateSlot (const char *name, size_t len)
+{
+	switch (len)
+	{
+		case 6 :
+			return 0;
+		case 7 :
+			return (name[0] == 'T') ? 1 : 2;
+		case 8 :
+			return 3;
+	}
+	return -1;
+}
+
+static_assert ((stdStateSlot ("Unread", 6) == 0) &&
+	(stdStateSlot ("To Read", 7) == 1) && (stdStateSlot ("Reading", 7) == 2) &&
+	(stdStateSlot ("Finished", 8) == 3), "stdStateSlot does not match");
+
+//! \fn static int stdStateValue (const string& name)
+//! \brief Find the standard state of a state name.
+//! \return The standard state, -1 if the name is not a standard state.
+static int stdStateValue (const string& name)
+{
+	int slot = stdStateSlot (name.c_str (), name.length ());
+	if ((slot >= 0) && (name == stdStateNames[slot]))
+	{
+		return slot;
+	}
+	return -1;
+}
+
+// RefLookup methods. ///////////////////////////////////
+//! RefLookup constructor.
+RefLookup::RefLookup ()
+{
+	for (int i = 0; i <= RATE_MASK; i++)
+	{
+		rateIdByStd[i] = 0;
+	}
+	for (int i = 0; i < STD_STATES; i++)
+	{
+		stateIdByStd[i] = -1;
+	}
+}
+
+//! \fn int RefLookup::setRatings (map<int, int>& dbRatings)
+//! \brief Create the rating lookup tables from the rating ids.
+//! The standard ratings of the ids below LOOKUP_IDS are kept in an array.
+//! For a standard rating given by several ids the highest id is taken.
+int RefLookup::setRatings (map<int, int>& dbRatings)
+{
+	ratingIdMap = dbRatings;
+
+	stdRateById.clear ();
+	for (int i = 0; i <= RATE_MASK; i++)
+	{
+		rateIdByStd[i] = 0;
+	}
+	for (map<int, int>::iterator i = ratingIdMap.begin ();
+		i != ratingIdMap.end (); ++i)
+	{
+		if (((*i).first >= 0) && ((*i).first < LOOKUP_IDS))
+		{
+			stdRateById.resize ((*i).first + 1, 0);
+			stdRateById[(*i).first] = (*i).second;
+		}
+		if (((*i).second >= 0) && ((*i).second <= RATE_MASK))
+		{
+			rateIdByStd[(*i).second] = (*i).first;
+		}
+	}
+	return SUCCESS;
+}
+
+//! \fn int RefLookup::setStates (map<int, string>& t)
+//! \brief Create the read state lookup tables from the values read from DB.
+//! The texts of the state ids below LOOKUP_IDS are kept in an array, and
+//! the first id of each standard state name.
+int RefLookup::setStates (map<int, string>& t)
+{
+	states = t;
+
+	stateTextById.clear ();
+	stdStateById.clear ();
+	for (int i = 0; i < STD_STATES; i++)
+	{
+		stateIdByStd[i] = -1;
+	}
+	for (map<int, string>::iterator i = states.begin (); i != states.end ();
+		++i)
+	{
+		int std = stdStateValue ((*i).second);
+		if (((*i).first >= 0) && ((*i).first < LOOKUP_IDS))
+		{
+			stateTextById.resize ((*i).first + 1, unknownState);
+			stateTextById[(*i).first] = (*i).second;
+			stdStateById.resize ((*i).first + 1, -1);
+			stdStateById[(*i).first] = std;
+		}
+
+		if ((std >= 0) && (stateIdByStd[std] == -1))
+		{
+			stateIdByStd[std] = (*i).first;
+		}
+	}
+	return SUCCESS;
+}
+
+//! \fn const string& RefLookup::stateToText (int state) const
+//! \brief Find the state text from the state value.
+//! If the value is not known, "Unknown" is returned.
+const string& RefLookup::stateToText (int state) const
+{
+	if ((state >= 0) && (state < (int) stateTextById.size ()))
+	{
+		return stateTextById[state];
+	}
+
+	map<int, string>::const_iterator i = states.find (state);
+	if (i != states.end ())
+	{
+		return (*i).second;
+	}
+	return unknownState;
+}
+
+//! \fn int RefLookup::findStdState (int state) const
+//! \brief Find the standard state from the state value.
+//! \return The standard state, -1 if the text of the value is not a
+//! standard state.
+int RefLookup::findStdState (int state) const
+{
+	if ((state >= 0) && (state < (int) stdStateById.size ()))
+	{
+		return stdStateById[state];
+	}
+	return stdStateValue (stateToText (state));
+}
+
+//! \fn int RefLookup::textTostate (const string& stateName) const
+//! \brief Find the state value from the state text.
+//! \return The state value, -1 if the name is not known.
+int RefLookup::textTostate (const string& stateName) const
+{
+	int std = stdStateValue (stateName);
+	if (std >= 0)
+	{
+		return stateIdByStd[std];
+	}
+
+	for (map <int, string>::const_iterator i = states.begin ();
+		i != states.end (); ++i)
+	{
+		if ( (*i).second == stateName )
+		{
+			return (*i).first;
+		}
+	}
+	return -1;
+}
+
+//! \fn int RefLookup::findStdRating (int dbRating) const
+//! \brief Find the standard rating from the DB rating value.
+//! \return The standard rating, 0 if the value is not known.
+int RefLookup::findStdRating (int dbRating) const
+{
+	if ((dbRating >= 0) && (dbRating < (int) stdRateById.size ()))
+	{
+		return stdRateById[dbRating];
+	}
+
+	map<int, int>::const_iterator i = ratingIdMap.find (dbRating);
+	if (i != ratingIdMap.end ())
+	{
+		return (*i).second;
+	}
+	return 0;
+}
+
+//! \fn int RefLookup::stdRateToDBRate (int stdRate) const
+//! \brief Find the DB rating value from the standard rating.
+//! \return The rating id, 0 if there is none.
+int RefLookup::stdRateToDBRate (int stdRate) const
+{
+	int dbRate = 0;
+
+	if ((stdRate >= 0) && (stdRate <= RATE_MASK))
+	{
+		return rateIdByStd[stdRate];
+	}
+
+	for (map<int, int>::const_iterator j = ratingIdMap.begin ();
+		j != ratingIdMap.end (); ++j)
+	{
+		if ((*j).second == stdRate)
+		{
+			dbRate = (*j).first;
+		}
+	}
+	return dbRate;
+}
+
 // SyncClass methods. ////////////////////////////////////
 //! SyncClass constructor.
 SyncClass::SyncClass ()
@@ -37,26 +251,28 @@ SyncClass& SyncClass::operator = (const SyncClass& rhs)
 	rating = rhs.rating;
 	stdRating = rhs.stdRating;
 	state = rhs.state;
-	stateText = rhs.stateText;
 	stdState = rhs.stdState;
 	customStatePresent = rhs.customStatePresent;
 	flags = rhs.flags;
 
-	states = rhs.states;
-	ratingIdMap = rhs.ratingIdMap;
+	//! The lookup tables are shared, not copied.
+	lookup = rhs.lookup;
 	linkId = rhs.linkId;
 
 	return *this;
 }
 
-//! Set method for title.
-void SyncClass::setTitle (string name)
+//! \fn void SyncClass::setTitle (string_view name)
+//! \brief Set method for title.
+//! The title is copied into the buffer of the record, which is kept for
+//! the next title.
+void SyncClass::setTitle (string_view name)
 {
-	title = name;
+	title.assign (name.data (), name.length ());
 }
 
 //! Get method for title.
-string SyncClass::getTitle (void)
+const string& SyncClass::getTitle (void)
 {
 	return title;
 }
@@ -96,6 +312,16 @@ void SyncClass::setRating (int r)
 	stdRating = sRating;
 }
 
+//! \fn void SyncClass::setRating (int r, int stdR)
+//! \brief Set the rating and the standard rating found for it.
+//! Used when the records are set from the fetched books, the standard
+//! rating is looked up by the caller, see CalibreDb::setRecord.
+void SyncClass::setRating (int r, int stdR)
+{
+	rating = r;
+	stdRating = stdR;
+}
+
 //! Get method for rating
 int SyncClass::getRating (void)
 {
@@ -143,23 +369,18 @@ void SyncClass::setFlags (int f)
 	flags = f;
 }
 
-//! \fn int SyncClass::setStateText (string name)
-//! brief Set method for state text.
-//! Set the state text and standard state.
-int SyncClass::setStateText (string name)
+//! Set method for stdState
+void SyncClass::setStdState (int s)
 {
-	stateText = name;
-	int stateVal;
-	stateVal = findStdState (name);
-	stdState = stateVal;
-	return SUCCESS;
+	stdState = s;
 }
 
 //! \fn string SyncClass::getStateText (void)
-//! \brief set method for state text
+//! \brief Get method for state text.
+//! The record keeps only the state value, the text is looked up from it.
 string SyncClass::getStateText (void)
 {
-	return stateText;
+	return stateToText (state);
 }
 
 int SyncClass::setCustomStatePresent (bool val)
@@ -173,13 +394,39 @@ bool SyncClass::getCustomStatePresent (void)
 	return customStatePresent;
 }
 
+//! \fn void SyncClass::setLookup (shared_ptr<const RefLookup> l)
+//! \brief Share the lookup tables of the DB with the record.
+void SyncClass::setLookup (shared_ptr<const RefLookup> l)
+{
+	lookup = l;
+}
+
+//! \fn const RefLookup *SyncClass::getLookup (void)
+//! \brief Get the lookup tables of the DB, 0 if none were shared.
+const RefLookup *SyncClass::getLookup (void)
+{
+	return lookup.get ();
+}
+
 // Calibre methods //////////////////////////////////////
+//! Calibre constructor.
+Calibre::Calibre ()
+{
+}
+
 //! Calibre destructor.
 Calibre::~Calibre ()
 {
 	jTRACE ("Calibre destructor");
 }
 
+//! Calibre assignment operator.
+Calibre& Calibre::operator = (const Calibre& rhs)
+{
+	SyncClass::operator = (rhs);
+	return *this;
+}
+
 //! \fn void Calibre::displayData (void)
 //! \brief Display the Calibre data.
 void Calibre::displayData ()
@@ -194,84 +441,43 @@ void Calibre::displayData ()
 	else
 	{
 		jINFO ("Calibre Id =" << setw(5) << getId ()  << ", State = "
-		<< setw(8) << getStateText () << "  (" << "NA" << "), Rating = "
+		<< setw(8) << "" << "  (" << "NA" << "), Rating = "
 		<< getStdRating () << "(" << getRating () << ")" << ", Title = "
 		<< getTitle());
 	}
 }
 
-//! \fn int Calibre::createRefLookup (map<int, string>& t)
-//! \brief Create a lookup table for Calibre based on the values read from DB.
-int Calibre::createRefLookup (map<int, string>& t)
-{
-	states = t;
-	return SUCCESS;
-}
-
-int Calibre::createRatingLookup (map<int, int>& dbRatings)
-{
-	ratingIdMap = dbRatings;
-	return SUCCESS;
-}
-
 //! \fn int Calibre::findStdState (string stateName)
 //! \brief Find the state value given the Calibre state name.
 int Calibre::findStdState (string stateName)
 {
-	int lState = -1;
-	map<string, int> stdState;
-	stdState["Unread"] = 0;
-	stdState["To Read"] = 1;
-	stdState["Reading"] = 2;
-	stdState["Finished"] = 3;
-
-	map<string, int>::iterator res;
-
-	res = stdState.find (stateName);
-	if (res != stdState.end())
-	{
-		lState = stdState[stateName];
-	}
-	return (lState);
-
+	return stdStateValue (stateName);
 }
 
 //! \fn string Calibre::stateToText (int state)
 //! Translate the Read state values to text
-//! The text value of Calibre Text is returned from the map. If the input
-//! value is out of bounds, "Unknown" will be returned.
+//! The text value of Calibre Text is returned from the lookup tables. If
+//! the input value is out of bounds, "Unknown" will be returned.
 string Calibre::stateToText (int state)
 {
-	string text;
-	map<int, string>::iterator i = states.find (state);
-	if (i != states.end ())
+	const RefLookup *l = getLookup ();
+	if (l == 0)
 	{
-		text = (*i).second;
+		return "Unknown";
 	}
-	else
-	{
-		text = "Unknown";
-	}
-	return (text);
+	return l->stateToText (state);
 }
 
 //! \fn int Calibre::textTostate (string stateName)
 //! \brief Get the Calibre state value given the state name.
 int Calibre::textTostate (string stateName)
 {
-	int lState = -1;
-	// jFNTRY ();
-	for (map <int, string>::iterator i = states.begin ();
-		i != states.end (); ++i)
+	const RefLookup *l = getLookup ();
+	if (l == 0)
 	{
-		if ( (*i).second == stateName )
-		{
-			lState = (*i).first;
-			break;
-		}
+		return -1;
 	}
-	// jFX ();
-	return lState;
+	return l->textTostate (stateName);
 }
 
 //! \fn int Calibre::findStdRating (int dbRating)
@@ -283,20 +489,12 @@ int Calibre::findStdRating (int dbRating)
 	//! Calibre store the ratings in the ratings table. The ratings can
 	//! range from 0 to 10. The id of this rating is linked to the 
 	//! books_ratings_link table. The stars are derived as rating / 2.
-	int sRating = 0;
-
-	for (map<int, int>::iterator i = ratingIdMap.begin ();
-		i != ratingIdMap.end (); ++i)
+	const RefLookup *l = getLookup ();
+	if (l == 0)
 	{
-		if ((*i).first == dbRating)
-		{
-			sRating = (*i).second;
-		}
+		return 0;
 	}
-
-	// jTRACE ("Translating Calibre Rating from "<< dbRating << " to "
-	// << sRating);
-	return (sRating);
+	return l->findStdRating (dbRating);
 }
 
 
@@ -304,17 +502,12 @@ int Calibre::findStdRating (int dbRating)
 //! \brief Translate the standard rating to Calibre Rating.
 int Calibre::stdRateToDBRate (int stdRate)
 {
-	int dbRate = 0;
-
-	for (map<int, int>::iterator j = ratingIdMap.begin ();
-		j != ratingIdMap.end (); ++j)
+	const RefLookup *l = getLookup ();
+	if (l == 0)
 	{
-		if ((*j).second == stdRate)
-		{
-			dbRate = (*j).first;
-		}
+		return 0;
 	}
-	return dbRate;
+	return l->stdRateToDBRate (stdRate);
 }
 
 // Reader methods ///////////////////////////////////////
@@ -322,12 +515,6 @@ int Calibre::stdRateToDBRate (int stdRate)
 //! Reader constructor
 Reader::Reader ()
 {
-	map<int, string> t;
-	t[0] = "Unread";
-	t[1] = "To Read";
-	t[2] = "Reading";
-	t[3] = "Finished";
-	createRefLookup (t);
 	setId (0);
 	jDBG ("Calling setRating from Reader constructor");
 	setRating (0);
@@ -353,75 +540,30 @@ void Reader::displayData ()
 }
 
 
-//! Read state look up for Reader.
-int Reader::createRefLookup (map<int, string>& t)
-{
-	states = t;
-	return SUCCESS;
-}
-
-
 //! \fn string Reader::stateToText (int state)
 //! \brief Find the text value for a given state.
-//! The text value of Reader state is returned from the map.
+//! The Reader states are the standard states.
 string Reader::stateToText (int state)
 {
-	string lText;
-	
-	map<int, string>::iterator res = states.find (state);
-	if (res == states.end ())
+	if ((state < 0) || (state >= STD_STATES))
 	{
-		lText = "Unknown";
+		return "Unknown";
 	}
-	else
-	{
-		lText = states[state];
-	}
-	
-	return (lText);
+	return stdStateNames[state];
 }
 
 //! \fn int Reader::textTostate (string state)
 //! \brief Get the Reader state value given the state name.
 int Reader::textTostate (string stateName)
 {
-	int lState = -1;
-	// jFNTRY ();
-	for (map <int, string>::iterator i = states.begin ();
-		i != states.end (); ++i)
-	{
-		if ( (*i).second == stateName )
-		{
-			lState = (*i).first;
-			break;
-		}
-	}
-	// jFX ();
-	return lState;
+	return stdStateValue (stateName);
 }
 
 //! \fn int Reader::findStdState (string stateName)
 //! Find the Reader state value for the given state name.
 int Reader::findStdState (string stateName)
 {
-	int lState;
-	map<string, int> stdState;
-	stdState["Unread"] = 0;
-	stdState["To Read"] = 1;
-	stdState["Reading"] = 2;
-	stdState["Finished"] = 3;
-
-	map<string, int>::iterator res = stdState.find (stateName);
-	if (res == stdState.end ())
-	{
-		lState = -1;
-	}
-	else
-	{
-		lState = stdState[stateName];
-	}
-
-	return (lState);
+	return stdStateValue (stateName);
 }
 
 //! Find the standard rating for the given Reader rating.
@@ -445,11 +587,12 @@ void Reader::setRateNState (int f)
 	int lState = decodeRState (f);
 	setState (lState);
 
-	string lStateText = stateToText (lState);
-	setStateText (lStateText);
+	//! The Reader states are the standard states and the ratings are the
+	//! standard ratings, nothing is looked up.
+	setStdState ((lState < STD_STATES) ? lState : -1);
 
-	int lRating = decodeRRating (f);
-	setRating (lRating);
+	int lRating = Reader::decodeRRating (f);
+	setRating (lRating, lRating);
 }
 
 //! \fn int Reader::decodeRRating (int flags)
@@ -474,4 +617,18 @@ int Reader::decodeRState (int flags)
 	return state;
 }
 
+//! \fn int Reader::encodeRFlags (void)
+//! \brief Merge the rating and the state into the flags.
+//! The rating is stored in bits 20 to 23 and the state in bits 16 to 19 of
+//! the flags, the other bits are kept.
+//! \return The flags with the rating and state of the record.
+int Reader::encodeRFlags (void)
+{
+	int f = getFlags ();
 
+	f = (f & ~(RATE_MASK << RATE_SHIFT)) |
+		((getRating () & RATE_MASK) << RATE_SHIFT);
+	f = (f & ~(STATE_MASK << STATE_SHIFT)) |
+		((getState () & STATE_MASK) << STATE_SHIFT);
+	return f;
+}
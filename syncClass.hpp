@@ -2,6 +2,10 @@
 #define __SYNCCLASS_H
 
 #include <map>
+#include <vector>
+#include <memory>
+#include <string>
+#include <string_view>
 //! \file syncClass.hpp
 //! \brief SyncClass, Calibre & Reader class declarations.
 
@@ -14,9 +18,6 @@
 //! Return value for no data.
 #define NO_DATA -2
 
-//! Length of book titles.
-#define TITLE_LEN 200
-
 //! The Read State is bytes 16-19 in Flags.
 #define STATE_SHIFT 16
 
@@ -29,6 +30,66 @@
 //! Mask for extrating rating
 #define RATE_MASK 0x0F
 
+//! Number of standard read states, Unread, To Read, Reading and Finished.
+#define STD_STATES 4
+
+//! Calibre rating and state ids below this are looked up in arrays, the
+//! others in the maps, see RefLookup::setRatings.
+#define LOOKUP_IDS 4096
+
+//! Rating and read state lookup tables of a DB.
+//! The tables are built once, after the rating ids and the read states are
+//! loaded from the DB, and are then shared read only by all the records of
+//! the DB, see SyncClass::setLookup.
+class RefLookup
+{
+private :
+	//! Possible read states.
+	map<int,string> states;
+
+	//! Ratings id and ratings map.
+	map<int, int> ratingIdMap;
+
+	//! Standard rating by rating id, built from ratingIdMap.
+	vector<int> stdRateById;
+
+	//! Rating id by standard rating, 0 if there is none.
+	int rateIdByStd[RATE_MASK + 1];
+
+	//! State text by state id, built from states.
+	vector<string> stateTextById;
+
+	//! Standard state by state id, -1 if the text is not a standard state.
+	vector<int> stdStateById;
+
+	//! State id by standard state, -1 if there is none.
+	int stateIdByStd[STD_STATES];
+
+public :
+	RefLookup ();
+
+	//! Create the rating lookup tables from the rating ids.
+	int setRatings (map<int, int>& dbRatings);
+
+	//! Create the read state lookup tables.
+	int setStates (map<int, string>& stateLookup);
+
+	//! Find the state text from the state value.
+	const string& stateToText (int state) const;
+
+	//! Find the standard state from the state value.
+	int findStdState (int state) const;
+
+	//! Find the state value from the state text.
+	int textTostate (const string& stateName) const;
+
+	//! Find the standard rating from the DB rating value.
+	int findStdRating (int dbRating) const;
+
+	//! Find the DB rating value from the standard rating.
+	int stdRateToDBRate (int stdRate) const;
+};
+
 //! Abstract base class for the Calibre & Reader classes.
 class SyncClass
 {
@@ -51,9 +112,6 @@ private :
 	//! Read state
 	int state;
 
-	//! Rating text.
-	string stateText;
-
 	//! Standard state
 	int stdState;
 
@@ -63,14 +121,10 @@ private :
 	//! Flags - specific to Reader
 	int flags;
 
-public :
-
-	//! Possible read states.
-	map<int,string> states;
-
-	//! Ratings id and ratings map.
-	map<int, int> ratingIdMap;
+	//! Lookup tables shared by the records of the DB, 0 if none.
+	shared_ptr<const RefLookup> lookup;
 
+public :
 	SyncClass ();
 	virtual ~SyncClass ();
 
@@ -80,9 +134,6 @@ public :
 	//! Display the data.
 	virtual void displayData (void) = 0;
 
-	//! Create read state look up table.
-	virtual int createRefLookup (map<int, string>& stateLookup) = 0;
-
 	//! Method to find the state text from state value.	
 	virtual string stateToText (int state) = 0; 
 
@@ -93,10 +144,10 @@ public :
 	virtual int stdRateToDBRate (int stdRate) = 0;
 
 	//! Set method for title.
-	void setTitle (string name);
+	void setTitle (string_view name);
 
 	//! Get method for title.
-	string getTitle (void);
+	const string& getTitle (void);
 
 	//! Set method for id.
 	void setId (int i);
@@ -113,6 +164,9 @@ public :
 	//! Set method for rating
 	void setRating (int r);
 
+	//! Set the rating and the standard rating found for it.
+	void setRating (int r, int stdR);
+
 	//! Get method for rating
 	int getRating (void);
 
@@ -131,8 +185,8 @@ public :
 	//! Method to decode Rating from Reader flags.
 	virtual int decodeRRating (int flags) {return FAIL;};
 
-	//! Method to set the state Text.
-	int setStateText (string name);
+	//! Method to merge Rating and State into Reader flags.
+	virtual int encodeRFlags (void) {return FAIL;};
 
 	//! Method to get the state text.
 	string getStateText (void);
@@ -146,6 +200,9 @@ public :
 	//! Method to get the standard state.
 	int getStdState (void);
 
+	//! Method to set the standard state.
+	void setStdState (int);
+
 	//! Method to set the standard rating
 	void setStdRating (int);
 
@@ -158,6 +215,12 @@ public :
 	//! Method to get customStatePresent flag.
 	bool getCustomStatePresent (void);
 
+	//! Method to share the lookup tables of the DB.
+	void setLookup (shared_ptr<const RefLookup> l);
+
+	//! Method to get the lookup tables, 0 if none.
+	const RefLookup *getLookup (void);
+
 	//! Method to extract and set State and Rating for Reader.
 	virtual void setRateNState (int flags){};
 };
@@ -166,11 +229,10 @@ public :
 class Calibre : public SyncClass
 {
 public :
+	Calibre ();
 	virtual ~Calibre ();
 	Calibre& operator = (const Calibre& rhs);
 	void displayData (void);
-	int createRefLookup (map<int, string>& stateLookup);
-	int createRatingLookup (map<int, int>& dbRatings);
 	string stateToText (int state); 
 	int textTostate (string state); 
 	int stdRateToDBRate (int stdRate);
@@ -187,7 +249,6 @@ public :
 	virtual ~Reader ();
 	Reader& operator = (const Reader& rhs);
 	void displayData (void);
-	int createRefLookup (map<int, string>& stateLookup);
 	string stateToText (int state); 
 	int textTostate (string state); 
 	int stdRateToDBRate (int stdRate);
@@ -198,6 +259,9 @@ public :
 	//! Method to decode State from Reader flags.
 	int decodeRState (int flags);
 
+	//! Method to merge Rating and State into the flags.
+	int encodeRFlags (void);
+
 	//! Extract rating and state from the flags and set it.
 	void setRateNState (int flags);
 };
@@ -13,48 +13,1095 @@ using namespace std;
 //! Cool Reader database.
 
 
+//! \fn static void syncHashStep (sqlite3_context *ctx, int argc,
+//! sqlite3_value **argv)
+//! \brief Step of the sync_hash aggregate, see SyncDb::queryDataHash.
+//! The arguments of a row are hashed with FNV-1a and mixed, the row hashes
+//! are added so that the result does not depend on the row order.
+static void syncHashStep (sqlite3_context *ctx, int argc,
+	sqlite3_value **argv)
+{
+	sqlite3_uint64 *sum = (sqlite3_uint64 *) sqlite3_aggregate_context (ctx,
+		sizeof (sqlite3_uint64));
+	if (sum == 0)
+	{
+		sqlite3_result_error_nomem (ctx);
+		return;
+	}
+
+	sqlite3_uint64 h = 14695981039346656037ULL;
+	for (int i = 0; i < argc; i++)
+	{
+		// The type keeps null apart from an empty text.
+		h = (h ^ sqlite3_value_type (argv[i])) * 1099511628211ULL;
+
+		const unsigned char *p = sqlite3_value_text (argv[i]);
+		int len = sqlite3_value_bytes (argv[i]);
+		for (int j = 0; j < len; j++)
+		{
+			h = (h ^ p[j]) * 1099511628211ULL;
+		}
+		h = (h ^ 0xff) * 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	*sum += h;
+}
+
+//! \fn static void syncHashFinal (sqlite3_context *ctx)
+//! \brief Result of the sync_hash aggregate, 0 if there are no rows.
+static void syncHashFinal (sqlite3_context *ctx)
+{
+	sqlite3_uint64 *sum = (sqlite3_uint64 *) sqlite3_aggregate_context (ctx,
+		0);
+	sqlite3_result_int64 (ctx, (sum == 0) ? 0 : (sqlite3_int64) *sum);
+}
+
+//! Number of bits of the title filter per indexed title.
+#define FILTER_BITS_PER_TITLE 10
+
+//! Number of title filter bits set per title.
+#define FILTER_PROBES 6
+
+//! \fn static string foldTitle (string_view title)
+//! \brief Fold a title as the NOCASE collation of the title columns does.
+//! Only the ASCII upper case letters are folded to lower case. The book
+//! index is keyed by the folded title, so that a title matches the books
+//! the title lookup query finds, and the title filter hashes it.
+static string foldTitle (string_view title)
+{
+	string folded (title);
+	for (string::iterator c = folded.begin (); c != folded.end (); ++c)
+	{
+		if ((*c >= 'A') && (*c <= 'Z'))
+		{
+			*c = *c - 'A' + 'a';
+		}
+	}
+	return folded;
+}
+
+//! \fn static unsigned long long filterHash (const string& key)
+//! \brief Hash of a folded title for the title filter, see foldTitle.
+//! The filter hashes the keys of the book index, a title found in the index
+//! is never rejected by the filter.
+static unsigned long long filterHash (const string& key)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	for (string::const_iterator c = key.begin (); c != key.end (); ++c)
+	{
+		h = (h ^ (unsigned char) *c) * 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+//! \fn static unsigned int titleHash (const unsigned char *title, int len)
+//! \brief FNV-1a hash of a title, the leaves of the title tree are ranges
+//! of this hash.
+static unsigned int titleHash (const unsigned char *title, int len)
+{
+	unsigned int h = 2166136261U;
+	for (int i = 0; i < len; i++)
+	{
+		h = (h ^ title[i]) * 16777619U;
+	}
+	return h;
+}
+
+//! \fn static string_view columnText (sqlite3_stmt *stmt, int col)
+//! \brief Get a text column of the current row without copying it.
+//! The text is valid until the statement is stepped, reset or finalized.
+//! A null column is an empty text.
+static string_view columnText (sqlite3_stmt *stmt, int col)
+{
+	const char *text = (const char *) sqlite3_column_text (stmt, col);
+	if (text == 0)
+	{
+		return string_view ();
+	}
+	return string_view (text, sqlite3_column_bytes (stmt, col));
+}
+
+//! \fn static void syncLeafFunc (sqlite3_context *ctx, int argc,
+//! sqlite3_value **argv)
+//! \brief sync_leaf (title, bits), the title tree leaf of a title.
+static void syncLeafFunc (sqlite3_context *ctx, int argc,
+	sqlite3_value **argv)
+{
+	const unsigned char *title = sqlite3_value_text (argv[0]);
+	int bits = sqlite3_value_int (argv[1]);
+	unsigned int h = titleHash (title, sqlite3_value_bytes (argv[0]));
+	sqlite3_result_int (ctx, (bits == 0) ? 0 : (int) (h >> (32 - bits)));
+}
+
+//! \fn static void syncDirtyFunc (sqlite3_context *ctx, int argc,
+//! sqlite3_value **argv)
+//! \brief sync_dirty (title), 1 if the title is in a marked leaf.
+static void syncDirtyFunc (sqlite3_context *ctx, int argc,
+	sqlite3_value **argv)
+{
+	SyncDb *db = (SyncDb *) sqlite3_user_data (ctx);
+	const unsigned char *title = sqlite3_value_text (argv[0]);
+	sqlite3_result_int (ctx,
+		db->inLeafFilter (title, sqlite3_value_bytes (argv[0])) ? 1 : 0);
+}
+
+//! \fn static void syncStdRatingFunc (sqlite3_context *ctx, int argc,
+//! sqlite3_value **argv)
+//! \brief sync_std_rating (rating), the standard rating of a DB rating.
+static void syncStdRatingFunc (sqlite3_context *ctx, int argc,
+	sqlite3_value **argv)
+{
+	SyncClass *rec = (SyncClass *) sqlite3_user_data (ctx);
+	sqlite3_result_int (ctx, rec->findStdRating (sqlite3_value_int (argv[0])));
+}
+
+//! \fn static void syncStdStateFunc (sqlite3_context *ctx, int argc,
+//! sqlite3_value **argv)
+//! \brief sync_std_state (state), the standard state of a DB state, -1 for
+//! null as in fetchRecords.
+static void syncStdStateFunc (sqlite3_context *ctx, int argc,
+	sqlite3_value **argv)
+{
+	SyncClass *rec = (SyncClass *) sqlite3_user_data (ctx);
+	int state = -1;
+	if (sqlite3_value_type (argv[0]) != SQLITE_NULL)
+	{
+		state = sqlite3_value_int (argv[0]);
+	}
+	sqlite3_result_int (ctx, rec->findStdState (rec->stateToText (state)));
+}
+
+// RecordBatch methods ///////////////////////////////////
+//! \fn size_t RecordBatch::size (void)
+//! \brief Number of books in the batch.
+size_t RecordBatch::size (void)
+{
+	return ids.size ();
+}
+
+//! \fn void RecordBatch::clear (void)
+//! \brief Remove all the books, the memory is kept for the next batch.
+void RecordBatch::clear (void)
+{
+	ids.clear ();
+	linkIds.clear ();
+	ratings.clear ();
+	states.clear ();
+	flags.clear ();
+	titleEnds.clear ();
+	titles.clear ();
+}
+
+//! \fn void RecordBatch::reserve (size_t rows)
+//! \brief Reserve space for rows books.
+void RecordBatch::reserve (size_t rows)
+{
+	ids.reserve (rows);
+	linkIds.reserve (rows);
+	ratings.reserve (rows);
+	states.reserve (rows);
+	flags.reserve (rows);
+	titleEnds.reserve (rows);
+}
+
+//! \fn void RecordBatch::addRow (string_view title, BookRecord& bRec)
+//! \brief Add a book.
+//! The title is copied into the title buffer of the batch.
+void RecordBatch::addRow (string_view title, BookRecord& bRec)
+{
+	ids.push_back (bRec.id);
+	linkIds.push_back (bRec.linkId);
+	ratings.push_back (bRec.rating);
+	states.push_back (bRec.state);
+	flags.push_back (bRec.flags);
+	titles.append (title.data (), title.length ());
+	titleEnds.push_back (titles.length ());
+}
+
+//! \fn void RecordBatch::append (RecordBatch& from)
+//! \brief Add all the books of another batch after the books of this one.
+void RecordBatch::append (RecordBatch& from)
+{
+	size_t base = titles.length ();
+
+	ids.insert (ids.end (), from.ids.begin (), from.ids.end ());
+	linkIds.insert (linkIds.end (), from.linkIds.begin (),
+		from.linkIds.end ());
+	ratings.insert (ratings.end (), from.ratings.begin (),
+		from.ratings.end ());
+	states.insert (states.end (), from.states.begin (), from.states.end ());
+	flags.insert (flags.end (), from.flags.begin (), from.flags.end ());
+	for (size_t i = 0; i < from.titleEnds.size (); i++)
+	{
+		titleEnds.push_back (base + from.titleEnds[i]);
+	}
+	titles.append (from.titles);
+}
+
+//! \fn string_view RecordBatch::getTitle (size_t i)
+//! \brief Get the title of book i.
+//! The title is not copied, it is valid until books are added to the batch
+//! or the batch is cleared.
+string_view RecordBatch::getTitle (size_t i)
+{
+	size_t start = (i == 0) ? 0 : titleEnds[i - 1];
+	return string_view (titles.data () + start, titleEnds[i] - start);
+}
+
+//! \fn void RecordBatch::getBook (size_t i, BookRecord& bRec)
+//! \brief Get the book data of book i.
+void RecordBatch::getBook (size_t i, BookRecord& bRec)
+{
+	bRec.id = ids[i];
+	bRec.linkId = linkIds[i];
+	bRec.rating = ratings[i];
+	bRec.state = states[i];
+	bRec.flags = flags[i];
+}
+
 // SyncDb methods ///////////////////////////////////////
+//! SyncDb constructor
+SyncDb::SyncDb ()
+{
+	dbPtr = 0;
+	customStatePresent = false;
+	indexLoaded = false;
+	readOnly = false;
+	commitEvery = 0;
+	inTransaction = false;
+	pendingBooks = 0;
+	committedBooks = 0;
+	commitCount = 0;
+	staging = false;
+	stageStmt = 0;
+	stageStmtTrail = 0;
+	idRange = false;
+	rangeLo = 0;
+	rangeHi = 0;
+	leafFilter = 0;
+	leafBits = 0;
+	lookups = 0;
+	filterSkips = 0;
+	falseHits = 0;
+	idCache = 0;
+	indexRows = 0;
+}
+
 //! SyncDb destructor
 SyncDb::~SyncDb ()
 {
-	jTRACE ("SyncDb destructor");
+	jTRACE ("SyncDb destructor");
+}
+
+
+int SyncDb::setCustomStatePresent (bool val)
+{
+	customStatePresent = val;
+	return SUCCESS;
+}
+
+//! \fn bool SyncDb::getCustomStatePresent (void)
+//! \brief Check if custom state is present.
+//! Check if custom state is present. Based on the availability of this
+//! field certain processes that involve custom state are performed.
+//! \return True if custom state is present.
+bool SyncDb::getCustomStatePresent (void)
+{
+	return customStatePresent;
+}
+
+//! \fn void SyncDb::indexBook (string_view bookTitle, BookRecord& bRec)
+//! \brief Add a book to the book index unless its title is there.
+//! The first book loaded for a folded title is kept in the index, which
+//! is the same book the title lookup query returns.
+void SyncDb::indexBook (string_view bookTitle, BookRecord& bRec)
+{
+	pair<unordered_map<string, IndexedBook>::iterator, bool> i =
+		bookIndex.try_emplace (foldTitle (bookTitle));
+	if (i.second == true)
+	{
+		(*i.first).second.title.assign (bookTitle.data (),
+			bookTitle.length ());
+		(*i.first).second.book = bRec;
+	}
+}
+
+//! \fn int SyncDb::lookupBook (const string& bookTitle, BookRecord *bRec)
+//! \brief Look up a book in the book index.
+//! \return SUCCESS if found, NO_DATA otherwise.
+int SyncDb::lookupBook (const string& bookTitle, BookRecord *bRec)
+{
+	IndexedBook *book = findBook (bookTitle);
+	if (book == 0)
+	{
+		return NO_DATA;
+	}
+
+	*bRec = book->book;
+	return SUCCESS;
+}
+
+//! \fn IndexedBook *SyncDb::findBook (const string& bookTitle)
+//! \brief Find a book in the book index by its folded title.
+//! \return The book, 0 if not found.
+IndexedBook *SyncDb::findBook (const string& bookTitle)
+{
+	string key = foldTitle (bookTitle);
+
+	lookups++;
+	if (titleFilter.empty () != true)
+	{
+		//! Most source titles without a destination book are rejected by
+		//! the title filter without probing the index.
+		unsigned long long h = filterHash (key);
+		unsigned long long step = (h >> 32) | 1;
+		size_t bits = titleFilter.size () * 64;
+		for (int k = 0; k < FILTER_PROBES; k++)
+		{
+			size_t bit = (h + k * step) & (bits - 1);
+			if ((titleFilter[bit / 64] & (1ULL << (bit % 64))) == 0)
+			{
+				filterSkips++;
+				return 0;
+			}
+		}
+	}
+
+	unordered_map<string, IndexedBook>::iterator i = bookIndex.find (key);
+	if (i == bookIndex.end ())
+	{
+		if (titleFilter.empty () != true)
+		{
+			falseHits++;
+		}
+		return 0;
+	}
+	return &(*i).second;
+}
+
+//! \fn void SyncDb::buildTitleFilter (void)
+//! \brief Build the title filter from the book index.
+//! Called at the end of loadBookIndex. The filter is a Bloom filter of
+//! FILTER_BITS_PER_TITLE bits per title rounded up to a power of two, with
+//! FILTER_PROBES bits set per title.
+void SyncDb::buildTitleFilter (void)
+{
+	size_t bits = 64;
+	while (bits < bookIndex.size () * FILTER_BITS_PER_TITLE)
+	{
+		bits *= 2;
+	}
+	titleFilter.assign (bits / 64, 0);
+
+	for (unordered_map<string, IndexedBook>::iterator i = bookIndex.begin ();
+		i != bookIndex.end (); ++i)
+	{
+		unsigned long long h = filterHash ((*i).first);
+		unsigned long long step = (h >> 32) | 1;
+		for (int k = 0; k < FILTER_PROBES; k++)
+		{
+			size_t bit = (h + k * step) & (bits - 1);
+			titleFilter[bit / 64] |= (1ULL << (bit % 64));
+		}
+	}
+}
+
+//! \fn void SyncDb::displayLookupStats (string dbName)
+//! \brief Display the book index lookup statistics.
+//! Nothing is displayed if the index was not used.
+void SyncDb::displayLookupStats (string dbName)
+{
+	if (lookups == 0)
+	{
+		return;
+	}
+	jINFO (dbName << " title lookups : " << lookups << ", "
+		<< lookups - filterSkips - falseHits << " found, " << filterSkips
+		<< " skipped by the title filter, " << falseHits
+		<< " false positives.");
+}
+
+//! Pair the books by id through the id cache of the last run. Must be
+//! called before loadBookIndex.
+void SyncDb::setIdCache (IdCache *cache)
+{
+	idCache = cache;
+}
+
+//! \fn void SyncDb::buildIdIndex (void)
+//! \brief Build the id index from the book index.
+//! Called at the end of loadBookIndex if the id cache is used. The entries
+//! point to the book index, which keeps them in line with refreshBookIndex.
+//! Only the book a title lookup returns is in the index. The index is a
+//! table addressed by the book id, the ids of a DB are mostly dense. If
+//! they are not, no index is built and the books are paired by title.
+void SyncDb::buildIdIndex (void)
+{
+	size_t maxId = ID_INDEX_SPREAD * bookIndex.size () + 4096;
+
+	idIndex.clear ();
+	for (unordered_map<string, IndexedBook>::iterator i = bookIndex.begin ();
+		i != bookIndex.end (); ++i)
+	{
+		int id = (*i).second.book.id;
+		if (id <= 0)
+		{
+			continue;
+		}
+		if ((size_t) id >= idIndex.size ())
+		{
+			if ((size_t) id > maxId)
+			{
+				jLOG ("Book id " << id << " for " << bookIndex.size ()
+					<< " titles, pairing all books by title.");
+				idIndex.clear ();
+				return;
+			}
+			idIndex.resize (id + 1, 0);
+		}
+		idIndex[id] = &(*i).second;
+	}
+}
+
+//! \fn int SyncDb::matchBook (SyncClass *rec, SyncClass *source)
+//! \brief Find the destination book of a source book.
+//! If the source book was paired in the last run and its title is still
+//! the title of the destination book, the destination book is taken from
+//! the id index without folding or hashing the title. Otherwise it is
+//! looked up by title, see getBookInfo, and the pair is recorded for the
+//! next run.
+//! \param [out] rec The destination book.
+//! \return SUCCESS, NO_DATA if there is no destination book or FAIL.
+int SyncDb::matchBook (SyncClass *rec, SyncClass *source)
+{
+	if ((idCache == 0) || (indexLoaded != true))
+	{
+		return getBookInfo (rec, source->getTitle ());
+	}
+
+	//! A renamed book on either side no longer has the title of the other
+	//! book, a book whose title differs only in case from the destination
+	//! title is looked up by title as well.
+	const string& title = source->getTitle ();
+	const IdCacheEntry *entry = idCache->findPair (source->getId ());
+	if ((entry != 0) && (entry->destId > 0) &&
+		((size_t) entry->destId < idIndex.size ()))
+	{
+		IndexedBook *book = idIndex[entry->destId];
+		if ((book != 0) && (book->title == title))
+		{
+			setRecord (rec, book->title, book->book);
+			idCache->countLookup (entry, true);
+			idCache->addPair (source->getId (), entry->destId);
+			return SUCCESS;
+		}
+	}
+	idCache->countLookup (entry, false);
+
+	int retVal = getBookInfo (rec, title);
+	if (retVal == SUCCESS)
+	{
+		idCache->addPair (source->getId (), rec->getId ());
+	}
+	return retVal;
+}
+
+//! \fn void SyncDb::setIndexRows (RecordBatch *rows)
+//! \brief Keep all the books read by loadBookIndex.
+//! The book index keeps the first book of a title, the books are added to
+//! rows in the order they are read, repeated titles included. Used to sync
+//! both directions from one scan, see planBack.
+void SyncDb::setIndexRows (RecordBatch *rows)
+{
+	indexRows = rows;
+}
+
+//! \fn void SyncDb::addToBookIndex (const string& bookTitle,
+//! BookRecord& bRec)
+//! \brief Add a book to the book index.
+//! Used when the books are paired outside loadBookIndex, see
+//! CalibreDb::fetchJoinedRecords. The first book added for a title is kept.
+void SyncDb::addToBookIndex (const string& bookTitle, BookRecord& bRec)
+{
+	indexBook (bookTitle, bRec);
+	indexLoaded = true;
+}
+
+//! \fn void SyncDb::recordIndex (SyncClass *rec, SyncState *state)
+//! \brief Record the values of the books in the book index in state.
+//! \param [in] rec Record to set from each book.
+void SyncDb::recordIndex (SyncClass *rec, SyncState *state)
+{
+	for (unordered_map<string, IndexedBook>::iterator i = bookIndex.begin ();
+		i != bookIndex.end (); ++i)
+	{
+		setRecord (rec, (*i).second.title, (*i).second.book);
+		state->setDest (rec);
+	}
+}
+
+//! \fn void SyncDb::refreshBookIndex (SyncClass *newData)
+//! \brief Update the book index entry after a write.
+//! Keep the index in line with the database so that a later source record
+//! with the same title sees the updated values, as it would have with the
+//! title lookup query.
+void SyncDb::refreshBookIndex (SyncClass *newData)
+{
+	if (indexLoaded != true)
+	{
+		return;
+	}
+
+	unordered_map<string, IndexedBook>::iterator i =
+		bookIndex.find (foldTitle (newData->getTitle ()));
+	if (i == bookIndex.end ())
+	{
+		return;
+	}
+
+	BookRecord& bRec = (*i).second.book;
+	bRec.linkId = newData->getLinkId ();
+	bRec.rating = newData->getRating ();
+	bRec.state = newData->getState ();
+	bRec.flags = newData->getFlags ();
+}
+
+//! Open the DB read only.
+void SyncDb::setReadOnly (bool val)
+{
+	readOnly = val;
+}
+
+//! \fn int SyncDb::openDB (char *fName)
+//! \brief Open the SQLite DB file, read only if SyncDb::setReadOnly is set.
+int SyncDb::openDB (char *fName)
+{
+	int retVal;
+	int flags;
+
+	if (readOnly == true)
+	{
+		flags = SQLITE_OPEN_READONLY;
+	}
+	else
+	{
+		flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+	}
+
+	retVal = sqlite3_open_v2 (fName, &dbPtr, flags, 0);
+	if (SQLITE_OK != retVal)
+	{
+		jERR ("Opening [" << fName << "] failed " << sqlite3_errmsg (dbPtr));
+		return FAIL;
+	}
+
+	//! Register the hash functions used by the fingerprint and the title
+	//! tree, see queryDataHash and queryLeafHashes.
+	retVal = sqlite3_create_function (dbPtr, "sync_hash", -1,
+		SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, 0, syncHashStep,
+		syncHashFinal);
+	if (retVal == SQLITE_OK)
+	{
+		retVal = sqlite3_create_function (dbPtr, "sync_leaf", 2,
+			SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, syncLeafFunc, 0, 0);
+	}
+	if (retVal == SQLITE_OK)
+	{
+		retVal = sqlite3_create_function (dbPtr, "sync_dirty", 1,
+			SQLITE_UTF8, this, syncDirtyFunc, 0, 0);
+	}
+	if (retVal != SQLITE_OK)
+	{
+		jERR ("Creating the sync functions failed with error [" << retVal
+			<< "] " << sqlite3_errmsg (dbPtr));
+		return FAIL;
+	}
+
+	return SUCCESS;
+}
+
+//! \fn int SyncDb::execSql (const char *sql)
+//! \brief Execute an SQL statement that does not return rows.
+int SyncDb::execSql (const char *sql)
+{
+	int retVal;
+	char *errMsg = 0;
+
+	jDBG ("SQL : " << sql);
+	retVal = sqlite3_exec (dbPtr, sql, 0, 0, &errMsg);
+	if (retVal != SQLITE_OK)
+	{
+		jERR ("[" << sql << "] failed with error [" << retVal << "] "
+			<< (errMsg ? errMsg : ""));
+		sqlite3_free (errMsg);
+		return FAIL;
+	}
+	return SUCCESS;
+}
+
+//! \fn void SyncDb::setIdRange (int lo, int hi)
+//! \brief Limit the records fetched to the books with ids lo to hi.
+//! Must be called before setupDbStmts, used to scan a DB in shards.
+void SyncDb::setIdRange (int lo, int hi)
+{
+	idRange = true;
+	rangeLo = lo;
+	rangeHi = hi;
+}
+
+//! \fn int SyncDb::queryIdBounds (const char *qry, int *minId, int *maxId)
+//! \brief Run a query returning the lowest and the highest book id.
+//! \return SUCCESS, NO_DATA if there are no books or FAIL.
+int SyncDb::queryIdBounds (const char *qry, int *minId, int *maxId)
+{
+	int retVal;
+
+	sqlite3_stmt *boundsStmt;
+	const char *boundsTrail;
+
+	jDBG ("SQL : boundsStmt prepare");
+	retVal = sqlite3_prepare_v2 (dbPtr, qry, -1, &boundsStmt, &boundsTrail);
+	if (retVal != SQLITE_OK)
+	{
+		jERR ("Prepare statement for boundsStmt failed with error ["
+			<< retVal << "] " << sqlite3_errmsg (dbPtr));
+		return FAIL;
+	}
+
+	retVal = sqlite3_step (boundsStmt);
+	if (retVal != SQLITE_ROW)
+	{
+		jERR ("Fetching the book id bounds failed " << sqlite3_errmsg (dbPtr));
+		sqlite3_finalize (boundsStmt);
+		return FAIL;
+	}
+
+	if (sqlite3_column_type (boundsStmt, 0) == SQLITE_NULL)
+	{
+		sqlite3_finalize (boundsStmt);
+		return NO_DATA;
+	}
+
+	*minId = sqlite3_column_int (boundsStmt, 0);
+	*maxId = sqlite3_column_int (boundsStmt, 1);
+	sqlite3_finalize (boundsStmt);
+	return SUCCESS;
+}
+
+//! \fn int SyncDb::queryDataHash (const char *qry, string& hash)
+//! \brief Run a query returning the hashes of the synced data.
+//! The query can use the sync_hash aggregate, the columns of the single
+//! row returned are joined into hash.
+int SyncDb::queryDataHash (const char *qry, string& hash)
+{
+	int retVal;
+
+	sqlite3_stmt *hashStmt;
+	const char *hashTrail;
+
+	jDBG ("SQL : hashStmt prepare");
+	retVal = sqlite3_prepare_v2 (dbPtr, qry, -1, &hashStmt, &hashTrail);
+	if (retVal != SQLITE_OK)
+	{
+		jERR ("Prepare statement for hashStmt failed with error ["
+			<< retVal << "] " << sqlite3_errmsg (dbPtr));
+		return FAIL;
+	}
+
+	retVal = sqlite3_step (hashStmt);
+	if (retVal != SQLITE_ROW)
+	{
+		jERR ("Hashing the book data failed " << sqlite3_errmsg (dbPtr));
+		sqlite3_finalize (hashStmt);
+		return FAIL;
+	}
+
+	hash.clear ();
+	for (int i = 0; i < sqlite3_column_count (hashStmt); i++)
+	{
+		if (i != 0)
+		{
+			hash += ":";
+		}
+		hash += (char *) sqlite3_column_text (hashStmt, i);
+	}
+	sqlite3_finalize (hashStmt);
+	return SUCCESS;
+}
+
+//! \fn void SyncDb::setLeafFilter (vector<bool> *dirty, int bits)
+//! \brief Fetch and index only the books in the marked title tree leaves.
+//! Must be called before setupDbStmts. The leaves are checked when the
+//! books are fetched, dirty can be filled after the statements are
+//! prepared. See SyncTree.
+void SyncDb::setLeafFilter (vector<bool> *dirty, int bits)
+{
+	leafFilter = dirty;
+	leafBits = bits;
+}
+
+//! \fn bool SyncDb::inLeafFilter (const unsigned char *title, int len)
+//! \brief Check if a title is in a marked leaf, see setLeafFilter.
+bool SyncDb::inLeafFilter (const unsigned char *title, int len)
+{
+	if ((leafFilter == 0) || (leafFilter->empty () == true))
+	{
+		return false;
+	}
+	unsigned int h = titleHash (title, len);
+	return (*leafFilter)[(leafBits == 0) ? 0 : (h >> (32 - leafBits))];
+}
+
+//! \fn int SyncDb::createStdFunctions (SyncClass *rec,
+//! const char *ratingFunc, const char *stateFunc)
+//! \brief Create the SQL functions converting the DB values of rec.
+//! ratingFunc (rating) is the standard rating of a DB rating and
+//! stateFunc (state) the standard state of a DB state, see
+//! syncStdRatingFunc and syncStdStateFunc. rec needs the rating and state
+//! lookups and must be kept while the statements using them run.
+int SyncDb::createStdFunctions (SyncClass *rec, const char *ratingFunc,
+	const char *stateFunc)
+{
+	int retVal;
+
+	retVal = sqlite3_create_function (dbPtr, ratingFunc, 1, SQLITE_UTF8, rec,
+		syncStdRatingFunc, 0, 0);
+	if (retVal == SQLITE_OK)
+	{
+		retVal = sqlite3_create_function (dbPtr, stateFunc, 1, SQLITE_UTF8,
+			rec, syncStdStateFunc, 0, 0);
+	}
+	if (retVal != SQLITE_OK)
+	{
+		jERR ("Creating the standard value functions failed with error ["
+			<< retVal << "] " << sqlite3_errmsg (dbPtr));
+		return FAIL;
+	}
+	return SUCCESS;
+}
+
+//! \fn int SyncDb::queryLeafHashes (SyncClass *rec, const char *qry,
+//! int bits, vector<TreeLeaf>& leaves)
+//! \brief Run a query returning the hashes of the title tree leaves.
+//! The query returns the leaf, the number of books, the number of titles
+//! and the hash of each leaf with books. The sync_std_rating and
+//! sync_std_state functions convert the DB values with rec.
+int SyncDb::queryLeafHashes (SyncClass *rec, const char *qry, int bits,
+	vector<TreeLeaf>& leaves)
+{
+	int retVal;
+
+	sqlite3_stmt *leafStmt;
+	const char *leafTrail;
+
+	if (createStdFunctions (rec, "sync_std_rating", "sync_std_state")
+		!= SUCCESS)
+	{
+		return FAIL;
+	}
+
+	jDBG ("SQL : leafStmt prepare");
+	retVal = sqlite3_prepare_v2 (dbPtr, qry, -1, &leafStmt, &leafTrail);
+	if (retVal != SQLITE_OK)
+	{
+		jERR ("Prepare statement for leafStmt failed with error ["
+			<< retVal << "] " << sqlite3_errmsg (dbPtr));
+		return FAIL;
+	}
+
+	TreeLeaf empty;
+	empty.hash = 0;
+	empty.books = 0;
+	empty.titles = 0;
+	leaves.assign (1 << bits, empty);
+	while ((retVal = sqlite3_step (leafStmt)) == SQLITE_ROW)
+	{
+		TreeLeaf& leaf = leaves[sqlite3_column_int (leafStmt, 0)];
+		leaf.books = sqlite3_column_int (leafStmt, 1);
+		leaf.titles = sqlite3_column_int (leafStmt, 2);
+		leaf.hash = sqlite3_column_int64 (leafStmt, 3);
+	}
+	sqlite3_finalize (leafStmt);
+	if (retVal != SQLITE_DONE)
+	{
+		jERR ("Hashing the title tree leaves failed "
+			<< sqlite3_errmsg (dbPtr));
+		return FAIL;
+	}
+	return SUCCESS;
+}
+
+//! \fn int SyncDb::updateBook (SyncClass *newData, bool rate, bool state)
+//! \brief Update the rating and/or the state of a book.
+int SyncDb::updateBook (SyncClass *newData, bool rate, bool state)
+{
+	int retVal;
+
+	if (rate)
+	{
+		retVal = updateRating (newData);
+		if (retVal != SUCCESS)
+		{
+			jERR ("Updating the rating failed for " << newData->getTitle());
+			return FAIL;
+		}
+	}
+
+	if (state)
+	{
+		retVal = updateState (newData);
+		if (retVal != SUCCESS)
+		{
+			jERR ("Updating the state failed for " << newData->getTitle());
+			return FAIL;
+		}
+	}
+	return SUCCESS;
+}
+
+//! \fn void SyncDb::setCommitEvery (int n)
+//! \brief Set the number of books to update per transaction.
+//! With 0, the default, all the updates of the run are made in a single
+//! transaction.
+void SyncDb::setCommitEvery (int n)
+{
+	commitEvery = n;
 }
 
+//! \fn int SyncDb::beginTransaction (void)
+//! \brief Begin a transaction for the updates.
+//! In autocommit mode every update statement is a transaction of its own,
+//! which costs a journal write and a few fsyncs per book. The updates are
+//! grouped into explicit transactions instead, see SyncDb::bookUpdated.
+int SyncDb::beginTransaction (void)
+{
+	int retVal;
 
-int SyncDb::setCustomStatePresent (bool val)
+	if (inTransaction == true)
+	{
+		return SUCCESS;
+	}
+
+	retVal = execSql ("begin immediate transaction");
+	if (retVal != SUCCESS)
+	{
+		return FAIL;
+	}
+
+	inTransaction = true;
+	pendingBooks = 0;
+	return SUCCESS;
+}
+
+//! \fn int SyncDb::commitTransaction (void)
+//! \brief Commit the open transaction.
+int SyncDb::commitTransaction (void)
 {
-	customStatePresent = val;
+	int retVal;
+
+	if (inTransaction != true)
+	{
+		return SUCCESS;
+	}
+
+	if (staging == true)
+	{
+		//! The staged changes of the batch are applied before the commit.
+		retVal = applyStaged ();
+		if (retVal != SUCCESS)
+		{
+			return FAIL;
+		}
+	}
+
+	retVal = execSql ("commit transaction");
+	if (retVal != SUCCESS)
+	{
+		return FAIL;
+	}
+
+	inTransaction = false;
+	if (pendingBooks > 0)
+	{
+		commitCount++;
+		committedBooks += pendingBooks;
+	}
+	jDBG ("Committed " << pendingBooks << " book updates.");
+	pendingBooks = 0;
 	return SUCCESS;
 }
 
-//! \fn bool SyncDb::getCustomStatePresent (void)
-//! \brief Check if custom state is present.
-//! Check if custom state is present. Based on the availability of this
-//! field certain processes that involve custom state are performed.
-//! \return True if custom state is present.
-bool SyncDb::getCustomStatePresent (void)
+//! \fn int SyncDb::rollbackTransaction (void)
+//! \brief Roll back the open transaction.
+//! All the updates made since the last commit are discarded.
+int SyncDb::rollbackTransaction (void)
 {
-	return customStatePresent;
+	int retVal;
+
+	if (inTransaction != true)
+	{
+		return SUCCESS;
+	}
+
+	retVal = execSql ("rollback transaction");
+	inTransaction = false;
+	if (staging == true)
+	{
+		execSql ("delete from temp.sync_changes");
+	}
+	jWARN ("Rolled back " << pendingBooks << " book updates.");
+	pendingBooks = 0;
+	return retVal;
+}
+
+//! \fn int SyncDb::bookUpdated (void)
+//! \brief Record a book update, commit the batch if it is full.
+int SyncDb::bookUpdated (void)
+{
+	int retVal;
+
+	pendingBooks++;
+	if ((commitEvery > 0) && (pendingBooks >= commitEvery))
+	{
+		retVal = commitTransaction ();
+		if (retVal != SUCCESS)
+		{
+			return FAIL;
+		}
+
+		retVal = beginTransaction ();
+		if (retVal != SUCCESS)
+		{
+			return FAIL;
+		}
+	}
+	return SUCCESS;
+}
+
+//! Get the number of committed transactions.
+int SyncDb::getCommitCount (void)
+{
+	return commitCount;
+}
+
+//! Get the number of books updated in the committed transactions.
+int SyncDb::getCommittedBooks (void)
+{
+	return committedBooks;
+}
+
+//! \fn int SyncDb::setupStaging (void)
+//! \brief Stage the updates in a temp table and apply them in bulk.
+//! Instead of running an update statement per book, the write methods
+//! record the new values in the temp table sync_changes on the destination
+//! connection. The changes are applied with a few set based statements when
+//! the transaction is committed, see applyStaged.
+int SyncDb::setupStaging (void)
+{
+	int retVal;
+
+	jFNTRY ();
+	retVal = execSql ("create temp table if not exists sync_changes ("
+		"book integer primary key, rating integer, state integer, "
+		"flags integer)");
+	if (retVal != SUCCESS)
+	{
+		return FAIL;
+	}
+
+	//! Changes of the same book are merged into one row.
+	jDBG ("SQL : stageStmt prepare");
+	retVal = sqlite3_prepare_v2 (dbPtr,
+		"insert into temp.sync_changes (book, rating, state, flags) "
+		"values (:book, :rating, :state, :flags) on conflict (book) do "
+		"update set rating = coalesce (excluded.rating, rating), "
+		"state = coalesce (excluded.state, state), "
+		"flags = coalesce (excluded.flags, flags)",
+		-1, &stageStmt, &stageStmtTrail);
+	if (retVal != SQLITE_OK)
+	{
+		jERR ("Prepare statement for stageStmt failed with error ["
+			<< retVal << "] " << sqlite3_errmsg (dbPtr));
+		return FAIL;
+	}
+
+	staging = true;
+	jFX ();
+	return SUCCESS;
+}
+
+//! \fn int SyncDb::stageChange (int book, int column, int value)
+//! \brief Stage a change in the sync_changes table.
+//! \param [in] book Book id.
+//! \param [in] column STAGE_RATING, STAGE_STATE or STAGE_FLAGS.
+//! \param [in] value The new value for the column.
+int SyncDb::stageChange (int book, int column, int value)
+{
+	int retVal;
+
+	retVal = sqlite3_bind_int (stageStmt, 1, book);
+	for (int i = STAGE_RATING; (retVal == SQLITE_OK) && (i <= STAGE_FLAGS); i++)
+	{
+		if (i == column)
+		{
+			retVal = sqlite3_bind_int (stageStmt, i + 1, value);
+		}
+		else
+		{
+			retVal = sqlite3_bind_null (stageStmt, i + 1);
+		}
+	}
+
+	if (retVal == SQLITE_OK)
+	{
+		retVal = sqlite3_step (stageStmt);
+	}
+	sqlite3_clear_bindings (stageStmt);
+	sqlite3_reset (stageStmt);
+
+	if (retVal != SQLITE_DONE)
+	{
+		jERR ("Staging the change for book id " << book << " failed "
+			<< sqlite3_errmsg (dbPtr));
+		return FAIL;
+	}
+	return SUCCESS;
+}
+
+//! \fn void SyncDb::finalizeStaging (void)
+//! \brief Finalize the staging statement.
+void SyncDb::finalizeStaging (void)
+{
+	if (stageStmt)
+	{
+		jDBG ("SQL : stageStmt finalize");
+		sqlite3_finalize (stageStmt);
+		stageStmt = 0;
+	}
 }
 
 // CalibreDb methods ///////////////////////////////////////
 //! CalibreDb constructor
 CalibreDb::CalibreDb ()
 {
-	dbPtr = 0;
 	cFetchRecordsStmt = 0;
 	cFetchStmtTrail = 0;
-	calibreStateStmt = 0;
 	cGetBookInfStmt = 0;
 	customStatePresent = false;
 	cGetBookInfStmtTrail = 0;
 	cUpdateRatingStmt = 0;
 	cUpdateRatingStmtTrail = 0;
-	cInsRatingStmt = 0;
-	cInsRatingStmtTrail = 0;
 	cUpdateStateStmt = 0;
 	cUpdateStateStmtTrail = 0;
+	cJoinStmt = 0;
+	cJoinStmtTrail = 0;
 	tabId = 0;
+	deltaFetch = false;
 	jTRACE ("CalibreDb constructor");
 }
 
@@ -65,8 +1112,8 @@ int CalibreDb::connectToDB (char *fName)
 	int retVal;
 	jDBG ("CalibreDb::connectToDB [" << fName << "]");
 	jDBG ("SQL : CalibreDb open DB");
-	retVal = sqlite3_open (fName, &dbPtr);
-	if (SQLITE_OK != retVal)
+	retVal = openDB (fName);
+	if (retVal != SUCCESS)
 	{
 		return FAIL;
 	}
@@ -109,19 +1156,53 @@ CalibreDb::~CalibreDb ()
 //! \fn int CalibreDb::setupDbStmts (void)
 //! \brief Prepare the SQL Statements for Calibre
 //! Setup the SQL statements to fetch the book records and book information
-//! from the Calibre db.
+//! from the Calibre db. If the custom state is present, the read state from
+//! the custom column link table is fetched in the same row, otherwise the
+//! state column is null. With a modified since time only the books with a
+//! later last_modified are fetched, see setModifiedSince.
 //! \returns SUCCESS or FAIL
 int CalibreDb::setupDbStmts (void)
 {
 	int retVal;
+	char qry[512];
+	char stateCol[128];
+
 	jFNTRY ();
 
+	memset (stateCol, '\0', 128);
+	if (getCustomStatePresent () == true)
+	{
+		sprintf (stateCol, "(select s.value from books_custom_column_%d_link s "
+			"where s.book = b.id)", getTabId ());
+	}
+	else
+	{
+		sprintf (stateCol, "null");
+	}
+
 	// Prepare the statement to fetch data from Calibre db
+	memset (qry, '\0', 512);
+	sprintf (qry, "select b.title, b.id, r.rating, r.id, %s from books b "
+		"left outer join books_ratings_link r on b.id = r.book", stateCol);
+	const char *cond = "where";
+	if (idRange == true)
+	{
+		sprintf (qry + strlen (qry), " where b.id between %d and %d",
+			rangeLo, rangeHi);
+		cond = "and";
+	}
+	if (modifiedSince.length () != 0)
+	{
+		sprintf (qry + strlen (qry), " %s b.last_modified > :since", cond);
+		cond = "and";
+	}
+	if (leafFilter != 0)
+	{
+		sprintf (qry + strlen (qry), " %s sync_dirty (b.title)", cond);
+	}
+
 	jDBG ("SQL : cFetchRecordsStmt prepare");
-	retVal = sqlite3_prepare_v2 (dbPtr,
-		"select b.title, b.id, r.rating, r.id from books b left outer join "
-		"books_ratings_link r on b.id = r.book",
-		-1, &cFetchRecordsStmt,
+	retVal = sqlite3_prepare_v2 (dbPtr, qry, -1, &cFetchRecordsStmt,
 		&cFetchStmtTrail);
 	if (retVal != SQLITE_OK)
 	{
@@ -130,14 +1211,29 @@ int CalibreDb::setupDbStmts (void)
 		return (FAIL);
 	}
 
+	if (modifiedSince.length () != 0)
+	{
+		int idx = sqlite3_bind_parameter_index (cFetchRecordsStmt, ":since");
+		retVal = sqlite3_bind_text (cFetchRecordsStmt, idx,
+			modifiedSince.c_str (), -1, SQLITE_TRANSIENT);
+		if (retVal != SQLITE_OK)
+		{
+			jERR ("Binding for cFetchRecordsStmt failed with error ["
+				<< retVal << "] " << sqlite3_errmsg (dbPtr));
+			return FAIL;
+		}
+	}
+
 	// Prepare the statement to fetch the book info from Calibre db
 	// for the given id
 	jDBG ("SQL : cGetBookInfStmt prepare");
 
-	retVal = sqlite3_prepare_v2 (dbPtr,
-	"select b.title, b.id, r.rating, r.id from books b left outer join " 
-	" books_ratings_link r on b.id = r.book where b.title = :calTitle",
-			-1, &cGetBookInfStmt, &cGetBookInfStmtTrail);
+	memset (qry, '\0', 512);
+	sprintf (qry, "select b.title, b.id, r.rating, r.id, %s from books b "
+		"left outer join books_ratings_link r on b.id = r.book "
+		"where b.title = :calTitle", stateCol);
+	retVal = sqlite3_prepare_v2 (dbPtr, qry, -1, &cGetBookInfStmt,
+		&cGetBookInfStmtTrail);
 	if (retVal != SQLITE_OK)
 	{
 		jERR ("Prepare statemnt for cGetBookInfStmt failed with error ["
@@ -145,9 +1241,15 @@ int CalibreDb::setupDbStmts (void)
 		return FAIL;
 	}
 
+	// books_ratings_link is only unique on (book, rating), so the upsert
+	// conflicts on the id of the existing link row of the book. A book
+	// without a rating gets a null id and a new link row.
 	jDBG ("SQL : cUpdateRatingStmt prepare");
 	retVal = sqlite3_prepare_v2 (dbPtr,
-		"update books_ratings_link set rating = :rating where book = :book",
+		"insert into books_ratings_link (id, book, rating) values "
+		"((select l.id from books_ratings_link l where l.book = :book), "
+		":book, :rating) on conflict (id) do update set "
+		"rating = excluded.rating",
 		-1, &cUpdateRatingStmt, &cUpdateRatingStmtTrail);
 	if (retVal != SQLITE_OK)
 	{
@@ -156,35 +1258,6 @@ int CalibreDb::setupDbStmts (void)
 		return FAIL;
 	}
 
-	jDBG ("SQL : cInsRatingStmt prepare");
-	retVal = sqlite3_prepare_v2 (dbPtr,
-		"insert into books_ratings_link (book, rating) values "
-		"(:cbookId, :cRating)", -1, &cInsRatingStmt, &cInsRatingStmtTrail);
-	if (retVal != SQLITE_OK)
-	{
-		jERR ("Prepare statemnt for cInsRatingStmt failed with error ["
-				<< retVal << "]" << sqlite3_errmsg (dbPtr));
-		return FAIL;
-	}
-
-	char qry[255];
-	int tabId;
-
-	tabId = getTabId ();
-	memset (qry, '\0', 255);
-	sprintf (qry, "update books_custom_column_%d_link set value = :cState "
-	"where book = :csBookId", tabId);
-
-	jDBG ("SQL : cUpdateStateStmt prepare");
-	retVal = sqlite3_prepare_v2 (dbPtr, qry,
-		-1, &cUpdateStateStmt, &cUpdateStateStmtTrail);
-	if (retVal != SQLITE_OK)
-	{
-		jERR ("Prepare statemnt for cUpdateStateStmt failed with error ["
-				<< retVal << "]" << sqlite3_errmsg (dbPtr));
-		return FAIL;
-	}
-
 	jFX ();
 	return SUCCESS;
 }
@@ -215,20 +1288,14 @@ int CalibreDb::finalizeStmts (void)
 		cUpdateRatingStmt = 0;
 	}
 
-	if (cInsRatingStmt)
-	{
-		jDBG ("SQL : cInsRatingStmt finalize");
-		sqlite3_finalize (cInsRatingStmt);
-		cInsRatingStmt = 0;
-	}
-
-	if (cUpdateStateStmt)
+	if (cJoinStmt)
 	{
-		jDBG ("SQL : cUpdateStateStmt finalize");
-		sqlite3_finalize (cUpdateStateStmt);
-		cUpdateStateStmt = 0;
+		jDBG ("SQL : cJoinStmt finalize");
+		sqlite3_finalize (cJoinStmt);
+		cJoinStmt = 0;
 	}
 
+	finalizeStaging ();
 	return SUCCESS;
 }
 
@@ -238,7 +1305,6 @@ int CalibreDb::fetchRecords (SyncClass *cRec)
 {
 	int retVal;
 
-	char cTitle[TITLE_LEN];
 	int cId;
 	int cRating;
 	int linkId; // Id from books_ratings_link table.
@@ -252,31 +1318,38 @@ int CalibreDb::fetchRecords (SyncClass *cRec)
 		return NO_DATA;
 	}
 
-	strcpy (cTitle,  (char *) sqlite3_column_text (cFetchRecordsStmt, 0));
 	cId = sqlite3_column_int (cFetchRecordsStmt, 1);
 	cRating = sqlite3_column_int (cFetchRecordsStmt, 2);
-	linkId = sqlite3_column_int (cFetchRecordsStmt, 3);
+	if (sqlite3_column_type (cFetchRecordsStmt, 3) == SQLITE_NULL)
+	{
+		//! No rating link, as in loadBookIndex.
+		linkId = -1;
+	}
+	else
+	{
+		linkId = sqlite3_column_int (cFetchRecordsStmt, 3);
+	}
 
 	cRec->setId (cId);
-	cRec->setTitle (cTitle);
+	cRec->setTitle (columnText (cFetchRecordsStmt, 0));
 	cRec->setRating (cRating);
 	cRec->setLinkId (linkId);
 
 	if (cRec->getCustomStatePresent () == true)
 	{
 		int cState;
-		retVal = getCalibreStateInfo (cId, &cState);
-		if (retVal != SUCCESS)
+		if (sqlite3_column_type (cFetchRecordsStmt, 4) == SQLITE_NULL)
 		{
-			jERR ("getCalibreStateInfo failed");
-			return FAIL;
+			cState = -1;
+		}
+		else
+		{
+			cState = sqlite3_column_int (cFetchRecordsStmt, 4);
 		}
 		cRec->setState (cState);
 
-		// Find the State text
-		string stateText;
-		stateText = cRec->stateToText (cState);
-		cRec->setStateText (stateText);
+		// Find the standard state from the State text
+		cRec->setStdState (cRec->findStdState (cRec->stateToText (cState)));
 	}
 
 	// jLOG ("Title [" << cTitle << "] id [" << cId << "]");
@@ -285,9 +1358,67 @@ int CalibreDb::fetchRecords (SyncClass *cRec)
 	return SUCCESS;
 }
 
-//! \fn int CalibreDb::getBookInfo (SyncClass *cRec, string rTitle)
+//! \fn int CalibreDb::fetchBatch (RecordBatch& batch, size_t rows)
+//! \brief Fetch the next Calibre records into a batch.
+//! The columns are read straight into the batch, the rating and state are
+//! translated by the match stage, see CalibreDb::setRecord.
+//! \param [in] rows Number of records to fetch, 0 for all.
+//! \return SUCCESS if rows records were added, NO_DATA at the end of the
+//! records, with the records fetched before in the batch, FAIL on error.
+int CalibreDb::fetchBatch (RecordBatch& batch, size_t rows)
+{
+	int retVal;
+	BookRecord bRec;
+
+	bRec.state = 0;
+	bRec.flags = 0;
+	for (size_t n = 0; (rows == 0) || (n < rows); n++)
+	{
+		retVal = sqlite3_step (cFetchRecordsStmt);
+		if (retVal == SQLITE_DONE)
+		{
+			return NO_DATA;
+		}
+		if (retVal != SQLITE_ROW)
+		{
+			jERR ("Fetching the Calibre records failed "
+				<< sqlite3_errmsg (dbPtr));
+			return FAIL;
+		}
+
+		bRec.id = sqlite3_column_int (cFetchRecordsStmt, 1);
+		bRec.rating = sqlite3_column_int (cFetchRecordsStmt, 2);
+		if (sqlite3_column_type (cFetchRecordsStmt, 3) == SQLITE_NULL)
+		{
+			//! No rating link, as in loadBookIndex.
+			bRec.linkId = -1;
+		}
+		else
+		{
+			bRec.linkId = sqlite3_column_int (cFetchRecordsStmt, 3);
+		}
+		if (customStatePresent == true)
+		{
+			if (sqlite3_column_type (cFetchRecordsStmt, 4) == SQLITE_NULL)
+			{
+				bRec.state = -1;
+			}
+			else
+			{
+				bRec.state = sqlite3_column_int (cFetchRecordsStmt, 4);
+			}
+		}
+
+		batch.addRow (columnText (cFetchRecordsStmt, 0), bRec);
+	}
+	return SUCCESS;
+}
+
+//! \fn int CalibreDb::getBookInfo (SyncClass *cRec, const string& rTitle)
 //! \brief Get the book info from Calibre DB.
-int CalibreDb::getBookInfo (SyncClass *cRec, string rTitle)
+//! The title is bound without a copy, the binding is cleared before
+//! returning.
+int CalibreDb::getBookInfo (SyncClass *cRec, const string& rTitle)
 {
 	int idx;
 	int retVal;
@@ -295,6 +1426,23 @@ int CalibreDb::getBookInfo (SyncClass *cRec, string rTitle)
 	// jTRACE ("CalibreDb::getBookInfo");	
 
 	// jFNTRY ();
+	if (indexLoaded == true)
+	{
+		//! Use the book index instead of the title lookup query if the
+		//! index is loaded.
+		IndexedBook *book = findBook (rTitle);
+		if (book == 0)
+		{
+			cRec->setId (0);
+			return (NO_DATA);
+		}
+
+		//! The record gets the title as stored in the DB, as with the
+		//! title lookup query.
+		setRecord (cRec, book->title, book->book);
+		return SUCCESS;
+	}
+
 	idx = sqlite3_bind_parameter_index (cGetBookInfStmt, ":calTitle");
 	if (!idx)
 	{
@@ -302,11 +1450,8 @@ int CalibreDb::getBookInfo (SyncClass *cRec, string rTitle)
 		return (FAIL);
 	}
 
-	char title[TITLE_LEN];
-	memset (title, '\0', TITLE_LEN);
-	strcpy (title, rTitle.c_str ());
-	retVal = sqlite3_bind_text (cGetBookInfStmt, idx, title, -1, 
-		SQLITE_TRANSIENT);
+	retVal = sqlite3_bind_text (cGetBookInfStmt, idx, rTitle.data (),
+		rTitle.length (), SQLITE_STATIC);
 	if (retVal != SQLITE_OK)
 	{
 		jERR ("Binding for calibreId failed");
@@ -327,9 +1472,6 @@ int CalibreDb::getBookInfo (SyncClass *cRec, string rTitle)
 		return (NO_DATA);
 	}
 
-	memset (title, '\0', TITLE_LEN);
-	strcpy (title, (char *) sqlite3_column_text (cGetBookInfStmt, 0));
-
 	int id;
 	id = sqlite3_column_int (cGetBookInfStmt, 1);
 
@@ -357,25 +1499,25 @@ int CalibreDb::getBookInfo (SyncClass *cRec, string rTitle)
 
 
 	cRec->setId (id);
-	cRec->setTitle (title);
+	cRec->setTitle (columnText (cGetBookInfStmt, 0));
 	cRec->setRating (rating);
 	cRec->setLinkId (linkId);
 
 	if (cRec->getCustomStatePresent () == true)
 	{
 		int cState;
-		retVal = getCalibreStateInfo (id, &cState);
-		if (retVal != SUCCESS)
+		if (sqlite3_column_type (cGetBookInfStmt, 4) == SQLITE_NULL)
 		{
-			jERR ("getCalibreStateInfo failed");
-			return FAIL;
+			cState = -1;
+		}
+		else
+		{
+			cState = sqlite3_column_int (cGetBookInfStmt, 4);
 		}
 		cRec->setState (cState);
 
-		// Get the state text.
-		string stateText;
-		stateText = cRec->stateToText (cState);
-		cRec->setStateText (stateText);
+		// Get the standard state from the state text.
+		cRec->setStdState (cRec->findStdState (cRec->stateToText (cState)));
 	}
 
 	// Clear the bindings.
@@ -451,93 +1593,47 @@ int CalibreDb::getCustomTabId (string stateFName, int *tabId)
 }
 
 //! \fn int CalibreDb::setupStateOps (int tabId)
-//! \brief Statements for finding the state info.
+//! \brief Prepare the statements for the custom state column.
+//! The read state is fetched along with the book records, see
+//! CalibreDb::setupDbStmts. This prepares the statement to upsert the state
+//! in the custom column link table, keyed on the id of the book's link row
+//! as the link table is only unique on (book, value).
 int CalibreDb::setupStateOps (int tabId)
 {
-	char qry[255];
+	char qry[512];
 	int retVal;
 
-	const char *cStateTrail;	
-
 	jFNTRY ();
-	memset (qry, '\0', 255);
-	sprintf (qry,
-			"select b.id, r.value from books b left outer join "
-			"books_custom_column_%d_link r on  b.id = r.book "
-			"where b.id = :bookId", tabId);
-	jDBG ("State Qry is [" <<  qry << "]");
-	jDBG ("SQL : calibreStateStmt prepare");
-	retVal = sqlite3_prepare_v2 (dbPtr, qry, -1,
-			&calibreStateStmt, &cStateTrail);
-	if (retVal != SQLITE_OK)
-	{
-		jERR ("Prepare for state select statement failed " << retVal <<
-				", " <<  sqlite3_errmsg (dbPtr));
-		return (FAIL);
-	}
-
-	jFX ();
-	return SUCCESS;
-}
-
-//! \fn int CalibreDb::getCalibreStateInfo (int id, int *state)
-//! \brief Get the state info from the Calibre DB for the given Book id.
-int CalibreDb::getCalibreStateInfo (int id, int *state)
-{
-	// Get the state info from the Calibre DB for the given Book id.
-	int retVal;
-	int idx;
-	
-	idx = sqlite3_bind_parameter_index (calibreStateStmt, ":bookId");
-	if (!idx)
-	{
-		jERR ("Look up for bookId failed"); 
-		return (FAIL);
-	}
-	retVal = sqlite3_bind_int (calibreStateStmt, idx, id);
-	if (retVal != SQLITE_OK)
-	{
-		jERR ("Binding for bookId failed\n"); 
-		sqlite3_clear_bindings (calibreStateStmt);
-		sqlite3_reset (calibreStateStmt);
-		return (FAIL);
-	}
-
-	retVal = sqlite3_step (calibreStateStmt);
-	if (retVal != SQLITE_ROW)
-	{
-		jERR ("Error fetching state info for book id [" << id << "]");
-		sqlite3_clear_bindings (calibreStateStmt);
-		sqlite3_reset (calibreStateStmt);
-		return (NO_DATA);
-	}
+	memset (qry, '\0', 512);
+	sprintf (qry, "insert into books_custom_column_%d_link (id, book, value) "
+		"values ((select l.id from books_custom_column_%d_link l "
+		"where l.book = :csBookId), :csBookId, :cState) "
+		"on conflict (id) do update set value = excluded.value",
+		tabId, tabId);
 
-	if (sqlite3_column_type (calibreStateStmt, 1) ==  SQLITE_NULL)
-	{
-		*state = -1;
-	}
-	else
+	jDBG ("SQL : cUpdateStateStmt prepare");
+	retVal = sqlite3_prepare_v2 (dbPtr, qry,
+		-1, &cUpdateStateStmt, &cUpdateStateStmtTrail);
+	if (retVal != SQLITE_OK)
 	{
-		*state = sqlite3_column_int (calibreStateStmt, 1);
+		jERR ("Prepare statemnt for cUpdateStateStmt failed with error ["
+				<< retVal << "]" << sqlite3_errmsg (dbPtr));
+		return FAIL;
 	}
-	//  jDBG ("Calibre State [" << *state << "]");
-
-	sqlite3_clear_bindings (calibreStateStmt);
-	sqlite3_reset (calibreStateStmt);
-	return (SUCCESS);
 
+	jFX ();
+	return SUCCESS;
 }
 
-
 //! \fn int CalibreDb::finalizeStateOps (void)
 //! \brief Finalize statements related to the state info.
 int CalibreDb::finalizeStateOps (void)
 {
-	if (calibreStateStmt)
+	if (cUpdateStateStmt)
 	{
-		jDBG ("SQL : calibreStateStmt finalize");
-		sqlite3_finalize (calibreStateStmt);
-		calibreStateStmt = 0;
+		jDBG ("SQL : cUpdateStateStmt finalize");
+		sqlite3_finalize (cUpdateStateStmt);
+		cUpdateStateStmt = 0;
 	}
 	return SUCCESS;
 }
@@ -548,7 +1644,6 @@ int CalibreDb::loadReadState (int tabId, map<int, string>& cStates)
 {
 	int retVal;
 	char qry[255];
-	char stateName[20];
 
 	sqlite3_stmt *stateNameStmt;
 	const char *stateNameTrail;
@@ -586,11 +1681,10 @@ int CalibreDb::loadReadState (int tabId, map<int, string>& cStates)
 		}
 		int stateNum;
 		stateNum = sqlite3_column_int (stateNameStmt, 0);
-		strcpy (stateName,
-				(char *) sqlite3_column_text (stateNameStmt, 1));
+		string_view stateName = columnText (stateNameStmt, 1);
 
 		// jDBG ("Fetched id [" << stateNum << "] name [" << stateName);
-		cStates[stateNum] = stateName;
+		cStates[stateNum].assign (stateName.data (), stateName.length ());
 	}
 	jDBG ("SQL : stateNameStmt finalize");
 	sqlite3_finalize (stateNameStmt);
@@ -665,12 +1759,19 @@ int CalibreDb::loadRatingIds (map<int, int>& cRates)
 
 //! \fn int CalibreDb::updateRating (SyncClass *newData)
 //! \brief Update the rating of the book in the Calibre DB.
+//! The rating link row is inserted if the book does not have one yet.
 int CalibreDb::updateRating (SyncClass *newData)
 {
 	int retVal;
 	int idx;
 	// jFNTRY ();
 
+	if (staging == true)
+	{
+		return stageChange (newData->getId (), STAGE_RATING,
+			newData->getRating ());
+	}
+
 	idx = sqlite3_bind_parameter_index (cUpdateRatingStmt, ":rating");
 	if (!idx)
 	{
@@ -705,7 +1806,7 @@ int CalibreDb::updateRating (SyncClass *newData)
 		return (FAIL);
 	}
 
-	jDBG ("Updating rating to " << newRating << " for bookid " << newBookId);
+	jDBG ("Upserting rating " << newRating << " for bookid " << newBookId);
 	retVal = sqlite3_step (cUpdateRatingStmt);
 	if (retVal != SQLITE_DONE)
 	{
@@ -722,146 +1823,655 @@ int CalibreDb::updateRating (SyncClass *newData)
 	return SUCCESS;
 }
 
-//! \fn int CalibreDb::insertRating (SyncClass *newData)
-//! \brief Insert the rating of the book in the Calibre DB.
-int CalibreDb::insertRating (SyncClass *newData)
+//! \fn int CalibreDb::updateState (SyncClass *newData)
+//! \brief Update the state of the book in the Calibre DB.
+//! The state link row is inserted if the book does not have one yet.
+int CalibreDb::updateState (SyncClass* newData)
 {
-	// jFNTRY ();
+	jFNTRY ();
+	int lBook;
+	int lState;
+	
 	int retVal;
 	int idx;
 
-	idx = sqlite3_bind_parameter_index (cInsRatingStmt, ":cbookId");
+	lBook =  newData->getId ();
+	lState = newData->getState ();
+
+	if (staging == true)
+	{
+		retVal = stageChange (lBook, STAGE_STATE, lState);
+		jFX ();
+		return retVal;
+	}
+
+	idx = sqlite3_bind_parameter_index (cUpdateStateStmt, ":cState");
 	if (!idx)
 	{
-		jERR ("Lookup for cbookId failed");
+		jERR ("Look up for cState failed");
 		return FAIL;
 	}
-	int lBookId = newData->getId ();
-	retVal = sqlite3_bind_int (cInsRatingStmt, idx, lBookId);
+
+	retVal = sqlite3_bind_int (cUpdateStateStmt, idx, lState);
 	if (retVal != SQLITE_OK)
 	{
-		jERR ("Binding for cbookId failed");
-		sqlite3_clear_bindings (cInsRatingStmt);
-		sqlite3_reset (cInsRatingStmt);
+		jERR ("Binding for cState failed");
+		sqlite3_clear_bindings (cUpdateStateStmt);
+		sqlite3_reset (cUpdateStateStmt);
 		return FAIL;
 	}
 
-	idx = sqlite3_bind_parameter_index (cInsRatingStmt, ":cRating");
+	idx = sqlite3_bind_parameter_index (cUpdateStateStmt, ":csBookId");
 	if (!idx)
 	{
-		jERR ("Lookup for cRating failed");
+		jERR ("Look up for csBookId failed");
 		return FAIL;
 	}
-	int lRating = newData->getRating ();
-	retVal = sqlite3_bind_int (cInsRatingStmt, idx, lRating);
+
+	retVal = sqlite3_bind_int (cUpdateStateStmt, idx, lBook);
 	if (retVal != SQLITE_OK)
 	{
-		jERR ("Binding for cRating failed");
-		sqlite3_clear_bindings (cInsRatingStmt);
-		sqlite3_reset (cInsRatingStmt);
+		jERR ("Binding for csBookId failed");
+		sqlite3_clear_bindings (cUpdateStateStmt);
+		sqlite3_reset (cUpdateStateStmt);
 		return FAIL;
 	}
 
-	jDBG ("Inserting rating for " << lBookId << ", Rating : " << lRating);
-	retVal = sqlite3_step (cInsRatingStmt);
-    if (retVal != SQLITE_DONE)
-    {
-        jERR ("Calibre rating insert failed");
-        sqlite3_clear_bindings (cInsRatingStmt);
-        sqlite3_reset (cInsRatingStmt);
-        return (FAIL);
-    }
+	jDBG ("Updating state for book id " << lBook << " State = " << lState);
+	retVal = sqlite3_step (cUpdateStateStmt);
+	if (retVal != SQLITE_DONE)
+	{
+		jERR ("Calibre state updated failed "
+			<< sqlite3_errmsg (dbPtr));
+		sqlite3_clear_bindings (cUpdateStateStmt);
+		sqlite3_reset (cUpdateStateStmt);
+		return FAIL;
+	}
 
-	sqlite3_clear_bindings (cInsRatingStmt);
-	sqlite3_reset (cInsRatingStmt);
+	sqlite3_clear_bindings (cUpdateStateStmt);
+	sqlite3_reset (cUpdateStateStmt);
 
-	// jFX ();
+	jFX ();
 	return SUCCESS;
 }
 
-int CalibreDb::updateState (SyncClass* newData)
+//! \fn int CalibreDb::loadBookIndex (void)
+//! \brief Load all the Calibre books into the book index.
+//! Scan the books table once and index the books by title so that
+//! getBookInfo does not have to run a title lookup query (books.title is
+//! not indexed) for every source record.
+int CalibreDb::loadBookIndex (void)
 {
+	int retVal;
+	char qry[512];
+
+	sqlite3_stmt *indexStmt;
+	const char *indexTrail;
+
 	jFNTRY ();
-	int lBook;
-	int lState;
-	
+	memset (qry, '\0', 512);
+	if (getCustomStatePresent () == true)
+	{
+		sprintf (qry, "select b.title, b.id, r.rating, r.id, "
+			"(select s.value from books_custom_column_%d_link s "
+			"where s.book = b.id) from books b left outer join "
+			"books_ratings_link r on b.id = r.book", getTabId ());
+	}
+	else
+	{
+		sprintf (qry, "select b.title, b.id, r.rating, r.id, null "
+			"from books b left outer join books_ratings_link r "
+			"on b.id = r.book");
+	}
+	if (leafFilter != 0)
+	{
+		strcat (qry, " where sync_dirty (b.title)");
+	}
+
+	jDBG ("SQL : indexStmt prepare");
+	retVal = sqlite3_prepare_v2 (dbPtr, qry, -1, &indexStmt, &indexTrail);
+	if (retVal != SQLITE_OK)
+	{
+		jERR ("Prepare statement for indexStmt failed with error ["
+			<< retVal << "] " << sqlite3_errmsg (dbPtr));
+		return (FAIL);
+	}
+
+	bookIndex.clear ();
+	while (1)
+	{
+		retVal = sqlite3_step (indexStmt);
+		if (retVal != SQLITE_ROW)
+		{
+			break;
+		}
+
+		if (sqlite3_column_type (indexStmt, 0) == SQLITE_NULL)
+		{
+			continue;
+		}
+		string_view title = columnText (indexStmt, 0);
+
+		BookRecord bRec;
+		bRec.id = sqlite3_column_int (indexStmt, 1);
+		bRec.rating = sqlite3_column_int (indexStmt, 2);
+		if (sqlite3_column_type (indexStmt, 3) == SQLITE_NULL)
+		{
+			bRec.linkId = -1;
+		}
+		else
+		{
+			bRec.linkId = sqlite3_column_int (indexStmt, 3);
+		}
+		if (sqlite3_column_type (indexStmt, 4) == SQLITE_NULL)
+		{
+			bRec.state = -1;
+		}
+		else
+		{
+			bRec.state = sqlite3_column_int (indexStmt, 4);
+		}
+		bRec.flags = 0;
+
+		// Keep the first book for a title, like the title lookup query.
+		indexBook (title, bRec);
+		if (indexRows != 0)
+		{
+			indexRows->addRow (title, bRec);
+		}
+	}
+
+	jDBG ("SQL : indexStmt finalize");
+	sqlite3_finalize (indexStmt);
+
+	if (retVal != SQLITE_DONE)
+	{
+		jERR ("Loading the Calibre book index failed "
+			<< sqlite3_errmsg (dbPtr));
+		bookIndex.clear ();
+		return (FAIL);
+	}
+
+	indexLoaded = true;
+	buildTitleFilter ();
+	if (idCache != 0)
+	{
+		buildIdIndex ();
+	}
+	jDBG ("Indexed " << bookIndex.size () << " Calibre titles.");
+	jFX ();
+	return SUCCESS;
+}
+
+//! \fn void CalibreDb::setRecord (SyncClass *cRec, string_view bookTitle,
+//! BookRecord& bRec)
+//! \brief Set the Calibre record from the book data.
+void CalibreDb::setRecord (SyncClass *cRec, string_view bookTitle,
+	BookRecord& bRec)
+{
+	cRec->setId (bRec.id);
+	cRec->setTitle (bookTitle);
+	cRec->setLinkId (bRec.linkId);
+
+	//! The values are looked up in the shared tables of the DB directly,
+	//! this runs for every fetched book.
+	const RefLookup *l = cRec->getLookup ();
+	if (l == 0)
+	{
+		cRec->setRating (bRec.rating);
+	}
+	else
+	{
+		cRec->setRating (bRec.rating, l->findStdRating (bRec.rating));
+	}
+
+	if (cRec->getCustomStatePresent () == true)
+	{
+		cRec->setState (bRec.state);
+		if (l == 0)
+		{
+			cRec->setStdState (cRec->findStdState (
+				cRec->stateToText (bRec.state)));
+		}
+		else
+		{
+			cRec->setStdState (l->findStdState (bRec.state));
+		}
+	}
+}
+
+//! \fn int CalibreDb::attachDB (char *fName)
+//! \brief Attach the Reader DB to the Calibre DB connection.
+//! The Reader DB is attached as schema rdr so that the Calibre and Reader
+//! books can be paired with a single query, see CalibreDb::setupJoinStmt.
+int CalibreDb::attachDB (char *fName)
+{
 	int retVal;
-	int idx;
 
-	lBook =  newData->getId ();
-	lState = newData->getState ();
-	/*
-	   "update books_custom_column_%d_link set value = :cState "
-	   "where book = :csBookId", id);
-	   */
+	sqlite3_stmt *attachStmt;
+	const char *attachTrail;
 
-	idx = sqlite3_bind_parameter_index (cUpdateStateStmt, ":cState");
-	if (!idx)
+	jFNTRY ();
+	jDBG ("SQL : attachStmt prepare");
+	retVal = sqlite3_prepare_v2 (dbPtr, "attach database :rFile as rdr", -1,
+		&attachStmt, &attachTrail);
+	if (retVal != SQLITE_OK)
+	{
+		jERR ("Prepare statement for attachStmt failed with error ["
+			<< retVal << "] " << sqlite3_errmsg (dbPtr));
+		return (FAIL);
+	}
+
+	retVal = sqlite3_bind_text (attachStmt, 1, fName, -1, SQLITE_TRANSIENT);
+	if (retVal == SQLITE_OK)
+	{
+		retVal = sqlite3_step (attachStmt);
+	}
+
+	jDBG ("SQL : attachStmt finalize");
+	sqlite3_finalize (attachStmt);
+	if (retVal != SQLITE_DONE)
+	{
+		jERR ("Attaching Reader DB [" << fName << "] failed "
+			<< sqlite3_errmsg (dbPtr));
+		return (FAIL);
+	}
+
+	jFX ();
+	return SUCCESS;
+}
+
+//! \fn int CalibreDb::setupJoinStmt (bool toReader, SyncClass *cRec,
+//! SyncClass *rRec)
+//! \brief Prepare the Calibre - Reader join statement.
+//! Pair the Calibre books with the Reader books of the same title in the
+//! attached Reader DB and return only the pairs where the destination
+//! standard state or rating is lower than that of the source. The DB
+//! values are converted to the standard values by the sync_cal_rating,
+//! sync_cal_state, sync_rdr_rating and sync_rdr_state functions with cRec
+//! and rRec, see createStdFunctions.
+//! The titles are compared with NOCASE whatever the collation of the title
+//! columns, as the book index compares them, see foldTitle. Like
+//! getBookInfo, the destination book with the lowest id is used when a
+//! title appears more than once.
+//! \param [in] toReader true for cal2reader, false for reader2cal.
+//! \param [in] cRec, rRec Calibre and Reader records with the lookups.
+int CalibreDb::setupJoinStmt (bool toReader, SyncClass *cRec,
+	SyncClass *rRec)
+{
+	int retVal;
+	char qry[2048];
+	char cState[256];
+	char cStdState[512];
+	char rStdState[128];
+	char rStdRating[128];
+	char cond[1024];
+
+	const char *cStdRating = "sync_cal_rating (r.rating)";
+
+	jFNTRY ();
+	if ((createStdFunctions (cRec, "sync_cal_rating", "sync_cal_state")
+		!= SUCCESS) ||
+		(createStdFunctions (rRec, "sync_rdr_rating", "sync_rdr_state")
+		!= SUCCESS))
 	{
-		jERR ("Look up for cState failed");
 		return FAIL;
 	}
 
-	retVal = sqlite3_bind_int (cUpdateStateStmt, idx, lState);
+	memset (rStdState, '\0', 128);
+	memset (rStdRating, '\0', 128);
+	sprintf (rStdState, "sync_rdr_state ((rb.flags >> %d) & %d)",
+		STATE_SHIFT, STATE_MASK);
+	sprintf (rStdRating, "sync_rdr_rating ((rb.flags >> %d) & %d)",
+		RATE_SHIFT, RATE_MASK);
+
+	memset (cState, '\0', 256);
+	memset (cStdState, '\0', 512);
+	if (getCustomStatePresent () == true)
+	{
+		sprintf (cState, "(select s.value from books_custom_column_%d_link s "
+			"where s.book = b.id)", getTabId ());
+		sprintf (cStdState, "sync_cal_state (%s)", cState);
+	}
+	else
+	{
+		sprintf (cState, "null");
+	}
+
+	memset (cond, '\0', 1024);
+	if (toReader)
+	{
+		sprintf (cond, "%s < %s", rStdRating, cStdRating);
+		if (getCustomStatePresent () == true)
+		{
+			sprintf (cond + strlen (cond), " or %s < %s", rStdState,
+				cStdState);
+		}
+	}
+	else
+	{
+		sprintf (cond, "%s < %s", cStdRating, rStdRating);
+		if (getCustomStatePresent () == true)
+		{
+			sprintf (cond + strlen (cond), " or %s < %s", cStdState,
+				rStdState);
+		}
+	}
+
+	memset (qry, '\0', 2048);
+	if (toReader)
+	{
+		// Every Calibre book against the first Reader book of the title.
+		sprintf (qry, "select b.title, b.id, r.rating, r.id, %s, rb.id, "
+			"rb.flags from books b "
+			"join (select min (id) id, title from rdr.book "
+			"group by title collate nocase) rm "
+			"on rm.title = b.title collate nocase "
+			"join rdr.book rb on rb.id = rm.id "
+			"left outer join books_ratings_link r on b.id = r.book "
+			"where %s", cState, cond);
+	}
+	else
+	{
+		// Every Reader book with flags against the first Calibre book of
+		// the title.
+		sprintf (qry, "select rb.title, b.id, r.rating, r.id, %s, rb.id, "
+			"rb.flags from rdr.book rb "
+			"join (select min (id) id, title from main.books "
+			"group by title collate nocase) bm "
+			"on bm.title = rb.title collate nocase "
+			"join books b on b.id = bm.id "
+			"left outer join books_ratings_link r on b.id = r.book "
+			"where rb.flags != 0 and (%s)", cState, cond);
+	}
+	jDBG ("Join qry [" << qry << "]");
+
+	jDBG ("SQL : cJoinStmt prepare");
+	retVal = sqlite3_prepare_v2 (dbPtr, qry, -1, &cJoinStmt, &cJoinStmtTrail);
 	if (retVal != SQLITE_OK)
 	{
-		jERR ("Binding for cState failed");
-		sqlite3_clear_bindings (cUpdateStateStmt);
-		sqlite3_reset (cUpdateStateStmt);
+		jERR ("Prepare statement for cJoinStmt failed with error ["
+			<< retVal << "] " << sqlite3_errmsg (dbPtr));
+		return (FAIL);
+	}
+
+	jFX ();
+	return SUCCESS;
+}
+
+//! \fn int CalibreDb::fetchJoinedRecords (vector<JoinedRecord>& joined)
+//! \brief Fetch the Calibre - Reader book pairs that are out of sync.
+//! Run the join statement prepared by setupJoinStmt to completion. The
+//! pairs are collected before any update is made so that the read lock on
+//! the attached Reader DB is released before the Reader DB is written.
+int CalibreDb::fetchJoinedRecords (vector<JoinedRecord>& joined)
+{
+	int retVal;
+
+	jFNTRY ();
+	while (1)
+	{
+		retVal = sqlite3_step (cJoinStmt);
+		if (retVal != SQLITE_ROW)
+		{
+			break;
+		}
+
+		JoinedRecord jRec;
+		string_view title = columnText (cJoinStmt, 0);
+		jRec.title.assign (title.data (), title.length ());
+
+		jRec.cBook.id = sqlite3_column_int (cJoinStmt, 1);
+		jRec.cBook.rating = sqlite3_column_int (cJoinStmt, 2);
+		if (sqlite3_column_type (cJoinStmt, 3) == SQLITE_NULL)
+		{
+			jRec.cBook.linkId = -1;
+		}
+		else
+		{
+			jRec.cBook.linkId = sqlite3_column_int (cJoinStmt, 3);
+		}
+		if (sqlite3_column_type (cJoinStmt, 4) == SQLITE_NULL)
+		{
+			jRec.cBook.state = -1;
+		}
+		else
+		{
+			jRec.cBook.state = sqlite3_column_int (cJoinStmt, 4);
+		}
+		jRec.cBook.flags = 0;
+
+		jRec.rBook.id = sqlite3_column_int (cJoinStmt, 5);
+		jRec.rBook.flags = sqlite3_column_int (cJoinStmt, 6);
+		jRec.rBook.linkId = 0;
+		jRec.rBook.rating = 0;
+		jRec.rBook.state = 0;
+
+		joined.push_back (jRec);
+	}
+	sqlite3_reset (cJoinStmt);
+
+	if (retVal != SQLITE_DONE)
+	{
+		jERR ("Fetching the joined records failed " << sqlite3_errmsg (dbPtr));
+		return (FAIL);
+	}
+
+	jDBG ("Fetched " << joined.size () << " joined records.");
+	jFX ();
+	return SUCCESS;
+}
+
+//! \fn int CalibreDb::applyStaged (void)
+//! \brief Apply the staged changes to the Calibre tables.
+//! The ratings of the books with a rating link are updated, the books
+//! without one get a new link and the read state is updated in the custom
+//! column link table, each in a single statement.
+int CalibreDb::applyStaged (void)
+{
+	int retVal;
+	char qry[512];
+
+	jFNTRY ();
+	retVal = execSql ("insert into books_ratings_link (id, book, rating) "
+		"select (select l.id from books_ratings_link l where l.book = c.book), "
+		"c.book, c.rating from temp.sync_changes c where c.rating is not null "
+		"on conflict (id) do update set rating = excluded.rating");
+	if (retVal != SUCCESS)
+	{
 		return FAIL;
 	}
 
-	idx = sqlite3_bind_parameter_index (cUpdateStateStmt, ":csBookId");
-	if (!idx)
+	if (getCustomStatePresent () == true)
+	{
+		memset (qry, '\0', 512);
+		sprintf (qry, "insert into books_custom_column_%d_link (id, book, value) "
+			"select (select l.id from books_custom_column_%d_link l "
+			"where l.book = c.book), c.book, c.state from temp.sync_changes c "
+			"where c.state is not null "
+			"on conflict (id) do update set value = excluded.value",
+			getTabId (), getTabId ());
+		retVal = execSql (qry);
+		if (retVal != SUCCESS)
+		{
+			return FAIL;
+		}
+	}
+
+	retVal = execSql ("delete from temp.sync_changes");
+	jFX ();
+	return retVal;
+}
+
+//! Set method for custom tab id.
+void CalibreDb::setTabId (int tId)
+{
+	tabId = tId;
+}
+
+//! Get method for custom tab id.
+int CalibreDb::getTabId (void)
+{
+	return tabId;
+}
+
+//! \fn int CalibreDb::getIdBounds (int *minId, int *maxId)
+//! \brief Get the lowest and the highest id in the books table.
+int CalibreDb::getIdBounds (int *minId, int *maxId)
+{
+	return queryIdBounds ("select min(id), max(id) from books", minId, maxId);
+}
+
+//! \fn SyncDb *CalibreDb::newShard (int lo, int hi)
+//! \brief Create a read only Calibre DB that fetches the books with ids lo
+//! to hi. The caller connects it, sets up the statements and deletes it.
+SyncDb *CalibreDb::newShard (int lo, int hi)
+{
+	CalibreDb *shard = new CalibreDb;
+
+	shard->setReadOnly (true);
+	shard->setCustomStatePresent (getCustomStatePresent ());
+	shard->setTabId (getTabId ());
+	shard->setIdRange (lo, hi);
+	if (getDeltaFetch () == true)
 	{
-		jERR ("Look up for csBookId failed");
-		return FAIL;
+		shard->setModifiedSince (modifiedSince);
 	}
+	return shard;
+}
 
-	retVal = sqlite3_bind_int (cUpdateStateStmt, idx, lBook);
+//! \fn void CalibreDb::setModifiedSince (string since)
+//! \brief Fetch only the books modified after the given time.
+//! Calibre updates last_modified of a book when its metadata, including
+//! the rating and the custom columns, is changed. since is compared with
+//! last_modified as text, an empty since fetches all the books. Must be
+//! called before setupDbStmts.
+void CalibreDb::setModifiedSince (string since)
+{
+	deltaFetch = true;
+	modifiedSince = since;
+}
+
+//! Get method for deltaFetch flag.
+bool CalibreDb::getDeltaFetch (void)
+{
+	return deltaFetch;
+}
+
+//! \fn int CalibreDb::loadLastModified (void)
+//! \brief Find the latest last_modified in the books table.
+//! Called before the books are fetched, the result is the modified since
+//! time of the next run. A book modified while the sync runs is fetched
+//! again by the next run.
+//! \return SUCCESS, NO_DATA if there are no books or FAIL.
+int CalibreDb::loadLastModified (void)
+{
+	int retVal;
+
+	sqlite3_stmt *modStmt;
+	const char *modTrail;
+
+	jDBG ("SQL : modStmt prepare");
+	retVal = sqlite3_prepare_v2 (dbPtr, "select max(last_modified) from books",
+		-1, &modStmt, &modTrail);
 	if (retVal != SQLITE_OK)
 	{
-		jERR ("Binding for csBookId failed");
-		sqlite3_clear_bindings (cUpdateStateStmt);
-		sqlite3_reset (cUpdateStateStmt);
+		jERR ("Prepare statement for modStmt failed with error ["
+			<< retVal << "] " << sqlite3_errmsg (dbPtr));
 		return FAIL;
 	}
 
-	jDBG ("Updating state for book id " << lBook << " State = " << lState);
-	retVal = sqlite3_step (cUpdateStateStmt);
-	if (retVal != SQLITE_DONE)
+	retVal = sqlite3_step (modStmt);
+	if (retVal != SQLITE_ROW)
 	{
-		jERR ("Calibre state updated failed "
+		jERR ("Fetching the last modified time failed "
 			<< sqlite3_errmsg (dbPtr));
-		sqlite3_clear_bindings (cUpdateStateStmt);
-		sqlite3_reset (cUpdateStateStmt);
+		sqlite3_finalize (modStmt);
 		return FAIL;
 	}
 
-	sqlite3_clear_bindings (cUpdateStateStmt);
-	sqlite3_reset (cUpdateStateStmt);
+	if (sqlite3_column_type (modStmt, 0) == SQLITE_NULL)
+	{
+		sqlite3_finalize (modStmt);
+		return NO_DATA;
+	}
 
-	jFX ();
+	lastModified = (char *) sqlite3_column_text (modStmt, 0);
+	sqlite3_finalize (modStmt);
+	jDBG ("Calibre last modified [" << lastModified << "]");
 	return SUCCESS;
 }
 
-//! Set method for custom tab id.
-void CalibreDb::setTabId (int tId)
+//! Get the latest last_modified found by loadLastModified.
+string CalibreDb::getLastModified (void)
 {
-	tabId = tId;
+	return lastModified;
 }
 
-//! Get method for custom tab id.
-int CalibreDb::getTabId (void)
+//! \fn int CalibreDb::dataHash (string& hash)
+//! \brief Hash the book data the sync reads.
+//! Covers the titles, the rating links, the ratings and, if the custom
+//! state is present, the state links and values.
+int CalibreDb::dataHash (string& hash)
 {
-	return tabId;
+	char qry[512];
+	char stateCol[128];
+	char stateHash[128];
+
+	memset (stateCol, '\0', 128);
+	memset (stateHash, '\0', 128);
+	if (getCustomStatePresent () == true)
+	{
+		sprintf (stateCol, "(select s.value from books_custom_column_%d_link s "
+			"where s.book = b.id)", getTabId ());
+		sprintf (stateHash, ", (select sync_hash (id, value) from "
+			"custom_column_%d)", getTabId ());
+	}
+	else
+	{
+		sprintf (stateCol, "null");
+	}
+
+	memset (qry, '\0', 512);
+	sprintf (qry, "select count(*), sync_hash (b.id, b.title, r.id, r.rating, "
+		"%s), (select sync_hash (id, rating) from ratings)%s from books b "
+		"left outer join books_ratings_link r on b.id = r.book", stateCol,
+		stateHash);
+	return queryDataHash (qry, hash);
+}
+
+//! \fn int CalibreDb::leafHashes (SyncClass *rec, int bits,
+//! vector<TreeLeaf>& leaves)
+//! \brief Hash the standard rating and state of the books by title tree
+//! leaf. rec converts the DB values, it needs the rating and state lookups.
+int CalibreDb::leafHashes (SyncClass *rec, int bits, vector<TreeLeaf>& leaves)
+{
+	char qry[512];
+	char stateCol[160];
+
+	memset (stateCol, '\0', 160);
+	if (getCustomStatePresent () == true)
+	{
+		sprintf (stateCol, "sync_std_state ((select s.value from "
+			"books_custom_column_%d_link s where s.book = b.id))", getTabId ());
+	}
+	else
+	{
+		sprintf (stateCol, "0");
+	}
+
+	memset (qry, '\0', 512);
+	sprintf (qry, "select sync_leaf (b.title, %d), count(*), "
+		"count(distinct b.title), sync_hash (b.title, "
+		"sync_std_rating (r.rating), %s) from books b left outer join "
+		"books_ratings_link r on b.id = r.book group by 1", bits, stateCol);
+	return queryLeafHashes (rec, qry, bits, leaves);
 }
 
 // ReaderDb methods ///////////////////////////////////////
 //! ReaderDb constructor.
 ReaderDb::ReaderDb ()
 {
-	dbPtr = 0;
 	rFetchRecordsStmt = 0;
 	rFetchStmtTrail = 0;
 	flags = 0;
@@ -880,8 +2490,8 @@ int ReaderDb::connectToDB (char *fName)
 	jDBG ("ReaderDb::connectToDB [" << fName << "]");
 
 	jDBG ("SQL : Reader open DB");
-	retVal = sqlite3_open (fName, &dbPtr);
-	if (SQLITE_OK != retVal)
+	retVal = openDB (fName);
+	if (retVal != SUCCESS)
 	{
 		return FAIL;
 	}
@@ -931,9 +2541,21 @@ int ReaderDb::setupDbStmts (void)
 	jFNTRY ();
 
 	// prepare the statement to fetch data from reader db.
+	char qry[128];
+	memset (qry, '\0', 128);
+	sprintf (qry, "select id, title, flags from book where flags != 0");
+	if (idRange == true)
+	{
+		sprintf (qry + strlen (qry), " and id between %d and %d",
+			rangeLo, rangeHi);
+	}
+	if (leafFilter != 0)
+	{
+		strcat (qry, " and sync_dirty (title)");
+	}
+
 	jDBG ("SQL : rFetchRecordsStmt prepare");
-	retVal = sqlite3_prepare_v2 (dbPtr,
-			"select id, title, flags from book where flags != 0", -1,
+	retVal = sqlite3_prepare_v2 (dbPtr, qry, -1,
 			&rFetchRecordsStmt, &rFetchStmtTrail);
 	if (retVal != SQLITE_OK)
 	{
@@ -994,6 +2616,8 @@ int ReaderDb::finalizeStmts (void)
 		sqlite3_finalize (rUpdateFlagStmt);
 		rUpdateFlagStmt = 0;
 	}
+
+	finalizeStaging ();
 	return SUCCESS;
 }
 
@@ -1002,7 +2626,6 @@ int ReaderDb::finalizeStmts (void)
 int ReaderDb::fetchRecords (SyncClass *rRec)
 {
 	int retVal;
-	char rTitle[TITLE_LEN];
 	int rId;
 	int rFlags;
 
@@ -1016,11 +2639,10 @@ int ReaderDb::fetchRecords (SyncClass *rRec)
 		return NO_DATA;
 	}
 	rId = sqlite3_column_int (rFetchRecordsStmt, 0);
-	strcpy (rTitle, (char *) sqlite3_column_text (rFetchRecordsStmt, 1));
 	rFlags = sqlite3_column_int (rFetchRecordsStmt, 2);
 
 	rRec->setId (rId);
-	rRec->setTitle (rTitle);
+	rRec->setTitle (columnText (rFetchRecordsStmt, 1));
 	rRec->setFlags (rFlags);
 	
 	// Extract the state and rating from flags and set them.
@@ -1030,15 +2652,69 @@ int ReaderDb::fetchRecords (SyncClass *rRec)
 	return SUCCESS;
 }
 
-//! \fn int ReaderDb::getBookInfo (SyncClass *rRec, string cTitle)
+//! \fn int ReaderDb::fetchBatch (RecordBatch& batch, size_t rows)
+//! \brief Fetch the next Reader records into a batch.
+//! \param [in] rows Number of records to fetch, 0 for all.
+//! \return SUCCESS if rows records were added, NO_DATA at the end of the
+//! records, with the records fetched before in the batch, FAIL on error.
+int ReaderDb::fetchBatch (RecordBatch& batch, size_t rows)
+{
+	int retVal;
+	BookRecord bRec;
+
+	bRec.linkId = 0;
+	for (size_t n = 0; (rows == 0) || (n < rows); n++)
+	{
+		retVal = sqlite3_step (rFetchRecordsStmt);
+		if (retVal == SQLITE_DONE)
+		{
+			return NO_DATA;
+		}
+		if (retVal != SQLITE_ROW)
+		{
+			jERR ("Fetching the Reader records failed "
+				<< sqlite3_errmsg (dbPtr));
+			return FAIL;
+		}
+
+		bRec.id = sqlite3_column_int (rFetchRecordsStmt, 0);
+		bRec.flags = sqlite3_column_int (rFetchRecordsStmt, 2);
+		bRec.rating = (bRec.flags >> RATE_SHIFT) & RATE_MASK;
+		bRec.state = (bRec.flags >> STATE_SHIFT) & STATE_MASK;
+
+		batch.addRow (columnText (rFetchRecordsStmt, 1), bRec);
+	}
+	return SUCCESS;
+}
+
+//! \fn int ReaderDb::getBookInfo (SyncClass *rRec, const string& cTitle)
 //! \brief Get the book info from Reader DB.
-int ReaderDb::getBookInfo (SyncClass *rRec, string cTitle)
+//! The title is bound without a copy, the binding is cleared before
+//! returning.
+int ReaderDb::getBookInfo (SyncClass *rRec, const string& cTitle)
 {
 	// jFNTRY ();
 
 	int idx;
 	int retVal;
 
+	if (indexLoaded == true)
+	{
+		//! Use the book index instead of the title lookup query if the
+		//! index is loaded.
+		IndexedBook *book = findBook (cTitle);
+		if (book == 0)
+		{
+			rRec->setId (0);
+			return (NO_DATA);
+		}
+
+		//! The record gets the title as stored in the DB, as with the
+		//! title lookup query.
+		setRecord (rRec, book->title, book->book);
+		return SUCCESS;
+	}
+
 	idx = sqlite3_bind_parameter_index (rGetBookInfStmt, ":rTitle");
 	if (!idx)
 	{
@@ -1046,14 +2722,9 @@ int ReaderDb::getBookInfo (SyncClass *rRec, string cTitle)
 		return (FAIL);
 	}
 
-	char title[TITLE_LEN];
-	memset (title, '\0', TITLE_LEN);
-	strcpy (title, cTitle.c_str ());
-	// jDBG ("Title [" << title << "]");
-
-
-	retVal = sqlite3_bind_text (rGetBookInfStmt, idx, title, -1,
-		SQLITE_TRANSIENT);
+	// jDBG ("Title [" << cTitle << "]");
+	retVal = sqlite3_bind_text (rGetBookInfStmt, idx, cTitle.data (),
+		cTitle.length (), SQLITE_STATIC);
 	if (retVal != SQLITE_OK)
 	{
 		jERR ("Binding for title failed");
@@ -1074,9 +2745,6 @@ int ReaderDb::getBookInfo (SyncClass *rRec, string cTitle)
 		return (NO_DATA);
 	}
 
-	memset (title, '\0', TITLE_LEN);
-	strcpy (title, (char *) sqlite3_column_text (rGetBookInfStmt, 1));
-
 	int id;
 	id = sqlite3_column_int (rGetBookInfStmt, 0);
 
@@ -1084,7 +2752,7 @@ int ReaderDb::getBookInfo (SyncClass *rRec, string cTitle)
 	dbFlags = sqlite3_column_int (rGetBookInfStmt, 2);
 	// jDBG ("Flags [" << dbFlags << "]");
 
-	rRec->setTitle (title);
+	rRec->setTitle (columnText (rGetBookInfStmt, 1));
 	rRec->setId (id);
 	rRec->setFlags (dbFlags);
 
@@ -1116,14 +2784,7 @@ int ReaderDb::updateRating (SyncClass *newData)
 	int curFlag;
 	int newFlag;
 	int newRating;
-
-	int idx;
 	int retVal;
-	int lBookId;
-
-	curFlag = 0;
-	newFlag = 0;
-	
 
 	curFlag = newData->getFlags ();
 	newRating = newData->getRating ();
@@ -1133,7 +2794,92 @@ int ReaderDb::updateRating (SyncClass *newData)
 	newFlag = (curFlag & ~(RATE_MASK << RATE_SHIFT)) |
 		((newRating & RATE_MASK) << RATE_SHIFT);
 
+	retVal = writeFlags (newData, newFlag);
+	jFX ();
+	return retVal;
+}
+
+//! \fn int ReaderDb::updateState (SyncClass *newData)
+//! \brief Update the state in Reader database.
+int ReaderDb::updateState (SyncClass* newData)
+{
+	jFNTRY ();
+	jDBG ("Update State Flags [" << newData->getFlags());
+	int curFlag;
+	int newFlag;
+	int newState;
+	int retVal;
+
+	curFlag = newData->getFlags ();
+	newState = newData->getState ();
+	jDBG ("New State is " << newState);
+	jDBG ("Flags is " << curFlag);
+
+	newFlag = (curFlag & ~(STATE_MASK << STATE_SHIFT)) |
+		((newState & STATE_MASK) << STATE_SHIFT);
+
+	retVal = writeFlags (newData, newFlag);
+	jFX ();
+	return retVal;
+}
+
+//! \fn int ReaderDb::updateBook (SyncClass *newData, bool rate, bool state)
+//! \brief Update the rating and/or the state in Reader database.
+//! The rating and the state are both stored in flags, the final flags are
+//! built once and written with a single update. Only the bits of the values
+//! to update are replaced, the others are kept as read from the DB.
+int ReaderDb::updateBook (SyncClass *newData, bool rate, bool state)
+{
+	jFNTRY ();
+	int curFlag;
+	int newFlag;
+	int retVal;
+
+	curFlag = newData->getFlags ();
+	jDBG ("New Rating is " << newData->getRating () << ", New State is "
+		<< newData->getState () << ", Flags is " << curFlag);
+
+	newFlag = curFlag;
+	if (rate)
+	{
+		newFlag = (newFlag & ~(RATE_MASK << RATE_SHIFT)) |
+			((newData->getRating () & RATE_MASK) << RATE_SHIFT);
+	}
+	if (state)
+	{
+		newFlag = (newFlag & ~(STATE_MASK << STATE_SHIFT)) |
+			((newData->getState () & STATE_MASK) << STATE_SHIFT);
+	}
+
+	retVal = SUCCESS;
+	if (rate || state)
+	{
+		retVal = writeFlags (newData, newFlag);
+	}
+	jFX ();
+	return retVal;
+}
+
+//! \fn int ReaderDb::writeFlags (SyncClass *newData, int newFlag)
+//! \brief Write the new flags of the book to the Reader database.
+int ReaderDb::writeFlags (SyncClass *newData, int newFlag)
+{
+	int idx;
+	int retVal;
+	int lBookId;
+
 	jDBG ("New flag [" << newFlag);
+	lBookId = newData->getId ();
+
+	if (staging == true)
+	{
+		retVal = stageChange (lBookId, STAGE_FLAGS, newFlag);
+		if (retVal == SUCCESS)
+		{
+			newData->setFlags (newFlag);
+		}
+		return retVal;
+	}
 
 	idx = sqlite3_bind_parameter_index (rUpdateFlagStmt, ":nFlags");
 	if (!idx)
@@ -1158,7 +2904,6 @@ int ReaderDb::updateRating (SyncClass *newData)
 		return FAIL;
 	}
 
-	lBookId = newData->getId ();
 	retVal = sqlite3_bind_int (rUpdateFlagStmt, idx, lBookId);
 	if (retVal != SQLITE_OK)
 	{
@@ -1184,95 +2929,185 @@ int ReaderDb::updateRating (SyncClass *newData)
 	//! Update the new flags in newData so that the new rating is reflected
 	//! in the flags which might be used for state updates.
 	newData->setFlags (newFlag);
-
-	jFX ();
 	return SUCCESS;
 }
 
-//! Insert rating function for Reader, not used.
-int ReaderDb::insertRating (SyncClass *newData)
+//! \fn void ReaderDb::setRecord (SyncClass *rRec, string_view bookTitle,
+//! BookRecord& bRec)
+//! \brief Set the Reader record from the book data.
+void ReaderDb::setRecord (SyncClass *rRec, string_view bookTitle,
+	BookRecord& bRec)
 {
-	jFNTRY ();
-	jFX ();
-	return SUCCESS;
+	rRec->setTitle (bookTitle);
+	rRec->setId (bRec.id);
+	rRec->setFlags (bRec.flags);
+
+	// Extract the state and rating from flags and set them.
+	rRec->setRateNState (bRec.flags);
 }
 
-int ReaderDb::updateState (SyncClass* newData)
+//! \fn int ReaderDb::applyStaged (void)
+//! \brief Apply the staged changes to the Reader book table.
+//! The staged flags already hold both the new rating and state.
+int ReaderDb::applyStaged (void)
 {
-	jFNTRY ();
-	jDBG ("Update State Flags [" << newData->getFlags());
-	int curFlag;
-	int newFlag;
-	int newState;
-
-	int idx;
 	int retVal;
-	int lBookId;
 
-	curFlag = 0;
-	newFlag = 0;
-	
+	jFNTRY ();
+	retVal = execSql ("update book set flags = c.flags "
+		"from temp.sync_changes c where book.id = c.book "
+		"and c.flags is not null");
+	if (retVal != SUCCESS)
+	{
+		return FAIL;
+	}
 
-	curFlag = newData->getFlags ();
-	newState = newData->getState ();
-	jDBG ("New State is " << newState);
-	jDBG ("Flags is " << curFlag);
+	retVal = execSql ("delete from temp.sync_changes");
+	jFX ();
+	return retVal;
+}
 
-	newFlag = (curFlag & ~(STATE_MASK << STATE_SHIFT)) |
-		((newState & STATE_MASK) << STATE_SHIFT);
+//! \fn void ReaderDb::refreshBookIndex (SyncClass *newData)
+//! \brief Update the book index entry after a write.
+//! The new rating and state are only merged into the flags when the flags
+//! are written, merge them here so that the index has the flags as they
+//! are after the update.
+void ReaderDb::refreshBookIndex (SyncClass *newData)
+{
+	newData->setFlags (newData->encodeRFlags ());
+	SyncDb::refreshBookIndex (newData);
+}
 
-	jDBG ("New flag [" << newFlag);
+//! \fn int ReaderDb::loadBookIndex (void)
+//! \brief Load all the Reader books into the book index.
+//! Scan the book table once and index the books by title so that
+//! getBookInfo does not have to run a title lookup query (book.title is
+//! not indexed) for every source record.
+int ReaderDb::loadBookIndex (void)
+{
+	int retVal;
 
-	idx = sqlite3_bind_parameter_index (rUpdateFlagStmt, ":nFlags");
-	if (!idx)
-	{
-		jERR ("Look up for nFlags failed");
-		return FAIL;
-	}
+	sqlite3_stmt *indexStmt;
+	const char *indexTrail;
 
-	retVal = sqlite3_bind_int (rUpdateFlagStmt, idx, newFlag);
+	jFNTRY ();
+	jDBG ("SQL : indexStmt prepare");
+	retVal = sqlite3_prepare_v2 (dbPtr, (leafFilter != 0) ?
+		"select id, title, flags from book where sync_dirty (title)" :
+		"select id, title, flags from book", -1, &indexStmt, &indexTrail);
 	if (retVal != SQLITE_OK)
 	{
-		jERR ("Binding for new flags failed");
-		sqlite3_clear_bindings (rUpdateFlagStmt);
-		sqlite3_reset (rUpdateFlagStmt);
+		jERR ("Prepare statement for indexStmt failed with error ["
+			<< retVal << "] " << sqlite3_errmsg (dbPtr));
 		return (FAIL);
 	}
 
-	idx = sqlite3_bind_parameter_index (rUpdateFlagStmt, ":rId");
-	if (!idx)
+	bookIndex.clear ();
+	while (1)
 	{
-		jERR ("Look up for rId failed");
-		return FAIL;
+		retVal = sqlite3_step (indexStmt);
+		if (retVal != SQLITE_ROW)
+		{
+			break;
+		}
+
+		if (sqlite3_column_type (indexStmt, 1) == SQLITE_NULL)
+		{
+			continue;
+		}
+		string_view title = columnText (indexStmt, 1);
+
+		BookRecord bRec;
+		bRec.id = sqlite3_column_int (indexStmt, 0);
+		bRec.flags = sqlite3_column_int (indexStmt, 2);
+		bRec.linkId = 0;
+		bRec.rating = 0;
+		bRec.state = 0;
+
+		// Keep the first book for a title, like the title lookup query.
+		indexBook (title, bRec);
+		if (indexRows != 0)
+		{
+			indexRows->addRow (title, bRec);
+		}
 	}
 
-	lBookId = newData->getId ();
-	retVal = sqlite3_bind_int (rUpdateFlagStmt, idx, lBookId);
-	if (retVal != SQLITE_OK)
+	jDBG ("SQL : indexStmt finalize");
+	sqlite3_finalize (indexStmt);
+
+	if (retVal != SQLITE_DONE)
 	{
-		jERR ("Binding for book id failed");
-		sqlite3_clear_bindings (rUpdateFlagStmt);
-		sqlite3_reset (rUpdateFlagStmt);
+		jERR ("Loading the Reader book index failed "
+			<< sqlite3_errmsg (dbPtr));
+		bookIndex.clear ();
 		return (FAIL);
 	}
 
-	jDBG ("Updating flags");
-	retVal = sqlite3_step (rUpdateFlagStmt);
-	if (retVal != SQLITE_DONE)
+	indexLoaded = true;
+	buildTitleFilter ();
+	if (idCache != 0)
 	{
-		jERR ("Reader flag update failed");
-		sqlite3_clear_bindings (rUpdateFlagStmt);
-		sqlite3_reset (rUpdateFlagStmt);
-		return FAIL;
+		buildIdIndex ();
 	}
+	jDBG ("Indexed " << bookIndex.size () << " Reader titles.");
+	jFX ();
+	return SUCCESS;
+}
 
-	sqlite3_clear_bindings (rUpdateFlagStmt);
-	sqlite3_reset (rUpdateFlagStmt);
+//! \fn int ReaderDb::getIdBounds (int *minId, int *maxId)
+//! \brief Get the lowest and the highest id of the books with flags.
+int ReaderDb::getIdBounds (int *minId, int *maxId)
+{
+	return queryIdBounds ("select min(id), max(id) from book where flags != 0",
+		minId, maxId);
+}
 
-	//! Update the new flags in newData so that the new rating is reflected
-	//! in the flags which might be used for state updates.
-	newData->setFlags (newFlag);
+//! \fn int ReaderDb::dataHash (string& hash)
+//! \brief Hash the book data the sync reads.
+//! All the books are hashed, a book without flags can be a destination.
+int ReaderDb::dataHash (string& hash)
+{
+	return queryDataHash (
+		"select count(*), sync_hash (id, title, flags) from book", hash);
+}
 
-	jFX ();
-	return SUCCESS;
+//! \fn int ReaderDb::leafHashes (SyncClass *rec, int bits,
+//! vector<TreeLeaf>& leaves)
+//! \brief Hash the standard rating and state of the books by title tree
+//! leaf. The rating and state are taken from the flags as in setRateNState.
+int ReaderDb::leafHashes (SyncClass *rec, int bits, vector<TreeLeaf>& leaves)
+{
+	char qry[512];
+	char stateCol[64];
+
+	memset (stateCol, '\0', 64);
+	if (getCustomStatePresent () == true)
+	{
+		sprintf (stateCol, "sync_std_state ((flags >> %d) & %d)", STATE_SHIFT,
+			STATE_MASK);
+	}
+	else
+	{
+		sprintf (stateCol, "0");
+	}
+
+	memset (qry, '\0', 512);
+	sprintf (qry, "select sync_leaf (title, %d), count(*), "
+		"count(distinct title), sync_hash (title, "
+		"sync_std_rating ((flags >> %d) & %d), %s) from book group by 1",
+		bits, RATE_SHIFT, RATE_MASK, stateCol);
+	return queryLeafHashes (rec, qry, bits, leaves);
+}
+
+//! \fn SyncDb *ReaderDb::newShard (int lo, int hi)
+//! \brief Create a read only Reader DB that fetches the books with ids lo
+//! to hi. The caller connects it, sets up the statements and deletes it.
+SyncDb *ReaderDb::newShard (int lo, int hi)
+{
+	ReaderDb *shard = new ReaderDb;
+
+	shard->setReadOnly (true);
+	shard->setCustomStatePresent (getCustomStatePresent ());
+	shard->setIdRange (lo, hi);
+	return shard;
 }
@@ -5,9 +5,252 @@
 
 
 #include <sqlite3.h>
+#include <unordered_map>
+#include <vector>
+#include "syncIdCache.hpp"
+#include "syncState.hpp"
+
+//! Staged rating change, see SyncDb::stageChange.
+#define STAGE_RATING 1
+
+//! Staged state change, see SyncDb::stageChange.
+#define STAGE_STATE 2
+
+//! Staged flags change, see SyncDb::stageChange.
+#define STAGE_FLAGS 3
+
+//! Book data held in the destination book index.
+struct BookRecord
+{
+	//! Book id
+	int id;
+
+	//! Link id, -1 if the rating link is not present.
+	int linkId;
+
+	//! Rating as stored in the DB.
+	int rating;
+
+	//! Read state as stored in the DB.
+	int state;
+
+	//! Flags - specific to Reader
+	int flags;
+};
+
+//! A book in the book index, see SyncDb::loadBookIndex.
+struct IndexedBook
+{
+	//! The title as stored in the DB.
+	string title;
+
+	//! The book data.
+	BookRecord book;
+};
+
+//! A Calibre book paired with the Reader book of the same title.
+struct JoinedRecord
+{
+	//! The book title
+	string title;
+
+	//! Calibre side of the pair.
+	BookRecord cBook;
+
+	//! Reader side of the pair.
+	BookRecord rBook;
+};
+
+//! Hash of the books in a leaf of the title tree, see SyncTree.
+struct TreeLeaf
+{
+	//! Sum of the hashes of the books.
+	long long hash;
+
+	//! Number of books.
+	int books;
+
+	//! Number of distinct titles.
+	int titles;
+};
+
+//! Number of source books the fetch stage passes to the match stage at a
+//! time, see SyncDb::fetchBatch.
+#define BATCH_ROWS 512
+
+//! Highest book id per indexed title for which the id index is built, see
+//! SyncDb::buildIdIndex.
+#define ID_INDEX_SPREAD 4
+
+//! Source books in columns, passed from the fetch to the match stage.
+//! The values of book i are at index i of each column and the titles are
+//! kept back to back in one buffer, so that a batch is filled and moved
+//! without an allocation per book.
+class RecordBatch
+{
+private :
+	//! Book ids.
+	vector<int> ids;
+
+	//! Link ids.
+	vector<int> linkIds;
+
+	//! Ratings as stored in the DB.
+	vector<int> ratings;
+
+	//! Read states as stored in the DB.
+	vector<int> states;
+
+	//! Reader flags.
+	vector<int> flags;
+
+	//! End of each title in titles.
+	vector<size_t> titleEnds;
+
+	//! The titles, back to back.
+	string titles;
+
+public :
+	//! Number of books in the batch.
+	size_t size (void);
+
+	//! Remove all the books, the memory is kept.
+	void clear (void);
+
+	//! Reserve space for a number of books.
+	void reserve (size_t rows);
+
+	//! Add a book.
+	void addRow (string_view title, BookRecord& bRec);
+
+	//! Add all the books of another batch.
+	void append (RecordBatch& from);
+
+	//! Get the title of a book, valid until books are added.
+	string_view getTitle (size_t i);
+
+	//! Get the book data of a book.
+	void getBook (size_t i, BookRecord& bRec);
+};
+
 //! Abstract base class for CalibreDb and ReaderDb.
 class SyncDb
 {
+protected :
+	//! DB Handle.
+	sqlite3 *dbPtr;
+
+	//! Book index keyed by the folded title, see SyncDb::loadBookIndex.
+	unordered_map<string, IndexedBook> bookIndex;
+
+	//! Flag indicating that the book index is loaded.
+	bool indexLoaded;
+
+	//! Bloom filter of the folded titles in the book index.
+	vector<unsigned long long> titleFilter;
+
+	//! Build the title filter from the book index.
+	void buildTitleFilter (void);
+
+	//! Number of book index lookups.
+	long lookups;
+
+	//! Lookups of titles not in the title filter.
+	long filterSkips;
+
+	//! Lookups of titles in the title filter but not in the book index.
+	long falseHits;
+
+	//! Pairs of the last run, 0 if the books are paired by title only.
+	IdCache *idCache;
+
+	//! The books in the book index by id, built if idCache is set. Empty
+	//! if the ids are too sparse, see SyncDb::buildIdIndex.
+	vector<IndexedBook *> idIndex;
+
+	//! Build the id index from the book index.
+	void buildIdIndex (void);
+
+	//! All the books read by loadBookIndex, 0 if not kept.
+	RecordBatch *indexRows;
+
+	//! Flag indicating that the DB is opened read only.
+	bool readOnly;
+
+	//! Open the SQLite DB file.
+	int openDB (char *fName);
+
+	//! Add a book to the book index unless its title is there.
+	void indexBook (string_view bookTitle, BookRecord& bRec);
+
+	//! Find a book in the book index, 0 if not found.
+	IndexedBook *findBook (const string& bookTitle);
+
+	//! Create the SQL functions converting the DB values of rec.
+	int createStdFunctions (SyncClass *rec, const char *ratingFunc,
+		const char *stateFunc);
+
+	//! Books to update per transaction, 0 for a single transaction.
+	int commitEvery;
+
+	//! Flag indicating that a transaction is open.
+	bool inTransaction;
+
+	//! Books updated in the open transaction.
+	int pendingBooks;
+
+	//! Books updated in the committed transactions.
+	int committedBooks;
+
+	//! Number of committed transactions.
+	int commitCount;
+
+	//! Flag indicating that the updates are staged, see SyncDb::setupStaging.
+	bool staging;
+
+	//! Statement to stage a change.
+	sqlite3_stmt *stageStmt;
+
+	//! Stage statement trail.
+	const char *stageStmtTrail;
+
+	//! Execute an SQL statement without results.
+	int execSql (const char *sql);
+
+	//! Stage a change in the sync_changes table.
+	int stageChange (int book, int column, int value);
+
+	//! Apply the staged changes to the DB tables.
+	virtual int applyStaged (void) = 0;
+
+	//! Finalize the staging statement.
+	void finalizeStaging (void);
+
+	//! Flag indicating that the fetch is limited to an id range.
+	bool idRange;
+
+	//! Lowest book id fetched, see SyncDb::setIdRange.
+	int rangeLo;
+
+	//! Highest book id fetched, see SyncDb::setIdRange.
+	int rangeHi;
+
+	//! Run a query returning the lowest and the highest book id.
+	int queryIdBounds (const char *qry, int *minId, int *maxId);
+
+	//! Run a query returning the hashes of the synced data.
+	int queryDataHash (const char *qry, string& hash);
+
+	//! Fetch only the books in these leaves of the title tree.
+	vector<bool> *leafFilter;
+
+	//! Number of title hash bits of the leaves in leafFilter.
+	int leafBits;
+
+	//! Run a query returning the hashes of the title tree leaves.
+	int queryLeafHashes (SyncClass *rec, const char *qry, int bits,
+		vector<TreeLeaf>& leaves);
+
 public :
 
 	//! Method to get customStatePresent flag.
@@ -16,6 +259,9 @@ public :
 	//! Flag indicating custom states for Calibre.
 	bool customStatePresent;
 
+	//! SyncDb constructor
+	SyncDb ();
+
 	//! SyncDb destructor
 	virtual ~SyncDb ();
 
@@ -34,8 +280,11 @@ public :
 	//! Fetch records from DB.
 	virtual int fetchRecords (SyncClass *rec) = 0;
 
+	//! Fetch the next records into a batch.
+	virtual int fetchBatch (RecordBatch& batch, size_t rows) = 0;
+
 	//! Get the book info from the DB.
-	virtual int getBookInfo (SyncClass *rec, string bookTitle) = 0;
+	virtual int getBookInfo (SyncClass *rec, const string& bookTitle) = 0;
 
 	//! Method to set customStatePresent flag.
 	int setCustomStatePresent (bool val);
@@ -43,29 +292,103 @@ public :
 	//! Method to update the rating.
 	virtual int updateRating (SyncClass *newData)  = 0;
 
-	//! Method to insert the rating.
-	virtual int insertRating (SyncClass *newData)  = 0;
-
 	//! Method to update the state.
 	virtual int updateState (SyncClass *newData) = 0;
+
+	//! Method to update the rating and/or the state.
+	virtual int updateBook (SyncClass *newData, bool rate, bool state);
+
+	//! Load all the books into the book index.
+	virtual int loadBookIndex (void) = 0;
+
+	//! Look up a book in the book index.
+	int lookupBook (const string& bookTitle, BookRecord *bRec);
+
+	//! Display the book index lookup statistics.
+	void displayLookupStats (string dbName);
+
+	//! Pair the books by id through the id cache of the last run.
+	void setIdCache (IdCache *cache);
+
+	//! Find the destination book of a source book.
+	int matchBook (SyncClass *rec, SyncClass *source);
+
+	//! Add a book to the book index.
+	void addToBookIndex (const string& bookTitle, BookRecord& bRec);
+
+	//! Keep all the books read by loadBookIndex.
+	void setIndexRows (RecordBatch *rows);
+
+	//! Set the record from the book data.
+	virtual void setRecord (SyncClass *rec, string_view bookTitle,
+		BookRecord& bRec) = 0;
+
+	//! Update the book index entry after a write.
+	virtual void refreshBookIndex (SyncClass *newData);
+
+	//! Record the values of the books in the book index.
+	void recordIndex (SyncClass *rec, SyncState *state);
+
+	//! Open the DB read only.
+	void setReadOnly (bool val);
+
+	//! Set the number of books to update per transaction.
+	void setCommitEvery (int n);
+
+	//! Begin a transaction for the updates.
+	int beginTransaction (void);
+
+	//! Commit the open transaction.
+	int commitTransaction (void);
+
+	//! Roll back the open transaction.
+	int rollbackTransaction (void);
+
+	//! Record a book update, commit the batch if it is full.
+	int bookUpdated (void);
+
+	//! Get the number of committed transactions.
+	int getCommitCount (void);
+
+	//! Get the number of books updated in the committed transactions.
+	int getCommittedBooks (void);
+
+	//! Stage the updates in a temp table and apply them in bulk.
+	int setupStaging (void);
+
+	//! Limit the records fetched to a range of book ids.
+	void setIdRange (int lo, int hi);
+
+	//! Get the lowest and the highest id of the fetched books.
+	virtual int getIdBounds (int *minId, int *maxId) = 0;
+
+	//! Create a read only DB of the same kind to fetch an id range.
+	virtual SyncDb *newShard (int lo, int hi) = 0;
+
+	//! Hash the book data the sync reads.
+	virtual int dataHash (string& hash) = 0;
+
+	//! Fetch and index only the books in the marked title tree leaves.
+	void setLeafFilter (vector<bool> *dirty, int bits);
+
+	//! Check if a title is in a marked leaf, see setLeafFilter.
+	bool inLeafFilter (const unsigned char *title, int len);
+
+	//! Hash the standard rating and state of the books by title tree leaf.
+	virtual int leafHashes (SyncClass *rec, int bits,
+		vector<TreeLeaf>& leaves) = 0;
 };
 
 //! Class for Calibre
 class CalibreDb : public SyncDb
 {
 private :
-	//! DB Handle.
-	sqlite3 *dbPtr;
-
 	//! FetchRecord statement.
 	sqlite3_stmt *cFetchRecordsStmt;
 
 	//! fetch statement trail.
 	const char *cFetchStmtTrail;
 
-	//! State info statement.
-	sqlite3_stmt *calibreStateStmt;
-
 	//! Book info statement
 	sqlite3_stmt *cGetBookInfStmt;
 
@@ -78,21 +401,30 @@ private :
 	//! Calibre rating update statement trail.
 	const char *cUpdateRatingStmtTrail;
 
-	//! Calibre rating insert statement
-	sqlite3_stmt *cInsRatingStmt;
-
-	//! Calibre rating insert statement trail.
-	const char *cInsRatingStmtTrail;
-
 	//! Calibre state update statement.
 	sqlite3_stmt *cUpdateStateStmt;
 
 	//! Calibre state update statement trail.
 	const char *cUpdateStateStmtTrail;
 
+	//! Calibre - Reader join statement.
+	sqlite3_stmt *cJoinStmt;
+
+	//! Calibre - Reader join statement trail.
+	const char *cJoinStmtTrail;
+
 	//! Table id for custom states.
 	int tabId;
 
+	//! Flag indicating that the books are fetched by last_modified.
+	bool deltaFetch;
+
+	//! Fetch the books modified after this time, all if empty.
+	string modifiedSince;
+
+	//! Latest last_modified in the books table, see loadLastModified.
+	string lastModified;
+
 public :
 
 	//! CalibreDb constructor
@@ -116,15 +448,15 @@ public :
 	//! Fetch records from Calibre db
 	int fetchRecords (SyncClass *cRec);
 
+	//! Fetch the next Calibre records into a batch.
+	int fetchBatch (RecordBatch& batch, size_t rows);
+
 	//! Method to find the state info.
 	int getCustomTabId (string stateFName, int *tabId);
 
-	//! Method to prepare SQL statements for fetching Calibre state info.
+	//! Method to prepare SQL statements for the Calibre state info.
 	int setupStateOps (int tabId);
 
-	//! Fetch the read state info from the Calibre Db.
-	int getCalibreStateInfo (int id, int *state);
-
 	//! Finalize state info statements.
 	int finalizeStateOps (void);
 
@@ -135,22 +467,62 @@ public :
 	int loadRatingIds (map<int, int>& cRates);
 
 	//! Get the book info from the Calibre db.
-	int getBookInfo (SyncClass *cRec, string bookTitle);
+	int getBookInfo (SyncClass *cRec, const string& bookTitle);
 
 	//! Update the rating in the Calibre db.
 	int updateRating (SyncClass *newData);
 
-	//! Insert rating in Calibre db.
-	int insertRating (SyncClass *newData);
-
 	//! Method to update the state in Calibre DB.
 	int updateState (SyncClass *newData);
 
+	//! Load all the Calibre books into the book index.
+	int loadBookIndex (void);
+
+	//! Set the Calibre record from the book data.
+	void setRecord (SyncClass *cRec, string_view bookTitle,
+		BookRecord& bRec);
+
+	//! Attach the Reader DB to the Calibre DB connection.
+	int attachDB (char *fName);
+
+	//! Prepare the Calibre - Reader join statement.
+	int setupJoinStmt (bool toReader, SyncClass *cRec, SyncClass *rRec);
+
+	//! Fetch the Calibre - Reader book pairs that are out of sync.
+	int fetchJoinedRecords (vector<JoinedRecord>& joined);
+
+	//! Apply the staged changes to the Calibre tables.
+	int applyStaged (void);
+
 	//! Method to set table id.
 	void setTabId (int tId);
 
 	//! Get method for custom table id.
 	int getTabId (void);
+
+	//! Fetch only the books modified after the given time.
+	void setModifiedSince (string since);
+
+	//! Get method for deltaFetch flag.
+	bool getDeltaFetch (void);
+
+	//! Find the latest last_modified in the books table.
+	int loadLastModified (void);
+
+	//! Get the latest last_modified found by loadLastModified.
+	string getLastModified (void);
+
+	//! Get the lowest and the highest id of the fetched books.
+	int getIdBounds (int *minId, int *maxId);
+
+	//! Create a read only DB of the same kind to fetch an id range.
+	SyncDb *newShard (int lo, int hi);
+
+	//! Hash the book data the sync reads.
+	int dataHash (string& hash);
+
+	//! Hash the standard rating and state of the books by title tree leaf.
+	int leafHashes (SyncClass *rec, int bits, vector<TreeLeaf>& leaves);
 };
 
 //! Class for Reader
@@ -175,9 +547,6 @@ private :
 	//! Update flag statment trail for Reader.
 	const char *rUpdateFlagStmtTrail;
 
-	//! DB Handle.
-	sqlite3 *dbPtr;
-
 	//! Flags - specific to Reader
 	int flags;
 
@@ -204,16 +573,47 @@ public :
 	//! Fetch records from Reader Db.
 	int fetchRecords (SyncClass *rRec);
 
+	//! Fetch the next Reader records into a batch.
+	int fetchBatch (RecordBatch& batch, size_t rows);
+
 	//! Fetch book info from Reader db.
-	int getBookInfo (SyncClass *rRec, string bookTitle);
+	int getBookInfo (SyncClass *rRec, const string& bookTitle);
 
 	//! Update the rating in the Reader db.
 	int updateRating (SyncClass *newData);
 
-	//! Insert rating in Reader db.
-	int insertRating (SyncClass *newData);
-
 	//! Method to update the state in Calibre DB.
 	int updateState (SyncClass *newData);
+
+	//! Load all the Reader books into the book index.
+	int loadBookIndex (void);
+
+	//! Set the Reader record from the book data.
+	void setRecord (SyncClass *rRec, string_view bookTitle,
+		BookRecord& bRec);
+
+	//! Apply the staged changes to the Reader book table.
+	int applyStaged (void);
+
+	//! Update the book index entry after a write.
+	void refreshBookIndex (SyncClass *newData);
+
+	//! Update the rating and state with a single flags update.
+	int updateBook (SyncClass *newData, bool rate, bool state);
+
+	//! Write the new flags of the book.
+	int writeFlags (SyncClass *newData, int newFlag);
+
+	//! Get the lowest and the highest id of the fetched books.
+	int getIdBounds (int *minId, int *maxId);
+
+	//! Create a read only DB of the same kind to fetch an id range.
+	SyncDb *newShard (int lo, int hi);
+
+	//! Hash the book data the sync reads.
+	int dataHash (string& hash);
+
+	//! Hash the standard rating and state of the books by title tree leaf.
+	int leafHashes (SyncClass *rec, int bits, vector<TreeLeaf>& leaves);
 };
 #endif
@@ -0,0 +1,245 @@
+using namespace std;
+#include "jlog.hpp"
+#include "syncClass.hpp"
+#include "syncIdCache.hpp"
+#include <algorithm>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//! \file syncIdCache.cc
+//! \brief IdCache class implementation.
+
+//! With --id-cache the source and destination book ids paired by title are
+//! kept in a file between runs. The file is mapped, not read. As the source
+//! books are fetched in id order a pair is mostly found a few entries after
+//! the last one, a binary search on the source id is done otherwise. A pair
+//! is used only if the source book still has the title of the destination
+//! book, a renamed or deleted book falls back to the title lookup and its
+//! pair is replaced.
+
+//! Compare the source ids of two cache entries.
+static bool entryLess (const IdCacheEntry& a, const IdCacheEntry& b)
+{
+	return a.srcId < b.srcId;
+}
+
+//! IdCache constructor.
+IdCache::IdCache (void) : mapAddr (0), mapSize (0), entries (0), count (0),
+	cursor (0), direction (0), partialFetch (false), hits (0), stale (0),
+	misses (0)
+{
+}
+
+//! IdCache destructor, unmaps the file.
+IdCache::~IdCache ()
+{
+	if (mapAddr != 0)
+	{
+		munmap (mapAddr, mapSize);
+	}
+}
+
+//! \fn int IdCache::openCache (const char *fName, string dirName)
+//! \brief Map the cache file of the last run.
+//! A missing file, or one written for the other direction, is not an
+//! error, all the books are paired by title.
+int IdCache::openCache (const char *fName, string dirName)
+{
+	direction = 2166136261U;
+	for (string::iterator c = dirName.begin (); c != dirName.end (); ++c)
+	{
+		direction = (direction ^ (unsigned char) *c) * 16777619U;
+	}
+
+	int fd = open (fName, O_RDONLY);
+	if (fd < 0)
+	{
+		jLOG ("No id cache in [" << fName << "], pairing all books by title.");
+		return SUCCESS;
+	}
+
+	struct stat st;
+	if ((fstat (fd, &st) != 0) || (st.st_size < (off_t) sizeof (IdCacheHeader)))
+	{
+		jWARN ("Invalid id cache [" << fName << "], not used.");
+		close (fd);
+		return SUCCESS;
+	}
+
+	mapSize = st.st_size;
+	mapAddr = mmap (0, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (mapAddr == MAP_FAILED)
+	{
+		jERR ("Unable to map the id cache [" << fName << "]");
+		mapAddr = 0;
+		return FAIL;
+	}
+
+	const IdCacheHeader *header = (const IdCacheHeader *) mapAddr;
+	if ((memcmp (header->magic, ID_CACHE_MAGIC, sizeof (header->magic)) != 0)
+		|| (mapSize != sizeof (IdCacheHeader)
+			+ header->count * sizeof (IdCacheEntry)))
+	{
+		jWARN ("Invalid id cache [" << fName << "], not used.");
+		return SUCCESS;
+	}
+	if (header->direction != direction)
+	{
+		jWARN ("Id cache [" << fName << "] is not for " << dirName
+			<< ", not used.");
+		return SUCCESS;
+	}
+
+	entries = (const IdCacheEntry *) (header + 1);
+	count = header->count;
+	jLOG ("Mapped " << count << " cached book pairs from [" << fName << "]");
+	return SUCCESS;
+}
+
+//! \fn const IdCacheEntry *IdCache::findPair (int srcId)
+//! \brief Find the cached pair of a source book.
+//! \return The entry, 0 if the book is not in the cache.
+const IdCacheEntry *IdCache::findPair (int srcId)
+{
+	size_t pos = cursor;
+	for (int step = 0; (step < ID_CACHE_STEPS) && (pos < count) &&
+		(entries[pos].srcId < srcId); step++)
+	{
+		pos++;
+	}
+
+	//! The entry is not within the steps after the last one found, or the
+	//! source ids are not in order.
+	if ((pos == count) || (entries[pos].srcId < srcId) ||
+		((pos > 0) && (entries[pos - 1].srcId >= srcId)))
+	{
+		IdCacheEntry key;
+		key.srcId = srcId;
+		pos = lower_bound (entries, entries + count, key, entryLess) - entries;
+	}
+
+	cursor = pos;
+	if ((pos == count) || (entries[pos].srcId != srcId))
+	{
+		return 0;
+	}
+	return entries + pos;
+}
+
+//! \fn void IdCache::countLookup (const IdCacheEntry *entry, bool valid)
+//! \brief Count a lookup, see SyncDb::matchBook.
+void IdCache::countLookup (const IdCacheEntry *entry, bool valid)
+{
+	if (entry == 0)
+	{
+		misses++;
+	}
+	else if (valid == true)
+	{
+		hits++;
+	}
+	else
+	{
+		stale++;
+	}
+}
+
+//! \fn void IdCache::addPair (int srcId, int destId)
+//! \brief Record the pair of a source book found in this run.
+void IdCache::addPair (int srcId, int destId)
+{
+	IdCacheEntry e;
+	e.srcId = srcId;
+	e.destId = destId;
+	found.push_back (e);
+}
+
+//! \fn void IdCache::setPartialFetch (bool partial)
+//! \brief Keep the pairs of the books not fetched in this run.
+//! Used when only some of the source books are fetched, see --tree.
+void IdCache::setPartialFetch (bool partial)
+{
+	partialFetch = partial;
+}
+
+//! \fn int IdCache::saveCache (const char *fName)
+//! \brief Write the cache file for the next run.
+//! Only the pairs found in this run are written, unless the fetch is
+//! partial, then the pairs of the last run not found again are kept. The
+//! file is written under a temporary name and renamed.
+int IdCache::saveCache (const char *fName)
+{
+	stable_sort (found.begin (), found.end (), entryLess);
+
+	vector<IdCacheEntry> pairs;
+	pairs.reserve (found.size () + ((partialFetch == true) ? count : 0));
+	size_t m = (partialFetch == true) ? 0 : count;
+	for (size_t i = 0; i < found.size (); i++)
+	{
+		//! A source book found more than once keeps its last pair.
+		if ((i + 1 < found.size ()) && (found[i + 1].srcId == found[i].srcId))
+		{
+			continue;
+		}
+		while ((m < count) && (entries[m].srcId < found[i].srcId))
+		{
+			pairs.push_back (entries[m++]);
+		}
+		if ((m < count) && (entries[m].srcId == found[i].srcId))
+		{
+			m++;
+		}
+		pairs.push_back (found[i]);
+	}
+	while (m < count)
+	{
+		pairs.push_back (entries[m++]);
+	}
+
+	string tmpName = string (fName) + ".tmp";
+	FILE *out = fopen (tmpName.c_str (), "wb");
+	if (out == 0)
+	{
+		jERR ("Unable to open id cache file [" << tmpName << "]");
+		return FAIL;
+	}
+
+	IdCacheHeader header;
+	memset (&header, '\0', sizeof (header));
+	memcpy (header.magic, ID_CACHE_MAGIC, sizeof (header.magic));
+	header.direction = direction;
+	header.count = pairs.size ();
+
+	bool ok = (fwrite (&header, sizeof (header), 1, out) == 1);
+	if ((ok == true) && (pairs.size () != 0))
+	{
+		ok = (fwrite (&pairs[0], sizeof (IdCacheEntry), pairs.size (), out)
+			== pairs.size ());
+	}
+	if ((fclose (out) != 0) || (ok != true))
+	{
+		jERR ("Writing id cache file [" << tmpName << "] failed");
+		remove (tmpName.c_str ());
+		return FAIL;
+	}
+	if (rename (tmpName.c_str (), fName) != 0)
+	{
+		jERR ("Unable to rename [" << tmpName << "] to [" << fName << "]");
+		return FAIL;
+	}
+
+	jLOG ("Wrote " << pairs.size () << " book pairs to [" << fName << "]");
+	return SUCCESS;
+}
+
+//! Display the cache statistics.
+void IdCache::displayStats (void)
+{
+	jINFO ("Id cache : " << hits << " pairs used, " << stale
+		<< " stale, " << misses << " books not cached.");
+}
@@ -0,0 +1,107 @@
+#ifndef __SYNCIDCACHE_H
+#define __SYNCIDCACHE_H
+//! \file syncIdCache.hpp
+//! \brief IdCache class declaration.
+
+#include <string>
+#include <vector>
+
+//! Header of the id cache file.
+struct IdCacheHeader
+{
+	//! File type and version, ID_CACHE_MAGIC.
+	char magic[8];
+
+	//! Hash of the sync direction the pairs were resolved for.
+	unsigned int direction;
+
+	//! Number of entries after the header.
+	unsigned int count;
+};
+
+//! A source book paired with its destination book.
+struct IdCacheEntry
+{
+	//! Source book id, the entries are sorted by it.
+	int srcId;
+
+	//! Destination book id.
+	int destId;
+};
+
+//! File type and version of the id cache file.
+#define ID_CACHE_MAGIC "SRIDMAP2"
+
+//! Number of entries IdCache::findPair steps over before it searches.
+#define ID_CACHE_STEPS 8
+
+//! Cache of the source and destination book pairs found by title.
+//! The pairs of the last run are read from a memory mapped file of sorted
+//! fixed width entries, see SyncDb::matchBook. The pairs of this run are
+//! written to a new file at the end.
+class IdCache
+{
+private :
+	//! The mapped file, 0 if there is none.
+	void *mapAddr;
+
+	//! Size of the mapped file.
+	size_t mapSize;
+
+	//! The entries in the mapped file.
+	const IdCacheEntry *entries;
+
+	//! Number of entries in the mapped file.
+	size_t count;
+
+	//! Position of the last entry found, see IdCache::findPair.
+	size_t cursor;
+
+	//! Hash of the sync direction.
+	unsigned int direction;
+
+	//! The pairs found in this run, in the order they were found.
+	vector<IdCacheEntry> found;
+
+	//! Flag indicating that only some of the source books are fetched.
+	bool partialFetch;
+
+	//! Number of pairs found in the cache and still valid.
+	long hits;
+
+	//! Number of pairs found in the cache but no longer valid.
+	long stale;
+
+	//! Number of source books not in the cache.
+	long misses;
+
+public :
+	//! IdCache constructor.
+	IdCache (void);
+
+	//! IdCache destructor, unmaps the file.
+	~IdCache ();
+
+	//! Map the cache file of the last run.
+	int openCache (const char *fName, string dirName);
+
+	//! Find the cached pair of a source book.
+	const IdCacheEntry *findPair (int srcId);
+
+	//! Count a lookup, see SyncDb::matchBook.
+	void countLookup (const IdCacheEntry *entry, bool valid);
+
+	//! Record the pair of a source book found in this run.
+	void addPair (int srcId, int destId);
+
+	//! Keep the pairs of the books not fetched in this run.
+	void setPartialFetch (bool partial);
+
+	//! Write the cache file for the next run.
+	int saveCache (const char *fName);
+
+	//! Display the cache statistics.
+	void displayStats (void);
+};
+
+#endif
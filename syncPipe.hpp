@@ -0,0 +1,148 @@
+#ifndef __SYNCPIPE_H
+#define __SYNCPIPE_H
+//! \file syncPipe.hpp
+//! \brief PipeQueue class, the queue between the sync pipeline stages.
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+//! Number of records a pipeline queue holds.
+#define PIPE_DEPTH 1024
+
+//! Bounded single producer, single consumer ring buffer.
+//! The fetch, match and write stages of the sync run on separate threads
+//! and hand the records over through these queues. Exactly one thread
+//! pushes and one thread pops. A stage that finds the queue full (producer)
+//! or empty (consumer) sleeps until the other stage moves a record, each
+//! such wait is counted as a stall so that the slow stage of the pipeline
+//! can be found. The lock is only taken to wait and to wake a waiting stage.
+template <class T> class PipeQueue
+{
+private :
+	//! The ring buffer, one slot is kept free to tell full from empty.
+	vector<T> slots;
+
+	//! Next slot to pop, written by the consumer only.
+	atomic<size_t> head;
+
+	//! Next slot to push, written by the producer only.
+	atomic<size_t> tail;
+
+	//! Flag indicating that the producer is done.
+	atomic<bool> closed;
+
+	//! Flag indicating that the producer waits for a free slot.
+	atomic<bool> pushWaiting;
+
+	//! Flag indicating that the consumer waits for a record.
+	atomic<bool> popWaiting;
+
+	//! Lock of the waiting stage.
+	mutex waitLock;
+
+	//! Signalled when a record is pushed or popped or the queue is closed.
+	condition_variable moved;
+
+	//! Number of times the producer waited for a free slot.
+	long fullStalls;
+
+	//! Number of times the consumer waited for a record.
+	long emptyStalls;
+
+	//! Get the slot after i.
+	size_t next (size_t i)
+	{
+		return (i + 1) % slots.size ();
+	}
+
+	//! \brief Wake the other stage if it waits.
+	//! The flag is set by the waiting stage under the lock before it checks
+	//! the queue again, so either it sees the move or it is woken here.
+	void wake (atomic<bool>& waiting)
+	{
+		if (waiting.load () == true)
+		{
+			lock_guard<mutex> lock (waitLock);
+			moved.notify_one ();
+		}
+	}
+
+public :
+	//! PipeQueue constructor.
+	PipeQueue (size_t depth) : slots (depth + 1), head (0), tail (0),
+		closed (false), pushWaiting (false), popWaiting (false),
+		fullStalls (0), emptyStalls (0)
+	{
+	}
+
+	//! \brief Add a record, waits while the queue is full.
+	void push (T& item)
+	{
+		size_t t = tail.load (memory_order_relaxed);
+		if (next (t) == head.load ())
+		{
+			fullStalls++;
+			unique_lock<mutex> lock (waitLock);
+			pushWaiting.store (true);
+			while (next (t) == head.load ())
+			{
+				moved.wait (lock);
+			}
+			pushWaiting.store (false);
+		}
+		slots[t] = std::move (item);
+		tail.store (next (t));
+		wake (popWaiting);
+	}
+
+	//! \brief Take the next record, waits while the queue is empty.
+	//! \return false if the queue is closed and all records are taken.
+	bool pop (T& item)
+	{
+		size_t h = head.load (memory_order_relaxed);
+		if (h == tail.load ())
+		{
+			emptyStalls++;
+			unique_lock<mutex> lock (waitLock);
+			popWaiting.store (true);
+			while ((h == tail.load ()) && (closed.load () != true))
+			{
+				moved.wait (lock);
+			}
+			popWaiting.store (false);
+			//! The last push may have come before the close.
+			if (h == tail.load ())
+			{
+				return false;
+			}
+		}
+		item = std::move (slots[h]);
+		head.store (next (h));
+		wake (pushWaiting);
+		return true;
+	}
+
+	//! \brief No more records will be pushed, called by the producer.
+	void close (void)
+	{
+		closed.store (true);
+		lock_guard<mutex> lock (waitLock);
+		moved.notify_one ();
+	}
+
+	//! Number of times the producer waited for a free slot.
+	long getFullStalls (void)
+	{
+		return fullStalls;
+	}
+
+	//! Number of times the consumer waited for a record.
+	long getEmptyStalls (void)
+	{
+		return emptyStalls;
+	}
+};
+
+#endif
@@ -0,0 +1,131 @@
+using namespace std;
+#include "jlog.hpp"
+#include "syncClass.hpp"
+#include "syncPlan.hpp"
+#include <fstream>
+
+//! \file syncPlan.cc
+//! \brief SyncPlan class implementation.
+
+//! The main loop of syncReaders first plans the changes for the
+//! destination DB and then applies them. The plan can be displayed and
+//! written to a file without touching the destination DB, see --dry-run.
+
+//! \fn void SyncPlan::addChange (BookChange& change)
+//! \brief Add a change to the plan.
+//! A destination book can be matched by more than one source book with the
+//! same title. The changes are merged so that every destination book is
+//! written once, with the values of the last change and the values in the
+//! DB before the first one.
+void SyncPlan::addChange (BookChange& change)
+{
+	unordered_map<int, size_t>::iterator i = changeIdx.find (change.id);
+	if (i == changeIdx.end ())
+	{
+		changeIdx[change.id] = changes.size ();
+		changes.push_back (change);
+		return;
+	}
+
+	BookChange& prev = changes[(*i).second];
+	if (change.rateChange)
+	{
+		prev.rateChange = true;
+		prev.newRating = change.newRating;
+	}
+	if (change.stateChange)
+	{
+		prev.stateChange = true;
+		prev.newState = change.newState;
+	}
+}
+
+//! Number of changes in the plan.
+size_t SyncPlan::size (void)
+{
+	return changes.size ();
+}
+
+//! Get the change at the given position.
+BookChange& SyncPlan::getChange (size_t i)
+{
+	return changes[i];
+}
+
+//! Remove all changes from the plan.
+void SyncPlan::clear (void)
+{
+	changes.clear ();
+	changeIdx.clear ();
+}
+
+//! \fn void SyncPlan::displayPlan (void)
+//! \brief Display the planned changes.
+void SyncPlan::displayPlan (void)
+{
+	for (vector<BookChange>::iterator i = changes.begin ();
+		i != changes.end (); ++i)
+	{
+		jINFO ("Plan Id =" << setw(5) << (*i).id << ", Rating = "
+		<< (*i).oldRating << " -> "
+		<< ((*i).rateChange ? (*i).newRating : (*i).oldRating)
+		<< ", State = " << (*i).oldState << " -> "
+		<< ((*i).stateChange ? (*i).newState : (*i).oldState)
+		<< ", Title = " << (*i).title);
+	}
+}
+
+//! \fn int SyncPlan::exportPlan (const char *fName)
+//! \brief Write the plan to a file.
+//! The plan is written as tab separated values, one change per line after
+//! a header line. The rating and state are the values stored in the
+//! destination DB. Tabs, newlines and backslashes in the title are escaped.
+int SyncPlan::exportPlan (const char *fName)
+{
+	ofstream out (fName);
+	if (!out)
+	{
+		jERR ("Unable to open plan file [" << fName << "]");
+		return FAIL;
+	}
+
+	out << "#id\tlinkId\tchange\toldRating\tnewRating\toldState\tnewState"
+		<< "\toldFlags\ttitle" << endl;
+	for (vector<BookChange>::iterator i = changes.begin ();
+		i != changes.end (); ++i)
+	{
+		string title;
+		for (string::iterator c = (*i).title.begin ();
+			c != (*i).title.end (); ++c)
+		{
+			switch (*c)
+			{
+				case '\t' : title += "\\t"; break;
+				case '\n' : title += "\\n"; break;
+				case '\\' : title += "\\\\"; break;
+				default : title += *c; break;
+			}
+		}
+
+		string change;
+		change += (*i).rateChange ? "R" : "";
+		change += (*i).stateChange ? "S" : "";
+
+		out << (*i).id << "\t" << (*i).linkId << "\t" << change << "\t"
+			<< (*i).oldRating << "\t"
+			<< ((*i).rateChange ? (*i).newRating : (*i).oldRating) << "\t"
+			<< (*i).oldState << "\t"
+			<< ((*i).stateChange ? (*i).newState : (*i).oldState) << "\t"
+			<< (*i).oldFlags << "\t" << title << endl;
+	}
+
+	out.close ();
+	if (!out)
+	{
+		jERR ("Writing plan file [" << fName << "] failed");
+		return FAIL;
+	}
+
+	jLOG ("Wrote " << changes.size () << " changes to [" << fName << "]");
+	return SUCCESS;
+}
@@ -0,0 +1,73 @@
+#ifndef __SYNCPLAN_H
+#define __SYNCPLAN_H
+//! \file syncPlan.hpp
+//! \brief SyncPlan class declaration.
+
+#include <vector>
+#include <unordered_map>
+
+//! Change planned for a destination book.
+struct BookChange
+{
+	//! The book title
+	string title;
+
+	//! Destination book id.
+	int id;
+
+	//! Destination link id, -1 if the rating link is not present.
+	int linkId;
+
+	//! Flag indicating that the rating changes.
+	bool rateChange;
+
+	//! Flag indicating that the state changes.
+	bool stateChange;
+
+	//! Rating in the destination DB.
+	int oldRating;
+
+	//! New rating for the destination DB.
+	int newRating;
+
+	//! State in the destination DB.
+	int oldState;
+
+	//! New state for the destination DB.
+	int newState;
+
+	//! Flags in the destination DB - specific to Reader.
+	int oldFlags;
+};
+
+//! Change set produced by the planning phase and written by the apply phase.
+class SyncPlan
+{
+private :
+	//! The planned changes in the order they were found.
+	vector<BookChange> changes;
+
+	//! Position of the change for a destination book id.
+	unordered_map<int, size_t> changeIdx;
+
+public :
+	//! Add a change, merging it with an earlier change of the same book.
+	void addChange (BookChange& change);
+
+	//! Number of changes in the plan.
+	size_t size (void);
+
+	//! Get a change.
+	BookChange& getChange (size_t i);
+
+	//! Remove all changes.
+	void clear (void);
+
+	//! Display the changes.
+	void displayPlan (void);
+
+	//! Write the plan to a file.
+	int exportPlan (const char *fName);
+};
+
+#endif
@@ -17,10 +17,25 @@ using namespace std;
 #include <getopt.h>
 #include <string.h>
 #include <limits.h>
+#include <errno.h>
 #include <cstdlib>
+#include <vector>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <fstream>
 #include "jlog.hpp"
 #include "syncClass.hpp"
 #include "syncDbClass.hpp"
+#include "syncVfs.hpp"
+#include "syncPlan.hpp"
+#include "syncPipe.hpp"
+#include "syncState.hpp"
+#include "syncTree.hpp"
+#include "syncIdCache.hpp"
+#include "syncWatch.hpp"
+#include "syncBase.hpp"
 
 //! \file syncReaders.cc Synchronize Calibre and Cool Reader database files.
 //! \brief Synchronize Calibre and Cool Reader SQLite database files.
@@ -38,14 +53,198 @@ using namespace std;
 // Calibre related entities referred as Calibre xyz or prefixed with 'C'.
 // Cool Reader related entities referred as Reader xyz or prefixed with 'R'.
 
+//! Nothing is scanned after the DB is set up, see DbLoad.
+#define SCAN_NONE 0
+
+//! The destination books are loaded into the book index, see DbLoad.
+#define SCAN_INDEX 1
+
+//! The source records are fetched, see DbLoad.
+#define SCAN_RECORDS 2
+
+//! Work and result of a DB loading thread, see loadCalibre and loadReader.
+struct DbLoad
+{
+	//! The SQLite Database file name.
+	char *dbFile;
+
+	//! SCAN_NONE, SCAN_INDEX or SCAN_RECORDS.
+	int scan;
+
+	//! Number of shards for SCAN_RECORDS.
+	int jobs;
+
+	//! The fetch queue for SCAN_RECORDS.
+	PipeQueue<RecordBatch> *records;
+
+	//! SUCCESS or FAIL.
+	int retVal;
+};
+
+//! Sync of one Reader DB in a multi device run, see syncDevices.
+struct DeviceSync
+{
+	//! The Reader SQLite Database file name.
+	string dbFile;
+
+	//! Reader db access class, the device's own connection.
+	ReaderDb rDb;
+
+	//! Reader record for the fetch and the destination.
+	Reader rData;
+
+	//! Reader record with the planned rating/state.
+	Reader newRdrData;
+
+	//! Reader record used for the writes.
+	Reader wRdrData;
+
+	//! The Reader records, for reader2cal.
+	RecordBatch records;
+
+	//! The changes planned for the device.
+	SyncPlan plan;
+
+	//! Books updated for the device.
+	int updated;
+
+	//! Commits made for the device.
+	int commits;
+
+	//! SUCCESS or FAIL.
+	int retVal;
+};
+
+//! Shared state of a multi device run, see syncDevices.
+struct DeviceRun
+{
+	//! Calibre db access class, shared by the devices.
+	CalibreDb cDb;
+
+	//! Calibre record with the rating and state lookups.
+	Calibre cData;
+
+	//! The Calibre records, for cal2reader. Read only once loaded.
+	RecordBatch cRecords;
+
+	//! Result of loading the Calibre DB, ready when it is loaded.
+	shared_future<int> calibreReady;
+
+	//! The devices.
+	vector<DeviceSync> devices;
+
+	//! Next device for a worker thread.
+	atomic<size_t> next;
+
+	//! Sync direction is cal2reader.
+	bool toReader;
+
+	//! Books to update per transaction.
+	int commitEvery;
+
+	//! Stage the updates and apply them in bulk.
+	bool bulkFlag;
+
+	//! Plan the changes without updating the DBs.
+	bool dryRun;
+
+	//! Number of shards to scan the Calibre DB in.
+	int jobs;
+};
+
+//! One id range of a sharded source scan, see scanShards.
+struct ShardScan
+{
+	//! Lowest book id of the shard.
+	int lo;
+
+	//! Highest book id of the shard.
+	int hi;
+
+	//! The shard's own read only DB connection.
+	SyncDb *db;
+
+	//! The records of the shard in the fetch order.
+	RecordBatch records;
+
+	//! Scan time in seconds.
+	double secs;
+
+	//! SUCCESS or FAIL.
+	int retVal;
+};
+
+//! The three-way merge of -d both with a base snapshot, see mergeBook.
+struct MergeRun
+{
+	//! Snapshot of the last merge.
+	SyncBase *base;
+
+	//! Calibre record, gets the planned Calibre values.
+	SyncClass *newCalData;
+
+	//! The Calibre changes.
+	SyncPlan *calPlan;
+};
+
 // Function prototypes.
-int processArgs (int argc, char **argv, char *CDbFile, char *RDbFile,
-	string& direction, string& stateVal,string& lvl);
+int processArgs (int argc, char **argv, char *CDbFile,
+	vector<string>& RDbFiles, string& direction, string& stateVal,
+	string& lvl, bool& attachFlag,
+	int& commitEvery, bool& bulkFlag, bool& dryRun, string& planFile,
+	int& jobs, string& stateFile, bool& deltaFlag, string& sinceTime,
+	string& fpFile, bool& treeFlag, string& idCacheFile, bool& watchFlag,
+	string& baseFile);
+int parseCount (const char *arg, int *count);
 void help (char *progName);
-int setupDbOps (CalibreDb& cDB, ReaderDb& rDB, char *CDbFile,
-	char *RDbFile, string stateVal, int *tabId);
+void loadCalibre (CalibreDb *cDb, Calibre *cData, DbLoad *load,
+	string stateVal, char *RDbFile, bool attachFlag);
+void loadReader (ReaderDb *rDb, DbLoad *load);
+int setupCalibre (CalibreDb *cDb, Calibre *cData, char *CDbFile,
+	string stateVal, char *RDbFile, bool attachFlag);
+int setupReader (ReaderDb *rDb, char *RDbFile);
+int scanDb (SyncDb *db, DbLoad *load);
 int clearDbOps (CalibreDb& cDb, ReaderDb& rDb);
-int updateData (SyncClass *Source, SyncClass *Dest, SyncDb *DestDb, SyncClass *newData);
+int syncBook (SyncClass *Source, SyncClass *Dest, SyncDb *destDB,
+	SyncClass *NewData, SyncPlan& plan, PipeQueue<BookChange> *changeQ);
+void matchRecords (SyncDb *sourceDB, SyncClass *Source, SyncClass *Dest,
+	SyncDb *destDB, SyncClass *NewData, SyncPlan *plan,
+	PipeQueue<RecordBatch> *fetchQ, PipeQueue<BookChange> *changeQ,
+	SyncState *syncState, bool indexSource, MergeRun *merge);
+int mergeBook (SyncClass *cRec, SyncClass *rRec, SyncDb *rDb,
+	SyncClass *newRdrData, SyncPlan& plan, PipeQueue<BookChange> *changeQ,
+	MergeRun *merge);
+void writeChanges (SyncDb *destDB, SyncClass *newData,
+	PipeQueue<BookChange> *changeQ, int *retVal);
+int fetchAll (SyncDb *db, RecordBatch& records);
+int scanShards (SyncDb *db, char *dbFile, int jobs, RecordBatch *records,
+	PipeQueue<RecordBatch> *fetchQ);
+void scanShard (ShardScan *shard, char *dbFile);
+int applyPlan (SyncPlan& plan, SyncDb *destDB, SyncClass *newData);
+int syncDevices (char *CDbFile, vector<string>& RDbFiles, bool toReader,
+	string stateVal, int commitEvery, bool bulkFlag, bool dryRun,
+	string planFile, int jobs);
+int loadSharedCalibre (DeviceRun *run, char *CDbFile, string stateVal);
+void deviceWorker (DeviceRun *run);
+int syncDevice (DeviceRun *run, DeviceSync *dev);
+bool planUpdate (SyncClass *Source, SyncClass *Dest, SyncClass *newData,
+	BookChange& change);
+bool planFields (SyncClass *Source, SyncClass *Dest, SyncClass *newData,
+	BookChange& change, bool rate, bool state);
+int updateData (BookChange& change, SyncDb *DestDb, SyncClass *newData);
+int readSinceMark (string fName, string& since);
+int checkFingerprint (SyncFingerprint& fingerprint, string fpFile,
+	char *CDbFile, char *RDbFile, string direction, string stateVal);
+int diffTrees (SyncDb *sourceDB, SyncClass *Source, SyncDb *destDB,
+	SyncClass *Dest, vector<bool>& dirty);
+int writeSinceMark (string fName, string since);
+int watchSync (char *CDbFile, char *RDbFile, bool toReader, string stateVal,
+	int commitEvery, bool bulkFlag);
+void planBack (SyncDb *rDb, SyncClass *rRec, SyncDb *cDb, SyncClass *cRec,
+	SyncClass *newData, RecordBatch& rows, SyncPlan& plan);
+int watchPass (SyncDb *sourceDB, SyncClass *Source, SyncDb *destDB,
+	SyncClass *Dest, SyncClass *NewData, SyncClass *WriteData,
+	SyncState& syncState, bool incremental);
 
 //! \fn int main (int argc, char **argv)
 //! \brief Starting point for syncReaders.
@@ -57,11 +256,14 @@ int updateData (SyncClass *Source, SyncClass *Dest, SyncDb *DestDb, SyncClass *n
 //! \arg \c -c, \c \--calibredb \c CalibreDBFile The Calibre SQLite Database
 //! File
 //! \arg \c -r, \c \--readerdb \c CoolReaderDbFile The CoolReader SQLite
-//! Database File
-//! \arg \c -d, \c \--direction  \c cal2reader | \c reader2cal Direction of
-//! synchronization. The option cal2reader will synchronize the data from
-//! Calibre Db to CoolReader DB and the option reader2cal will synchronize
-//! the data from CoolReader DB to Calibre DB.
+//! Database File. The option can be given more than once to sync the Calibre
+//! DB with the CoolReader DBs of several devices, see syncDevices
+//! \arg \c -d, \c \--direction  \c cal2reader | \c reader2cal | \c both
+//! Direction of synchronization. The option cal2reader will synchronize the
+//! data from Calibre Db to CoolReader DB and the option reader2cal will
+//! synchronize the data from CoolReader DB to Calibre DB. The option both
+//! reads each DB once and raises the lower side of each pair, with the
+//! same result as cal2reader followed by reader2cal, see planBack
 //! \arg \c -s \c customColumnName Name of the custom status column defined in
 //! Calibre. Calibre does not have a read state column by default. In order
 //! to support read state in Calibre, a custom column is required. Using the 
@@ -70,6 +272,46 @@ int updateData (SyncClass *Source, SyncClass *Dest, SyncDb *DestDb, SyncClass *n
 //! the "Lookup Name" should be passed as the customColumnName.
 //! For more details on how custom columns are processed, please refer
 //! CalibreDb::getCustomTabId
+//! \arg \c [ \c -a, \c \--attach \c] Attach the CoolReader DB to the
+//! Calibre DB connection and pair the books with a single join query that
+//! returns only the books that are out of sync. See CalibreDb::setupJoinStmt
+//! \arg \c [ \c -n, \c \--commit-every \c N] Commit the destination DB
+//! updates every N books. By default all the updates are made in a single
+//! transaction. If an update fails, the updates since the last commit are
+//! rolled back.
+//! \arg \c [ \c -b, \c \--bulk \c] Stage the updates in a temp table in
+//! the destination DB and apply them with set based statements at commit.
+//! See SyncDb::setupStaging
+//! \arg \c [ \c -x, \c \--dry-run \c] Plan the changes and display them
+//! without updating the destination DB. Both DBs are opened read only.
+//! \arg \c [ \c -p, \c \--plan \c planFile] Write the planned changes to
+//! planFile as tab separated values. See SyncPlan::exportPlan
+//! \arg \c [ \c -j, \c \--jobs \c N] Scan the source DB in N book id
+//! ranges on parallel threads, each with its own read only connection.
+//! See scanShards
+//! \arg \c [ \c -i, \c \--incremental \c stateFile] Skip the books that
+//! have not changed on either side since the last sync. The values of the
+//! source books and of their destination books are kept in stateFile
+//! between runs. See SyncState
+//! \arg \c [ \c -m, \c \--modified \c] cal2reader only. Fetch the Calibre
+//! books modified since the last run. The latest last_modified time of the
+//! books is kept in CoolReaderDbFile.since. See CalibreDb::setModifiedSince
+//! \arg \c [ \c -S, \c \--since \c time] Fetch the Calibre books modified
+//! after time instead of the time kept by the last run, implies -m.
+//! \arg \c [ \c -f, \c \--fingerprint \c fpFile] Skip the sync if neither
+//! DB has changed since the last sync. The fingerprints of the DBs are kept
+//! in fpFile. See checkFingerprint
+//! \arg \c [ \c -t, \c \--tree \c] Compare hash trees of the books of
+//! both DBs by title and sync only the books in the parts that differ.
+//! See diffTrees
+//! \arg \c [ \c -k, \c \--id-cache \c cacheFile] Keep the source and
+//! destination book ids paired by title in cacheFile and use the pairs in
+//! the next run. See SyncDb::matchBook
+//! \arg \c [ \c -B, \c \--base \c baseFile] With -d both, merge each
+//! value three-way against the values after the last merge, kept in
+//! baseFile, so that a lowered value is kept. See mergeBook
+//! \arg \c [ \c -w, \c \--watch \c] Keep both DBs open and sync them
+//! again each time one of them changes, until interrupted. See watchSync
 //!
 //! \see LVLS
 //! \see CalibreDb::getCustomTabId
@@ -78,9 +320,24 @@ int main (int argc, char **argv)
 {
 	char CDbFile[PATH_MAX];
 	char RDbFile[PATH_MAX];
+	vector<string> RDbFiles;
 	string direction;
 	string stateVal;
 	string lvl;
+	bool attachFlag = false;
+	int commitEvery = 0;
+	bool bulkFlag = false;
+	bool dryRun = false;
+	string planFile;
+	int jobs = 1;
+	string stateFile;
+	bool deltaFlag = false;
+	string sinceTime;
+	string fpFile;
+	bool treeFlag = false;
+	string idCacheFile;
+	bool watchFlag = false;
+	string baseFile;
 
 	int retVal;
 
@@ -91,8 +348,10 @@ int main (int argc, char **argv)
 
 	stateVal.clear ();
 
-	retVal = processArgs (argc, argv, CDbFile, RDbFile, direction,
-		stateVal, lvl);
+	retVal = processArgs (argc, argv, CDbFile, RDbFiles, direction,
+		stateVal, lvl, attachFlag, commitEvery, bulkFlag, dryRun, planFile,
+		jobs, stateFile, deltaFlag, sinceTime, fpFile, treeFlag, idCacheFile,
+		watchFlag, baseFile);
 	if (retVal != SUCCESS)
 	{
 		return FAIL;
@@ -107,8 +366,44 @@ int main (int argc, char **argv)
 	}
 	jTRACE ("processArgs retVal = " << retVal);
 
-	jDBG ("CDbFile [" << CDbFile << "] RDbFile [" << RDbFile);
-	
+	jDBG ("CDbFile [" << CDbFile << "] RDbFiles " << RDbFiles.size ());
+
+	// Count the fsyncs of the DB updates.
+	retVal = registerSyncVfs ();
+	if (retVal != SUCCESS)
+	{
+		jWARN ("fsyncs will not be counted");
+	}
+
+	if (RDbFiles.size () > 1)
+	{
+		//! Sync the Calibre DB with each of the Reader DBs.
+		return syncDevices (CDbFile, RDbFiles, (direction == "cal2reader"),
+			stateVal, commitEvery, bulkFlag, dryRun, planFile, jobs);
+	}
+	strcpy (RDbFile, RDbFiles[0].c_str ());
+
+	if (watchFlag == true)
+	{
+		return watchSync (CDbFile, RDbFile, (direction == "cal2reader"),
+			stateVal, commitEvery, bulkFlag);
+	}
+
+	SyncFingerprint fingerprint;
+	if (fpFile.length () != 0)
+	{
+		retVal = checkFingerprint (fingerprint, fpFile, CDbFile, RDbFile,
+			direction, stateVal);
+		if (retVal == SUCCESS)
+		{
+			jLOG ("Neither DB has changed since the last sync.");
+			return 0;
+		}
+		if (retVal == FAIL)
+		{
+			return FAIL;
+		}
+	}
 
 	// Db Classes.
 	CalibreDb cDb;
@@ -120,9 +415,14 @@ int main (int argc, char **argv)
 	Reader rData;
 	Reader newRdrData;
 
+	// Title info used by the write stage.
+	Calibre wCalData;
+	Reader wRdrData;
+
 	SyncClass *Source = 0; // Source
 	SyncClass *Dest = 0; // Destination
 	SyncClass *NewData = 0; // Class with updated rating/state.
+	SyncClass *WriteData = 0; // Class with the rating/state to write.
 
 	SyncDb *sourceDB = 0; // Source db
 	SyncDb *destDB = 0; // Destination db
@@ -137,72 +437,28 @@ int main (int argc, char **argv)
 		rData.setCustomStatePresent (true);
 	}
 
-	int tabId; // Custom table id for state.
-
-	int retval = setupDbOps (cDb, rDb, CDbFile, RDbFile, stateVal, &tabId);
-	if (retval != SUCCESS)
-	{
-		jERR ("setupDbOps failed");
-		return FAIL;
-	}
-
-	//! Get the Rating ids and the ratings.
-	map <int, int> r;
-	retval = cDb.loadRatingIds (r);
-	if (retval != SUCCESS)
-	{
-		jERR ("loadRatingIds failed");
-		clearDbOps (cDb, rDb);
-		return FAIL;
-	}
-
-	retval = cData.createRatingLookup (r);
-	if (retval != SUCCESS)
-	{
-		jERR ("Calibre createRefLookup failed");
-		return FAIL;
-	}
-	else
+	if (dryRun == true)
 	{
-		jDBG ("Found " << r.size () << " ratings.");
-		for (map<int, int>::iterator i = cData.ratingIdMap.begin ();
-			i != cData.ratingIdMap.end (); ++i)
-		{
-			jDBG ("Rating id [" << (*i).first << "] rating [" << (*i).second);
-		}
+		// Nothing is written in a dry run.
+		cDb.setReadOnly (true);
+		rDb.setReadOnly (true);
 	}
 
-	if (cDb.customStatePresent == true)
+	//! Both directions are synced in the cal2reader pipeline, the Calibre
+	//! changes are planned afterwards from the books read, see planBack.
+	bool bothFlag = (direction == "both");
+	bool toReader = ((direction == "cal2reader") || (bothFlag == true));
+	if (bothFlag == true)
 	{
-		map<int, string> t;
-		// Get the custom Read State values from the Calibre db.
-		retval = cDb.loadReadState (tabId, t);
-		if (retval != SUCCESS)
-		{
-			jERR ("Calibre loadReadState failed.");
-			return FAIL;
-		}
-		else
-		{
-
-			jDBG ("Found " << t.size () << " states.");
-			for (map <int, string>::iterator i = t.begin ();
-				i != t.end (); ++i)
-			{
-				jDBG ("State id [" << (*i).first << "] name [" << (*i).second);
-			}
-
-			jDBG ("Creating ref look up");
-			retval = cData.createRefLookup (t);
-			if (retval != SUCCESS)
-			{
-				jERR ("Calibre createRefLookup failed.");
-				return FAIL;
-			}
-
-		}
+		Source = &cData;
+		Dest = &rData;
+		NewData = &newRdrData;
+		WriteData = &wRdrData;
+		sourceDB = &cDb;
+		destDB = &rDb;
+		jLOG ("Syncing data between Calibre DB and CoolReader DB.");
 	}
-	if (direction == "cal2reader")
+	else if (toReader == true)
 	{
 		// Sync data from Calibre to Reader, set up source and
 		// destination variables.
@@ -211,12 +467,13 @@ int main (int argc, char **argv)
 
 		// Destination is reader, new class should be of type Reader.
 		NewData = &newRdrData;
+		WriteData = &wRdrData;
 
 		sourceDB = &cDb;
 		destDB = &rDb;
 		jLOG ("Syncing data from Calibre DB to CoolReader DB.");
 	}
-	else if (direction == "reader2cal")
+	else
 	{
 		// Sync data from Reader to Calibre, set up source and
 		// destination variables.
@@ -225,384 +482,2341 @@ int main (int argc, char **argv)
 
 		// Destination is Calibre, new class should be of type Calibre.
 		NewData = &newCalData;
+		WriteData = &wCalData;
 
 		sourceDB = &rDb;
 		destDB = &cDb;
 		jLOG ("Syncing data from CoolReader DB to Calibre DB.");
 	}
 
-	while (1)
+	//! The sync runs as a pipeline of three stages on separate threads :
+	//! the source records are fetched, matched against the destination
+	//! book index and the changes are written to the destination DB. The
+	//! stages hand the records over through bounded queues, see PipeQueue.
+	//! The changes are also collected in the plan for the dry run and the
+	//! plan file.
+	SyncPlan plan;
+	SyncPlan backPlan;
+	RecordBatch readerRows;
+	PipeQueue<RecordBatch> fetchQ (PIPE_DEPTH);
+	PipeQueue<BookChange> writeQ (PIPE_DEPTH);
+
+	//! In an incremental sync the source books that have not changed since
+	//! the last sync are not matched, see SyncState.
+	SyncState syncState;
+	SyncState *baseline = 0;
+	if (stateFile.length () != 0)
 	{
-		//! Fetch the data from the source db.
-		retval = sourceDB->fetchRecords (Source);
-		if (retval != SUCCESS)
-		{
-			break;
-		}
-
-		//! Fetch data from the dest Db for the source record.
-		retVal = destDB->getBookInfo (Dest, Source->getTitle());
-		if (retVal != SUCCESS)
+		if (syncState.loadState (stateFile.c_str (), direction, stateVal)
+			!= SUCCESS)
 		{
-			// The book may not be present in the destination DB, skip it.
-			continue;
+			return FAIL;
 		}
+		baseline = &syncState;
+	}
 
-		if ( (Dest->getStdState () < Source->getStdState ()) ||
-			 (Dest->getStdRating () < Source->getStdRating ())
-		)
+	//! The destination books paired in the last run are found by id, see
+	//! SyncDb::matchBook.
+	IdCache idCache;
+	if (idCacheFile.length () != 0)
+	{
+		if (idCache.openCache (idCacheFile.c_str (), direction) != SUCCESS)
 		{
-			jINFO ("");
-			Source->displayData ();
-			Dest->displayData ();
-
-			retVal = updateData (Source, Dest, destDB, NewData);
+			return FAIL;
 		}
+		idCache.setPartialFetch ((baseline != 0) || (deltaFlag == true) ||
+			(treeFlag == true));
+		destDB->setIdCache (&idCache);
 	}
-	jLOG ("Finished syncing.");
-
-	// Clear the DB connections and statements.
-	clearDbOps (cDb, rDb);
-	jTRACE ("Exiting========================================");
-	return (0);
-}
-
-//! \fn int processArgs (int argc, char **argv, char *CDbFile,
-//!	char *RDbFile, string& direction, string& stateVal,string& lvl)
-//! \brief Process and validate the input arguments and parameters.
-//! Process and validate the input arguments and parameters. The program
-//! expects three mandatory parameters : -c, -r and -d.
-//! \param [in] argc argc from main().
-//! \param [in] argv argv from main().
-//! \param [out] CDbFile Name of the Calibre database file.
-//! \param [out] RDbFile Name of the Cool Reader database file.
-//! \param [out] direction Sync direction (cal2reader, reader2cal).
-//! \param [out] stateVal State field in Calibre Db.
-//! \param [out] lvl The log level (DBG, TRACE).
-int processArgs (int argc, char **argv, char *CDbFile, char *RDbFile,
-	string& direction, string& stateVal, string& lvl)
-{
-	static struct option glyphOptions[] = 
-	{
-		{"calibredb",		required_argument,	0, 'c'},
-		{"readerdb",		required_argument,	0, 'r'},
-		{"direction",		required_argument,	0, 'd'},
-		{"state",			required_argument,	0, 's'},
-		{"log",				required_argument,	0, 'l'},
-		{"help",			no_argument, 		0, 'h'},
-		{0,					0,					0, 0}
-	};
-
-	int helpFlag = 0;
-	int optIdx = 0;
-	jFNTRY ();
 
-	while (1)
+	//! With a base snapshot the pairs are merged three-way and the Calibre
+	//! changes are planned with the Reader changes, see mergeBook.
+	SyncBase syncBase;
+	MergeRun mergeRun;
+	MergeRun *merge = 0;
+	if (baseFile.length () != 0)
 	{
-		int c = 0;
-		c = getopt_long (argc, argv, "c:r:d:s:l:h", glyphOptions, &optIdx);
-		jDBG ("optIdx " << optIdx);
-		if ( -1 == c )
+		if (syncBase.openBase (baseFile.c_str (), stateVal) != SUCCESS)
 		{
-			break;
+			return FAIL;
 		}
+		mergeRun.base = &syncBase;
+		mergeRun.newCalData = &newCalData;
+		mergeRun.calPlan = &backPlan;
+		merge = &mergeRun;
+	}
 
-		switch (c)
+	//! The high-water mark of the Calibre last_modified fetch is kept
+	//! alongside the Reader DB it was synced to.
+	string markFile = string (RDbFile) + ".since";
+	if (deltaFlag == true)
+	{
+		string since = sinceTime;
+		if ((since.length () == 0) &&
+			(readSinceMark (markFile, since) != SUCCESS))
 		{
-			case 'h' :
-				helpFlag = 1;
-				jDBG ("Help option found");
-				break;
-			case 'c' :
-				jDBG ("i: name = " << glyphOptions[optIdx].name
-						<<", optarg = "<< optarg);
-				strcpy (CDbFile, optarg);
-				// jDBG ("inFile " << CDbFile);
-				break;
-			case 'r' :
-				jDBG ("r: name = " << glyphOptions[optIdx].name
-						<<", optarg = "<< optarg);
-				strcpy (RDbFile, optarg);
-				break;
-			case 'd' :
-				jDBG ("d: name = " << glyphOptions[optIdx].name
-						<<", optarg = "<< optarg);
-				direction = optarg;
-				break;
-			case 's' :
-				jDBG ("s: name = " << glyphOptions[optIdx].name
-						<<", optarg = "<< optarg);
-				stateVal = optarg;
-				break;
-			case 'l' :
-				jDBG ("l: name = " << glyphOptions[optIdx].name
-						<<", optarg = "<< optarg);
-				lvl = optarg;
-				// If trace/debug statements from this functions are required.
-				if (lvl == "TRACE")
-				{
-					SETMSGLVL (TRACE);
-				}
-				jDBG ("Log level " << lvl);
-				break;
-			case '?' :
-				jDBG ("Try " << argv[0] << " --help for more information");
-				exit (2);
-				break;
+			return FAIL;
 		}
-		if (helpFlag)
+		if (since.length () != 0)
 		{
-			help (argv[0]);
-			exit (1);
+			jLOG ("Fetching the Calibre books modified after [" << since
+				<< "]");
+			//! The books not fetched are kept in the baseline.
+			syncState.setPartialFetch (true);
 		}
-
+		cDb.setModifiedSince (since);
 	}
 
-	if (strlen (CDbFile) == 0)
+	//! The Calibre and Reader DBs are independent until the books are
+	//! matched, each is opened, prepared and scanned on its own thread
+	//! with its own connection. The source thread goes on as the fetch
+	//! stage. In attach mode the join does the scan.
+	DbLoad cLoad;
+	DbLoad rLoad;
+	cLoad.dbFile = CDbFile;
+	rLoad.dbFile = RDbFile;
+	cLoad.records = 0;
+	rLoad.records = 0;
+	cLoad.jobs = jobs;
+	rLoad.jobs = jobs;
+	if ((bothFlag == true) && (merge == 0))
 	{
-		jERR ("Calibre DB file not specified, try " << argv[0] << " -h");
-		exit (1);
+		rDb.setIndexRows (&readerRows);
 	}
 
-	if (strlen (RDbFile) == 0)
+	//! In tree mode the DBs are scanned after the trees are compared, only
+	//! the books in the leaves that differ are fetched and indexed.
+	vector<bool> dirtyLeaves;
+	RecordBatch treeRecords;
+	if (treeFlag == true)
 	{
-		jERR ("Cool Reader DB file not specified, try " << argv[0] << " -h");
-		exit (1);
+		cDb.setLeafFilter (&dirtyLeaves, TREE_BITS);
+		rDb.setLeafFilter (&dirtyLeaves, TREE_BITS);
 	}
 
-	if (direction.length() != 0)
+	if ((attachFlag == true) || (treeFlag == true))
 	{
-		if ((direction != "cal2reader") && (direction != "reader2cal"))
-		{
-			jERR ("Invaid direction");
-			exit (1);
-		}
+		cLoad.scan = SCAN_NONE;
+		rLoad.scan = SCAN_NONE;
 	}
 	else
 	{
-		jERR ("Sync direction not specified, try " << argv[0] << " -h");
-		exit (1);
+		cLoad.scan = toReader ? SCAN_RECORDS : SCAN_INDEX;
+		rLoad.scan = toReader ? SCAN_INDEX : SCAN_RECORDS;
+		(toReader ? cLoad : rLoad).records = &fetchQ;
 	}
-	jFX ();
-	return SUCCESS;
-}
 
-//! \fn void help (char *progName)
-//! \brief Display the help text.
-void help (char *progName)
-{
-	cout << "Usage : " << progName <<
-		" -c CalibreDbFile -r CoolReaderDbFile -d direction" << endl;
-	cout << "\t -c, --calibredb  CalibreDbFile" << endl;
-	cout << "\t -r, --readerdb   CoolReaderDbFile" << endl;
-	cout << "\t -d, --direction  Sync direction (cal2reader | reader2cal)" << endl;
-	cout << "\t -s, --state      customColumnName" << endl;
-	cout << "\t [-l, --log]      MessageLevel (DBG | TRACE)" << endl;
-	cout << "\t [-h, --help]     Display this help message" << endl;
-}
+	thread cThread (loadCalibre, &cDb, &cData, &cLoad, stateVal, RDbFile,
+		attachFlag);
+	thread rThread (loadReader, &rDb, &rLoad);
+	thread& sourceThread = toReader ? cThread : rThread;
+	thread& destThread = toReader ? rThread : cThread;
+	DbLoad& sourceLoad = toReader ? cLoad : rLoad;
+	DbLoad& destLoad = toReader ? rLoad : cLoad;
 
-//! int setupDbOps (CalibreDb& cDb, ReaderDb& rDb, char *CDbFile,
-//! char *RDbFile, string stateVal, int *tabId)
-//! \brief Open DB, setup statements
-//! Open the SQLite Database files of Calibre and Reader and invokes the
-//! setupDbStmts to prepare various SQLite statements.
-//! \param [in] cDb Calibre db access class.
-//! \param [in] rDb Reader db access class.
-//! \param [in] CDbFile Calibre SQLite Database file name
-//! \param [in] RDbFile Reader SQLite Database file name
-//! \param [in] stateVal Name of the custom state field
-//! \param [in] tabId The id of the custom table.
-int setupDbOps (CalibreDb& cDb, ReaderDb& rDb, char *CDbFile,
-	char *RDbFile, string stateVal, int *tabId)
-{
 	int retval;
 
-	jFNTRY ();
-
-	// Connect to the Calibre DB
-	retval = cDb.connectToDB (CDbFile);
-	if (retval != SUCCESS)
+	//! The destination has to be loaded before the books are matched.
+	destThread.join ();
+	retval = destLoad.retVal;
+	if ((retval == SUCCESS) && (treeFlag == true))
 	{
-		jFATAL ("Unable to open Calibre DB [" << CDbFile << "]");
-		return FAIL;
-	}
-	else
+		sourceThread.join ();
+		retval = sourceLoad.retVal;
+		if (retval == SUCCESS)
+		{
+			retval = diffTrees (sourceDB, Source, destDB, Dest, dirtyLeaves);
+		}
+		if (retval == SUCCESS)
+		{
+			retval = fetchAll (sourceDB, treeRecords);
+		}
+	}
+	if ((retval == SUCCESS) && (dryRun != true))
+	{
+		destDB->setCommitEvery (commitEvery);
+		if (bulkFlag == true)
+		{
+			retval = destDB->setupStaging ();
+			if (retval != SUCCESS)
+			{
+				jERR ("setupStaging failed");
+			}
+		}
+	}
+	if (retval != SUCCESS)
+	{
+		//! Drain the fetch queue so that the fetch stage can finish. In
+		//! attach and tree mode there is no fetch stage and nothing closes
+		//! the queue.
+		RecordBatch batch;
+		while ((sourceLoad.records != 0) && (fetchQ.pop (batch)))
+		{
+		}
+		if (sourceThread.joinable () == true)
+		{
+			sourceThread.join ();
+		}
+		clearDbOps (cDb, rDb);
+		return FAIL;
+	}
+
+	//! Pair the books with a single join query on the Calibre connection
+	//! with the Reader DB attached. Only the pairs that are out of sync are
+	//! returned. The destination side of the pairs is added to the book
+	//! index so that syncBook finds it. The join runs before the write stage
+	//! is started, in reader2cal the Calibre connection is the destination
+	//! connection the write stage owns.
+	vector<JoinedRecord> joined;
+	if (attachFlag == true)
+	{
+		sourceThread.join ();
+		retval = sourceLoad.retVal;
+
+		if (retval == SUCCESS)
+		{
+			retval = cDb.setupJoinStmt (toReader, &cData, &rData);
+		}
+		if (retval == SUCCESS)
+		{
+			retval = cDb.fetchJoinedRecords (joined);
+		}
+		if (retval != SUCCESS)
+		{
+			jERR ("Joining Calibre and Reader DB failed");
+			joined.clear ();
+		}
+		jDBG ("Found " << joined.size () << " books to sync.");
+
+		for (vector<JoinedRecord>::iterator j = joined.begin ();
+			j != joined.end (); ++j)
+		{
+			destDB->addToBookIndex ((*j).title,
+				toReader ? (*j).rBook : (*j).cBook);
+		}
+	}
+
+	//! Nothing is written in a dry run, there is no write stage.
+	int writeRetVal = SUCCESS;
+	thread writeThread;
+	if (dryRun != true)
+	{
+		writeThread = thread (writeChanges, destDB, WriteData, &writeQ,
+			&writeRetVal);
+	}
+	PipeQueue<BookChange> *changeQ = (dryRun == true) ? 0 : &writeQ;
+
+	if (attachFlag == true)
+	{
+		for (vector<JoinedRecord>::iterator j = joined.begin ();
+			j != joined.end (); ++j)
+		{
+			sourceDB->setRecord (Source, (*j).title,
+				toReader ? (*j).cBook : (*j).rBook);
+			syncBook (Source, Dest, destDB, NewData, plan, changeQ);
+		}
+		writeQ.close ();
+	}
+	else if (treeFlag == true)
+	{
+		BookRecord bRec;
+		for (size_t j = 0; j < treeRecords.size (); j++)
+		{
+			treeRecords.getBook (j, bRec);
+			sourceDB->setRecord (Source, treeRecords.getTitle (j), bRec);
+			syncBook (Source, Dest, destDB, NewData, plan, changeQ);
+		}
+		writeQ.close ();
+	}
+	else
+	{
+		//! The destination books are loaded into the book index and the
+		//! source records are matched against the index instead of running
+		//! a title lookup query in the destination DB for every source
+		//! record. In an incremental sync the pairs are checked against the
+		//! destination values in the index, and the values they are left
+		//! with are recorded for the next run.
+		if (baseline != 0)
+		{
+			destDB->recordIndex (Dest, baseline);
+		}
+		thread matchThread (matchRecords, sourceDB, Source, Dest, destDB,
+			NewData, &plan, &fetchQ, changeQ, baseline,
+			((bothFlag == true) && (merge == 0)), merge);
+		matchThread.join ();
+		if (baseline != 0)
+		{
+			destDB->recordIndex (Dest, baseline);
+			baseline->destSynced ();
+		}
+		writeQ.close ();
+		sourceThread.join ();
+		retval = sourceLoad.retVal;
+	}
+
+	//! The Calibre changes of -d both are written on the Calibre
+	//! connection, once its records are fetched, while the Reader changes
+	//! are still being written.
+	int backRetVal = SUCCESS;
+	if ((bothFlag == true) && (merge == 0) && (retval == SUCCESS))
+	{
+		planBack (&rDb, &rData, &cDb, &cData, &newCalData, readerRows,
+			backPlan);
+	}
+	if ((bothFlag == true) && (retval == SUCCESS) && (dryRun != true) &&
+		(backPlan.size () != 0))
+	{
+		cDb.setCommitEvery (commitEvery);
+		if (bulkFlag == true)
+		{
+			backRetVal = cDb.setupStaging ();
+		}
+		if (backRetVal == SUCCESS)
+		{
+			backRetVal = applyPlan (backPlan, &cDb, &wCalData);
+		}
+	}
+
+	if (writeThread.joinable () == true)
+	{
+		writeThread.join ();
+	}
+	jLOG ("Planned changes for " << plan.size () << " books.");
+	if (bothFlag == true)
+	{
+		jLOG ("Planned changes for " << backPlan.size ()
+			<< " Calibre books.");
+	}
+	destDB->displayLookupStats (toReader ? "Reader" : "Calibre");
+	if (baseline != 0)
+	{
+		jLOG ("Skipped " << syncState.getUnchangedCount ()
+			<< " books unchanged since the last sync.");
+	}
+	if (idCacheFile.length () != 0)
+	{
+		idCache.displayStats ();
+	}
+	if (merge != 0)
+	{
+		syncBase.displayStats ();
+	}
+	jINFO ("Pipeline stalls : fetch " << fetchQ.getFullStalls ()
+		<< ", match " << fetchQ.getEmptyStalls () << " starved, "
+		<< writeQ.getFullStalls () << " blocked, write "
+		<< writeQ.getEmptyStalls () << " starved.");
+
+	if (retval != SUCCESS)
+	{
+		//! The source could not be read completely, the changes written
+		//! so far are kept.
+		jERR ("Reading the source DB failed");
+	}
+
+	if ((planFile.length () != 0) && (bothFlag == true))
+	{
+		//! The changes of each DB go to a plan file of their own.
+		if ((plan.exportPlan ((planFile + ".reader").c_str ()) != SUCCESS) ||
+			(backPlan.exportPlan ((planFile + ".calibre").c_str ())
+			!= SUCCESS))
+		{
+			retval = FAIL;
+		}
+	}
+	else if (planFile.length () != 0)
+	{
+		if (plan.exportPlan (planFile.c_str ()) != SUCCESS)
+		{
+			retval = FAIL;
+		}
+	}
+
+	if (dryRun == true)
+	{
+		plan.displayPlan ();
+		if (bothFlag == true)
+		{
+			jLOG ("Calibre changes :");
+			backPlan.displayPlan ();
+		}
+		jLOG ("Dry run, the destination DB is not updated.");
+		clearDbOps (cDb, rDb);
+		return ((retval == SUCCESS) ? 0 : FAIL);
+	}
+
+	if (writeRetVal != SUCCESS)
+	{
+		jERR ("Syncing failed, " << destDB->getCommittedBooks ()
+			<< " books updated in " << destDB->getCommitCount ()
+			<< " commits were kept.");
+		clearDbOps (cDb, rDb);
+		return FAIL;
+	}
+	if (backRetVal != SUCCESS)
+	{
+		jERR ("Syncing the Calibre DB failed, " << cDb.getCommittedBooks ()
+			<< " books updated in " << cDb.getCommitCount ()
+			<< " commits were kept.");
+		clearDbOps (cDb, rDb);
+		return FAIL;
+	}
+	if (retval != SUCCESS)
+	{
+		clearDbOps (cDb, rDb);
+		return FAIL;
+	}
+	jLOG ("Finished syncing.");
+
+	//! The baseline is written only after all the changes are committed,
+	//! a failed run is repeated in full by the next run.
+	if (baseline != 0)
+	{
+		if (syncState.saveState (stateFile.c_str ()) != SUCCESS)
+		{
+			clearDbOps (cDb, rDb);
+			return FAIL;
+		}
+	}
+	if (idCacheFile.length () != 0)
+	{
+		if (idCache.saveCache (idCacheFile.c_str ()) != SUCCESS)
+		{
+			clearDbOps (cDb, rDb);
+			return FAIL;
+		}
+	}
+	if (merge != 0)
+	{
+		if (syncBase.saveBase (baseFile.c_str ()) != SUCCESS)
+		{
+			clearDbOps (cDb, rDb);
+			return FAIL;
+		}
+	}
+	if ((deltaFlag == true) && (cDb.getLastModified ().length () != 0))
+	{
+		if (writeSinceMark (markFile, cDb.getLastModified ()) != SUCCESS)
+		{
+			clearDbOps (cDb, rDb);
+			return FAIL;
+		}
+	}
+	jLOG ("Updated " << destDB->getCommittedBooks () << " books, "
+		<< destDB->getCommitCount () << " commits, " << getSyncCount ()
+		<< " fsyncs.");
+	if (bothFlag == true)
+	{
+		jLOG ("Updated " << cDb.getCommittedBooks () << " Calibre books, "
+			<< cDb.getCommitCount () << " commits.");
+	}
+
+	//! The fingerprints are taken after the last update, the file times
+	//! after the DBs are closed.
+	if (fpFile.length () != 0)
+	{
+		string cHash;
+		string rHash;
+		retval = cDb.dataHash (cHash);
+		if (retval == SUCCESS)
+		{
+			retval = rDb.dataHash (rHash);
+		}
+		fingerprint.setHashes (cHash, rHash);
+	}
+
+	// Clear the DB connections and statements.
+	clearDbOps (cDb, rDb);
+
+	if (fpFile.length () != 0)
+	{
+		if (retval == SUCCESS)
+		{
+			retval = fingerprint.statFiles (CDbFile, RDbFile);
+		}
+		if (retval == SUCCESS)
+		{
+			retval = fingerprint.savePrint (fpFile.c_str ());
+		}
+		if (retval != SUCCESS)
+		{
+			jERR ("Unable to keep the fingerprints in [" << fpFile << "]");
+			return FAIL;
+		}
+	}
+	jTRACE ("Exiting========================================");
+	return (0);
+}
+
+//! \fn int syncDevices (char *CDbFile, vector<string>& RDbFiles,
+//! bool toReader, string stateVal, int commitEvery, bool bulkFlag,
+//! bool dryRun, string planFile, int jobs)
+//! \brief Sync the Calibre DB with the Reader DBs of several devices.
+//! The Calibre DB is opened, its lookups are loaded and it is scanned once,
+//! the devices are synced on a pool of worker threads, each with its own
+//! Reader connection.
+//!
+//! For cal2reader the Calibre records are fetched once and each worker
+//! matches them against the book index of its device and updates the
+//! device DB. For reader2cal the workers load the device records while the
+//! Calibre book index is loaded, the devices are then matched one after the
+//! other against the Calibre index, as separate runs would do, and the
+//! changes are written to the Calibre DB.
+//!
+//! A summary of each device is displayed at the end. With -p the plan of
+//! each device is written to planFile.N, N being the position of the
+//! device on the command line.
+//! \return 0 if all the devices were synced, FAIL otherwise.
+int syncDevices (char *CDbFile, vector<string>& RDbFiles, bool toReader,
+	string stateVal, int commitEvery, bool bulkFlag, bool dryRun,
+	string planFile, int jobs)
+{
+	int retval = SUCCESS;
+	DeviceRun run;
+
+	run.toReader = toReader;
+	run.commitEvery = commitEvery;
+	run.bulkFlag = bulkFlag;
+	run.dryRun = dryRun;
+	run.jobs = jobs;
+	run.next = 0;
+	run.devices.resize (RDbFiles.size ());
+	for (size_t i = 0; i < RDbFiles.size (); i++)
+	{
+		DeviceSync& dev = run.devices[i];
+		dev.dbFile = RDbFiles[i];
+		dev.updated = 0;
+		dev.commits = 0;
+		dev.retVal = FAIL;
+		dev.rDb.setReadOnly (dryRun);
+		if (stateVal.length () != 0)
+		{
+			dev.rDb.setCustomStatePresent (true);
+			dev.rData.setCustomStatePresent (true);
+		}
+	}
+	if (stateVal.length () != 0)
+	{
+		run.cDb.setCustomStatePresent (true);
+		run.cData.setCustomStatePresent (true);
+	}
+	run.cDb.setReadOnly (dryRun);
+
+	if (toReader == true)
+	{
+		jLOG ("Syncing data from Calibre DB to " << RDbFiles.size ()
+			<< " CoolReader DBs.");
+	}
+	else
+	{
+		jLOG ("Syncing data from " << RDbFiles.size ()
+			<< " CoolReader DBs to Calibre DB.");
+	}
+
+	run.calibreReady = async (launch::async, loadSharedCalibre, &run,
+		CDbFile, stateVal).share ();
+
+	size_t nWorkers = thread::hardware_concurrency ();
+	if (nWorkers == 0)
+	{
+		nWorkers = 2;
+	}
+	if (nWorkers > run.devices.size ())
+	{
+		nWorkers = run.devices.size ();
+	}
+	jDBG ("Starting " << nWorkers << " device workers");
+
+	vector<thread> workers;
+	for (size_t i = 0; i < nWorkers; i++)
+	{
+		workers.push_back (thread (deviceWorker, &run));
+	}
+	for (size_t i = 0; i < workers.size (); i++)
+	{
+		workers[i].join ();
+	}
+
+	if (run.calibreReady.get () != SUCCESS)
+	{
+		jERR ("Loading the Calibre DB failed");
+		retval = FAIL;
+	}
+	else if (toReader != true)
+	{
+		//! Match the devices one after the other, a book already raised
+		//! by a device is compared with the raised values.
+		Calibre newCalData;
+		Calibre wCalData;
+
+		for (size_t i = 0; i < run.devices.size (); i++)
+		{
+			DeviceSync& dev = run.devices[i];
+			if (dev.retVal != SUCCESS)
+			{
+				continue;
+			}
+			BookRecord bRec;
+			for (size_t j = 0; j < dev.records.size (); j++)
+			{
+				dev.records.getBook (j, bRec);
+				dev.rDb.setRecord (&dev.rData, dev.records.getTitle (j), bRec);
+				syncBook (&dev.rData, &run.cData, &run.cDb, &newCalData,
+					dev.plan, 0);
+			}
+		}
+
+		if (dryRun != true)
+		{
+			run.cDb.setCommitEvery (commitEvery);
+			if ((bulkFlag == true) && (run.cDb.setupStaging () != SUCCESS))
+			{
+				jERR ("setupStaging failed");
+				retval = FAIL;
+			}
+			for (size_t i = 0; (retval == SUCCESS) &&
+				(i < run.devices.size ()); i++)
+			{
+				DeviceSync& dev = run.devices[i];
+				if (dev.retVal != SUCCESS)
+				{
+					continue;
+				}
+				int books = run.cDb.getCommittedBooks ();
+				int commits = run.cDb.getCommitCount ();
+				dev.retVal = applyPlan (dev.plan, &run.cDb, &wCalData);
+				dev.updated = run.cDb.getCommittedBooks () - books;
+				dev.commits = run.cDb.getCommitCount () - commits;
+			}
+		}
+	}
+
+	jLOG ("Device summary :");
+	for (size_t i = 0; i < run.devices.size (); i++)
+	{
+		DeviceSync& dev = run.devices[i];
+		if (dryRun == true)
+		{
+			jLOG ("Device " << i + 1 << " [" << dev.dbFile << "]");
+			dev.plan.displayPlan ();
+		}
+		if (planFile.length () != 0)
+		{
+			string devPlan = planFile + "." + to_string (i + 1);
+			if (dev.plan.exportPlan (devPlan.c_str ()) != SUCCESS)
+			{
+				dev.retVal = FAIL;
+			}
+		}
+		if (dev.retVal != SUCCESS)
+		{
+			retval = FAIL;
+		}
+		jLOG (setw (3) << i + 1 << " " << dev.dbFile << " : "
+			<< ((dev.retVal == SUCCESS) ? "ok" : "FAILED") << ", "
+			<< dev.plan.size () << " changes planned, " << dev.updated
+			<< " books updated in " << dev.commits << " commits");
+
+		dev.rDb.displayLookupStats (dev.dbFile);
+		dev.rDb.finalizeStmts ();
+		dev.rDb.disconnectDB ();
+	}
+	run.cDb.displayLookupStats ("Calibre");
+	jLOG ("Finished syncing, " << getSyncCount () << " fsyncs.");
+
+	run.cDb.finalizeStmts ();
+	run.cDb.finalizeStateOps ();
+	run.cDb.disconnectDB ();
+	return ((retval == SUCCESS) ? 0 : FAIL);
+}
+
+//! \fn int loadSharedCalibre (DeviceRun *run, char *CDbFile,
+//! string stateVal)
+//! \brief Load the Calibre DB shared by the devices.
+//! The Calibre records are fetched for cal2reader, the Calibre book index
+//! is loaded for reader2cal. Runs on its own thread, see syncDevices.
+int loadSharedCalibre (DeviceRun *run, char *CDbFile, string stateVal)
+{
+	int retval;
+
+	retval = setupCalibre (&run->cDb, &run->cData, CDbFile, stateVal, 0,
+		false);
+	if (retval != SUCCESS)
+	{
+		return FAIL;
+	}
+
+	if (run->toReader == true)
+	{
+		retval = scanShards (&run->cDb, CDbFile, run->jobs, &run->cRecords,
+			0);
+	}
+	else
+	{
+		retval = run->cDb.loadBookIndex ();
+	}
+	return retval;
+}
+
+//! \fn void deviceWorker (DeviceRun *run)
+//! \brief Worker thread of a multi device run.
+//! Takes the next device until all the devices are done. For cal2reader the
+//! device is synced, see syncDevice. For reader2cal the device records are
+//! fetched.
+void deviceWorker (DeviceRun *run)
+{
+	size_t i;
+
+	while ((i = run->next++) < run->devices.size ())
+	{
+		DeviceSync *dev = &run->devices[i];
+		char RDbFile[PATH_MAX];
+
+		jDBG ("Loading device " << i + 1 << " [" << dev->dbFile << "]");
+		strcpy (RDbFile, dev->dbFile.c_str ());
+		dev->retVal = setupReader (&dev->rDb, RDbFile);
+		if (dev->retVal != SUCCESS)
+		{
+			continue;
+		}
+
+		if (run->toReader == true)
+		{
+			dev->retVal = syncDevice (run, dev);
+		}
+		else
+		{
+			dev->retVal = fetchAll (&dev->rDb, dev->records);
+		}
+	}
+}
+
+//! \fn int syncDevice (DeviceRun *run, DeviceSync *dev)
+//! \brief Sync the Calibre records to the Reader DB of a device.
+//! The device book index is loaded while the Calibre DB may still be
+//! loading, the shared Calibre records are then matched against it and the
+//! device DB is updated.
+int syncDevice (DeviceRun *run, DeviceSync *dev)
+{
+	int retval;
+
+	retval = dev->rDb.loadBookIndex ();
+	if (retval != SUCCESS)
+	{
+		jERR ("loadBookIndex failed for " << dev->dbFile);
+		return FAIL;
+	}
+
+	if (run->calibreReady.get () != SUCCESS)
+	{
+		return FAIL;
+	}
+
+	//! The source record is set for every Calibre record, each device has
+	//! its own copy sharing the Calibre lookups.
+	Calibre src;
+	src = run->cData;
+	BookRecord bRec;
+	for (size_t j = 0; j < run->cRecords.size (); j++)
+	{
+		run->cRecords.getBook (j, bRec);
+		run->cDb.setRecord (&src, run->cRecords.getTitle (j), bRec);
+		syncBook (&src, &dev->rData, &dev->rDb, &dev->newRdrData, dev->plan,
+			0);
+	}
+
+	if (run->dryRun == true)
+	{
+		return SUCCESS;
+	}
+
+	dev->rDb.setCommitEvery (run->commitEvery);
+	if (run->bulkFlag == true)
+	{
+		retval = dev->rDb.setupStaging ();
+		if (retval != SUCCESS)
+		{
+			jERR ("setupStaging failed for " << dev->dbFile);
+			return FAIL;
+		}
+	}
+
+	retval = applyPlan (dev->plan, &dev->rDb, &dev->wRdrData);
+	dev->updated = dev->rDb.getCommittedBooks ();
+	dev->commits = dev->rDb.getCommitCount ();
+	return retval;
+}
+
+//! \fn int applyPlan (SyncPlan& plan, SyncDb *destDB, SyncClass *newData)
+//! \brief Write the planned changes to the destination DB.
+//! If an update fails, the updates since the last commit are rolled back.
+int applyPlan (SyncPlan& plan, SyncDb *destDB, SyncClass *newData)
+{
+	int retval;
+
+	retval = destDB->beginTransaction ();
+	for (size_t i = 0; (retval == SUCCESS) && (i < plan.size ()); i++)
+	{
+		retval = updateData (plan.getChange (i), destDB, newData);
+	}
+
+	if (retval == SUCCESS)
+	{
+		retval = destDB->commitTransaction ();
+	}
+	if (retval != SUCCESS)
+	{
+		destDB->rollbackTransaction ();
+	}
+	return retval;
+}
+
+//! \fn int scanShards (SyncDb *db, char *dbFile, int jobs,
+//! RecordBatch *records, PipeQueue<RecordBatch> *fetchQ)
+//! \brief Fetch the source records in parallel shards.
+//! The book ids of the source DB are split into jobs ranges, each range is
+//! fetched on its own thread with its own read only connection. The shard
+//! records are then passed on in the order of the shards, which is the
+//! order of the single fetch, to records or to fetchQ. The throughput of
+//! each shard is displayed.
+//! \param [in] db The source DB, gives the id range and the shard DBs.
+//! \param [in] dbFile The SQLite Database file name.
+//! \param [in] jobs Number of shards.
+//! \param [out] records Vector to add the records to, or 0.
+//! \param [out] fetchQ Queue to push the records to, or 0.
+int scanShards (SyncDb *db, char *dbFile, int jobs, RecordBatch *records,
+	PipeQueue<RecordBatch> *fetchQ)
+{
+	int retval;
+	int minId;
+	int maxId;
+
+	retval = db->getIdBounds (&minId, &maxId);
+	if (retval == NO_DATA)
+	{
+		jDBG ("No records to fetch");
+		return SUCCESS;
+	}
+	if (retval != SUCCESS)
+	{
+		return FAIL;
+	}
+
+	//! Split the ids into ranges of the same size.
+	long span = ((long) maxId - minId) / jobs + 1;
+	vector<ShardScan> shards (jobs);
+	vector<thread> scans;
+	for (int i = 0; i < jobs; i++)
+	{
+		ShardScan& shard = shards[i];
+		shard.lo = minId + i * span;
+		shard.hi = (i == jobs - 1) ? maxId : (int) (shard.lo + span - 1);
+		shard.db = db->newShard (shard.lo, shard.hi);
+		shard.secs = 0;
+		shard.retVal = FAIL;
+		scans.push_back (thread (scanShard, &shard, dbFile));
+	}
+
+	retval = SUCCESS;
+	for (int i = 0; i < jobs; i++)
+	{
+		ShardScan& shard = shards[i];
+		scans[i].join ();
+		delete shard.db;
+		if (shard.retVal != SUCCESS)
+		{
+			jERR ("Scanning shard " << i + 1 << " failed");
+			retval = FAIL;
+			continue;
+		}
+
+		jINFO ("Shard " << i + 1 << " ids " << shard.lo << " - " << shard.hi
+			<< " : " << shard.records.size () << " records in "
+			<< shard.secs << " s, "
+			<< (long) (shard.secs > 0 ? shard.records.size () / shard.secs : 0)
+			<< " records/s");
+
+		//! Pass the records on as soon as the earlier shards are done, the
+		//! batch of a shard is moved to the match stage as a whole.
+		if (retval != SUCCESS)
+		{
+			continue;
+		}
+		if (fetchQ != 0)
+		{
+			fetchQ->push (shard.records);
+		}
+		else
+		{
+			records->append (shard.records);
+		}
+		shard.records.clear ();
+	}
+	return retval;
+}
+
+//! \fn void scanShard (ShardScan *shard, char *dbFile)
+//! \brief Fetch the records of one shard, runs on its own thread.
+void scanShard (ShardScan *shard, char *dbFile)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now ();
+
+	shard->retVal = shard->db->connectToDB (dbFile);
+	if (shard->retVal == SUCCESS)
+	{
+		shard->retVal = shard->db->setupDbStmts ();
+	}
+	if (shard->retVal == SUCCESS)
+	{
+		shard->retVal = fetchAll (shard->db, shard->records);
+	}
+	shard->db->finalizeStmts ();
+	shard->db->disconnectDB ();
+
+	shard->secs = chrono::duration<double> (chrono::steady_clock::now ()
+		- start).count ();
+}
+
+//! \fn int fetchAll (SyncDb *db, RecordBatch& records)
+//! \brief Fetch all the records of the DB into records.
+int fetchAll (SyncDb *db, RecordBatch& records)
+{
+	int retval;
+
+	records.clear ();
+	retval = db->fetchBatch (records, 0);
+	if (retval != NO_DATA)
+	{
+		jERR ("Fetching the records failed");
+		return FAIL;
+	}
+	return SUCCESS;
+}
+
+//! \fn int processArgs (int argc, char **argv, char *CDbFile,
+//!	vector<string>& RDbFiles, string& direction, string& stateVal,
+//! string& lvl)
+//! \brief Process and validate the input arguments and parameters.
+//! Process and validate the input arguments and parameters. The program
+//! expects three mandatory parameters : -c, -r and -d.
+//! \param [in] argc argc from main().
+//! \param [in] argv argv from main().
+//! \param [out] CDbFile Name of the Calibre database file.
+//! \param [out] RDbFiles Names of the Cool Reader database files, -r can
+//! be given more than once.
+//! \param [out] direction Sync direction (cal2reader, reader2cal, both).
+//! \param [out] stateVal State field in Calibre Db.
+//! \param [out] lvl The log level (DBG, TRACE).
+//! \param [out] attachFlag Pair the books with the attached DB join.
+//! \param [out] commitEvery Books to update per transaction.
+//! \param [out] bulkFlag Stage the updates and apply them in bulk.
+//! \param [out] dryRun Plan the changes without updating the DB.
+//! \param [out] planFile File to write the planned changes to.
+//! \param [out] jobs Number of shards to scan the source DB in.
+//! \param [out] stateFile Sidecar file of the incremental sync.
+//! \param [out] deltaFlag Fetch the Calibre books modified since the last
+//! run.
+//! \param [out] sinceTime Fetch the Calibre books modified after this time.
+//! \param [out] fpFile File to keep the fingerprints of the DBs in.
+//! \param [out] treeFlag Sync the books in the differing tree leaves only.
+//! \param [out] idCacheFile File to keep the book id pairs in.
+//! \param [out] watchFlag Sync again each time a DB changes.
+//! \param [out] baseFile File to keep the base snapshot of the merge in.
+int processArgs (int argc, char **argv, char *CDbFile,
+	vector<string>& RDbFiles, string& direction, string& stateVal,
+	string& lvl, bool& attachFlag,
+	int& commitEvery, bool& bulkFlag, bool& dryRun, string& planFile,
+	int& jobs, string& stateFile, bool& deltaFlag, string& sinceTime,
+	string& fpFile, bool& treeFlag, string& idCacheFile, bool& watchFlag,
+	string& baseFile)
+{
+	static struct option glyphOptions[] = 
+	{
+		{"calibredb",		required_argument,	0, 'c'},
+		{"readerdb",		required_argument,	0, 'r'},
+		{"direction",		required_argument,	0, 'd'},
+		{"state",			required_argument,	0, 's'},
+		{"log",				required_argument,	0, 'l'},
+		{"attach",			no_argument,		0, 'a'},
+		{"commit-every",	required_argument,	0, 'n'},
+		{"bulk",			no_argument,		0, 'b'},
+		{"dry-run",			no_argument,		0, 'x'},
+		{"plan",			required_argument,	0, 'p'},
+		{"jobs",			required_argument,	0, 'j'},
+		{"incremental",		required_argument,	0, 'i'},
+		{"modified",		no_argument,		0, 'm'},
+		{"since",			required_argument,	0, 'S'},
+		{"fingerprint",		required_argument,	0, 'f'},
+		{"tree",			no_argument,		0, 't'},
+		{"id-cache",		required_argument,	0, 'k'},
+		{"watch",			no_argument,		0, 'w'},
+		{"base",			required_argument,	0, 'B'},
+		{"help",			no_argument, 		0, 'h'},
+		{0,					0,					0, 0}
+	};
+
+	int helpFlag = 0;
+	int optIdx = 0;
+	jFNTRY ();
+
+	while (1)
+	{
+		int c = 0;
+		c = getopt_long (argc, argv, "c:r:d:s:l:an:bxp:j:i:mS:f:tk:wB:h", glyphOptions, &optIdx);
+		jDBG ("optIdx " << optIdx);
+		if ( -1 == c )
+		{
+			break;
+		}
+
+		switch (c)
+		{
+			case 'h' :
+				helpFlag = 1;
+				jDBG ("Help option found");
+				break;
+			case 'c' :
+				jDBG ("i: name = " << glyphOptions[optIdx].name
+						<<", optarg = "<< optarg);
+				strcpy (CDbFile, optarg);
+				// jDBG ("inFile " << CDbFile);
+				break;
+			case 'r' :
+				jDBG ("r: name = " << glyphOptions[optIdx].name
+						<<", optarg = "<< optarg);
+				RDbFiles.push_back (optarg);
+				break;
+			case 'd' :
+				jDBG ("d: name = " << glyphOptions[optIdx].name
+						<<", optarg = "<< optarg);
+				direction = optarg;
+				break;
+			case 's' :
+				jDBG ("s: name = " << glyphOptions[optIdx].name
+						<<", optarg = "<< optarg);
+				stateVal = optarg;
+				break;
+			case 'l' :
+				jDBG ("l: name = " << glyphOptions[optIdx].name
+						<<", optarg = "<< optarg);
+				lvl = optarg;
+				// If trace/debug statements from this functions are required.
+				if (lvl == "TRACE")
+				{
+					SETMSGLVL (TRACE);
+				}
+				jDBG ("Log level " << lvl);
+				break;
+			case 'a' :
+				jDBG ("Attach option found");
+				attachFlag = true;
+				break;
+			case 'n' :
+				jDBG ("n: name = " << glyphOptions[optIdx].name
+						<<", optarg = "<< optarg);
+				if (parseCount (optarg, &commitEvery) != SUCCESS)
+				{
+					jERR ("Invalid commit count " << optarg << ", try "
+						<< argv[0] << " -h");
+					exit (1);
+				}
+				break;
+			case 'b' :
+				jDBG ("Bulk option found");
+				bulkFlag = true;
+				break;
+			case 'x' :
+				jDBG ("Dry run option found");
+				dryRun = true;
+				break;
+			case 'p' :
+				jDBG ("p: name = " << glyphOptions[optIdx].name
+						<<", optarg = "<< optarg);
+				planFile = optarg;
+				break;
+			case 'j' :
+				jDBG ("j: name = " << glyphOptions[optIdx].name
+						<<", optarg = "<< optarg);
+				if (parseCount (optarg, &jobs) != SUCCESS)
+				{
+					jERR ("Invalid number of jobs " << optarg << ", try "
+						<< argv[0] << " -h");
+					exit (1);
+				}
+				break;
+			case 'i' :
+				jDBG ("i: name = " << glyphOptions[optIdx].name
+						<<", optarg = "<< optarg);
+				stateFile = optarg;
+				break;
+			case 'm' :
+				jDBG ("Modified option found");
+				deltaFlag = true;
+				break;
+			case 'S' :
+				jDBG ("S: name = " << glyphOptions[optIdx].name
+						<<", optarg = "<< optarg);
+				sinceTime = optarg;
+				deltaFlag = true;
+				break;
+			case 'f' :
+				jDBG ("f: name = " << glyphOptions[optIdx].name
+						<<", optarg = "<< optarg);
+				fpFile = optarg;
+				break;
+			case 't' :
+				jDBG ("Tree option found");
+				treeFlag = true;
+				break;
+			case 'k' :
+				jDBG ("k: name = " << glyphOptions[optIdx].name
+						<<", optarg = "<< optarg);
+				idCacheFile = optarg;
+				break;
+			case 'w' :
+				jDBG ("Watch option found");
+				watchFlag = true;
+				break;
+			case 'B' :
+				jDBG ("B: name = " << glyphOptions[optIdx].name
+						<<", optarg = "<< optarg);
+				baseFile = optarg;
+				break;
+			case '?' :
+				jDBG ("Try " << argv[0] << " --help for more information");
+				exit (2);
+				break;
+		}
+		if (helpFlag)
+		{
+			help (argv[0]);
+			exit (1);
+		}
+
+	}
+
+	if (strlen (CDbFile) == 0)
+	{
+		jERR ("Calibre DB file not specified, try " << argv[0] << " -h");
+		exit (1);
+	}
+
+	if (RDbFiles.empty () == true)
+	{
+		jERR ("Cool Reader DB file not specified, try " << argv[0] << " -h");
+		exit (1);
+	}
+
+	if ((RDbFiles.size () > 1) && (attachFlag == true))
+	{
+		jERR ("The attach option supports a single Cool Reader DB file");
+		exit (1);
+	}
+
+	if ((stateFile.length () != 0) &&
+		((RDbFiles.size () > 1) || (attachFlag == true)))
+	{
+		jERR ("The incremental option supports a single Cool Reader DB file"
+			<< " without the attach option");
+		exit (1);
+	}
+
+	if (direction.length() != 0)
+	{
+		if ((direction != "cal2reader") && (direction != "reader2cal") &&
+			(direction != "both"))
+		{
+			jERR ("Invaid direction");
+			exit (1);
+		}
+	}
+	else
+	{
+		jERR ("Sync direction not specified, try " << argv[0] << " -h");
+		exit (1);
+	}
+
+	if ((baseFile.length () != 0) && (direction != "both"))
+	{
+		jERR ("The base option requires -d both");
+		exit (1);
+	}
+
+	if ((direction == "both") && ((RDbFiles.size () > 1) ||
+		(attachFlag == true) || (stateFile.length () != 0) ||
+		(treeFlag == true) || (idCacheFile.length () != 0) ||
+		(watchFlag == true)))
+	{
+		jERR ("Syncing both directions supports a single Cool Reader DB file"
+			<< " and can not be combined with -a, -i, -t, -k or -w");
+		exit (1);
+	}
+
+	if ((treeFlag == true) && ((RDbFiles.size () > 1) ||
+		(attachFlag == true) || (stateFile.length () != 0) ||
+		(deltaFlag == true) || (jobs > 1)))
+	{
+		jERR ("The tree option supports a single Cool Reader DB file and"
+			<< " can not be combined with -a, -i, -m or -j");
+		exit (1);
+	}
+
+	if ((idCacheFile.length () != 0) &&
+		((RDbFiles.size () > 1) || (attachFlag == true)))
+	{
+		jERR ("The id cache option supports a single Cool Reader DB file"
+			<< " without the attach option");
+		exit (1);
+	}
+
+	if ((watchFlag == true) && ((RDbFiles.size () > 1) ||
+		(attachFlag == true) || (dryRun == true) || (planFile.length () != 0)
+		|| (jobs > 1) || (stateFile.length () != 0) || (deltaFlag == true) ||
+		(fpFile.length () != 0) || (treeFlag == true) ||
+		(idCacheFile.length () != 0)))
+	{
+		jERR ("The watch option supports a single Cool Reader DB file and"
+			<< " can not be combined with -a, -x, -p, -j, -i, -m, -f, -t or -k");
+		exit (1);
+	}
+
+	if ((fpFile.length () != 0) && (RDbFiles.size () > 1))
+	{
+		jERR ("The fingerprint option supports a single Cool Reader DB file");
+		exit (1);
+	}
+
+	if ((deltaFlag == true) && ((direction != "cal2reader") ||
+		(RDbFiles.size () > 1) || (attachFlag == true)))
+	{
+		jERR ("The modified option supports cal2reader with a single"
+			<< " Cool Reader DB file without the attach option");
+		exit (1);
+	}
+	jFX ();
+	return SUCCESS;
+}
+
+//! \fn int parseCount (const char *arg, int *count)
+//! \brief Parse the count of the -n and -j options.
+//! The whole argument has to be a decimal number of at least 1.
+//! \return SUCCESS, FAIL if the argument is not a valid count.
+int parseCount (const char *arg, int *count)
+{
+	char *end;
+
+	errno = 0;
+	long val = strtol (arg, &end, 10);
+	if ((end == arg) || (*end != '\0') || (errno != 0) || (val < 1) ||
+		(val > INT_MAX))
+	{
+		return FAIL;
+	}
+
+	*count = (int) val;
+	return SUCCESS;
+}
+
+//! \fn void help (char *progName)
+//! \brief Display the help text.
+void help (char *progName)
+{
+	cout << "Usage : " << progName <<
+		" -c CalibreDbFile -r CoolReaderDbFile -d direction" << endl;
+	cout << "\t -c, --calibredb  CalibreDbFile" << endl;
+	cout << "\t -r, --readerdb   CoolReaderDbFile (repeat for more devices)"
+		<< endl;
+	cout << "\t -d, --direction  Sync direction (cal2reader | reader2cal |"
+		<< " both)" << endl;
+	cout << "\t -s, --state      customColumnName" << endl;
+	cout << "\t [-l, --log]      MessageLevel (DBG | TRACE)" << endl;
+	cout << "\t [-a, --attach]   Pair the books with a single join" << endl;
+	cout << "\t [-n, --commit-every] N Commit the updates every N books"
+		<< endl;
+	cout << "\t [-b, --bulk]     Stage the updates and apply them in bulk"
+		<< endl;
+	cout << "\t [-x, --dry-run]  Display the planned changes only" << endl;
+	cout << "\t [-p, --plan]     planFile Write the planned changes" << endl;
+	cout << "\t [-j, --jobs]     N Scan the source DB in N parallel shards"
+		<< endl;
+	cout << "\t [-i, --incremental] stateFile Sync the changed books only"
+		<< endl;
+	cout << "\t [-m, --modified] Fetch the Calibre books modified since the"
+		<< " last run" << endl;
+	cout << "\t [-S, --since]    time Fetch the Calibre books modified after"
+		<< " time" << endl;
+	cout << "\t [-f, --fingerprint] fpFile Skip the sync if the DBs have not"
+		<< " changed" << endl;
+	cout << "\t [-t, --tree]     Sync the books in the differing title hash"
+		<< " ranges only" << endl;
+	cout << "\t [-k, --id-cache] cacheFile Reuse the book pairs of the last"
+		<< " run" << endl;
+	cout << "\t [-B, --base]     baseFile Merge -d both three-way against the"
+		<< " last merge" << endl;
+	cout << "\t [-w, --watch]    Sync again each time a DB changes" << endl;
+	cout << "\t [-h, --help]     Display this help message" << endl;
+}
+
+//! \fn void loadCalibre (CalibreDb *cDb, Calibre *cData, DbLoad *load,
+//! string stateVal, char *RDbFile, bool attachFlag)
+//! \brief Open, prepare and scan the Calibre DB.
+//! Runs on its own thread, the result is returned in load->retVal. The
+//! fetch queue, if any, is closed when the thread is done.
+//! \param [in] cDb Calibre db access class.
+//! \param [in] cData Calibre record, gets the rating and state lookups.
+//! \param [in,out] load The DB file and the scan to run.
+//! \param [in] stateVal Name of the custom state field
+//! \param [in] RDbFile Reader SQLite Database file name
+//! \param [in] attachFlag Attach the Reader DB to the Calibre connection.
+void loadCalibre (CalibreDb *cDb, Calibre *cData, DbLoad *load,
+	string stateVal, char *RDbFile, bool attachFlag)
+{
+	load->retVal = setupCalibre (cDb, cData, load->dbFile, stateVal,
+		RDbFile, attachFlag);
+	if (load->retVal == SUCCESS)
+	{
+		load->retVal = scanDb (cDb, load);
+	}
+	if (load->records != 0)
+	{
+		load->records->close ();
+	}
+}
+
+//! \fn int setupCalibre (CalibreDb *cDb, Calibre *cData, char *CDbFile,
+//! string stateVal, char *RDbFile, bool attachFlag)
+//! \brief Open the Calibre DB, prepare the statements and load the rating
+//! and state lookups.
+int setupCalibre (CalibreDb *cDb, Calibre *cData, char *CDbFile,
+	string stateVal, char *RDbFile, bool attachFlag)
+{
+	int retval;
+	int tabId; // Custom table id for state.
+
+	jFNTRY ();
+
+	// Connect to the Calibre DB
+	retval = cDb->connectToDB (CDbFile);
+	if (retval != SUCCESS)
+	{
+		jFATAL ("Unable to open Calibre DB [" << CDbFile << "]");
+		return FAIL;
+	}
+	else
+	{
+		jTRACE ("Connected to Calibre db");
+	}
+
+	if (cDb->customStatePresent == true)
+	{
+		// Need to proceed only if custom state is specified from command line.
+		retval = cDb->getCustomTabId (stateVal, &tabId);
+		if (retval != SUCCESS)
+		{
+			jFATAL ("Calibre getCustomTabId failed");
+			return FAIL;
+		}
+		retval = cDb->setupStateOps (tabId);
+		if (retval != SUCCESS)
+		{
+			jFATAL ("Calibre setupStateOps failed");
+			return FAIL;
+		}
+	}
+
+	// Prepare the statements for Calibre db
+	retval = cDb->setupDbStmts ();
+	if (retval != SUCCESS)
+	{
+		jFATAL ("Calibre setupDbStmts failed");
+		return FAIL;
+	}
+
+	if (cDb->getDeltaFetch () == true)
+	{
+		//! Find the modified since time of the next run before the books
+		//! are fetched.
+		retval = cDb->loadLastModified ();
+		if (retval == FAIL)
+		{
+			jFATAL ("Calibre loadLastModified failed");
+			return FAIL;
+		}
+	}
+
+	if (attachFlag == true)
+	{
+		// Attach the Reader DB to the Calibre connection for the join.
+		retval = cDb->attachDB (RDbFile);
+		if (retval != SUCCESS)
+		{
+			jFATAL ("Unable to attach Reader DB [" << RDbFile << "]");
+			return FAIL;
+		}
+	}
+
+	//! Get the Rating ids and the ratings.
+	map <int, int> r;
+	retval = cDb->loadRatingIds (r);
+	if (retval != SUCCESS)
+	{
+		jERR ("loadRatingIds failed");
+		return FAIL;
+	}
+
+	//! The lookup tables are built once and shared by all the Calibre
+	//! records copied from cData, see RefLookup.
+	shared_ptr<RefLookup> lookup = make_shared<RefLookup> ();
+	retval = lookup->setRatings (r);
+	if (retval != SUCCESS)
+	{
+		jERR ("Calibre setRatings failed");
+		return FAIL;
+	}
+	else
+	{
+		jDBG ("Found " << r.size () << " ratings.");
+		for (map<int, int>::iterator i = r.begin (); i != r.end (); ++i)
+		{
+			jDBG ("Rating id [" << (*i).first << "] rating [" << (*i).second);
+		}
+	}
+
+	if (cDb->customStatePresent == true)
+	{
+		map<int, string> t;
+		// Get the custom Read State values from the Calibre db.
+		retval = cDb->loadReadState (tabId, t);
+		if (retval != SUCCESS)
+		{
+			jERR ("Calibre loadReadState failed.");
+			return FAIL;
+		}
+
+		jDBG ("Found " << t.size () << " states.");
+		for (map <int, string>::iterator i = t.begin (); i != t.end (); ++i)
+		{
+			jDBG ("State id [" << (*i).first << "] name [" << (*i).second);
+		}
+
+		jDBG ("Creating ref look up");
+		retval = lookup->setStates (t);
+		if (retval != SUCCESS)
+		{
+			jERR ("Calibre setStates failed.");
+			return FAIL;
+		}
+	}
+	cData->setLookup (lookup);
+
+	jFX ();
+	return SUCCESS;
+}
+
+//! \fn void loadReader (ReaderDb *rDb, DbLoad *load)
+//! \brief Open, prepare and scan the Reader DB.
+//! Runs on its own thread, the result is returned in load->retVal. The
+//! fetch queue, if any, is closed when the thread is done.
+//! \param [in] rDb Reader db access class.
+//! \param [in,out] load The DB file and the scan to run.
+void loadReader (ReaderDb *rDb, DbLoad *load)
+{
+	load->retVal = setupReader (rDb, load->dbFile);
+	if (load->retVal == SUCCESS)
+	{
+		load->retVal = scanDb (rDb, load);
+	}
+	if (load->records != 0)
+	{
+		load->records->close ();
+	}
+}
+
+//! \fn int setupReader (ReaderDb *rDb, char *RDbFile)
+//! \brief Open the Reader DB and prepare the statements.
+int setupReader (ReaderDb *rDb, char *RDbFile)
+{
+	int retval;
+
+	jFNTRY ();
+
+	// Connect to the Reader DB
+	retval = rDb->connectToDB (RDbFile);
+	if (retval != SUCCESS)
+	{
+		jFATAL ("Unable to open Reader DB [" << RDbFile << "]");
+		return FAIL;
+	}
+	else
+	{
+		jTRACE ("Connected to Reader db");
+	}
+
+	// Prepare the statement for Reader db
+	retval = rDb->setupDbStmts ();
+	if (retval != SUCCESS)
+	{
+		jFATAL ("Reader setupDbStmts failed");
+		return FAIL;
+	}
+
+	jFX ();
+	return SUCCESS;
+}
+
+//! \fn int scanDb (SyncDb *db, DbLoad *load)
+//! \brief Run the scan of the loading thread.
+//! The destination books are loaded into the book index, the source
+//! records are fetched and passed to the match stage through
+//! load->records.
+int scanDb (SyncDb *db, DbLoad *load)
+{
+	int retval = SUCCESS;
+
+	if (load->scan == SCAN_INDEX)
+	{
+		retval = db->loadBookIndex ();
+		if (retval != SUCCESS)
+		{
+			jERR ("loadBookIndex failed");
+		}
+	}
+	else if ((load->scan == SCAN_RECORDS) && (load->jobs > 1))
+	{
+		retval = scanShards (db, load->dbFile, load->jobs, 0, load->records);
+	}
+	else if (load->scan == SCAN_RECORDS)
+	{
+		//! Fetch stage of the sync pipeline, the source records are
+		//! passed to the match stage in batches of BATCH_ROWS records as
+		//! they are fetched.
+		RecordBatch batch;
+		do
+		{
+			batch.clear ();
+			batch.reserve (BATCH_ROWS);
+			retval = db->fetchBatch (batch, BATCH_ROWS);
+			if ((retval != FAIL) && (batch.size () != 0))
+			{
+				load->records->push (batch);
+			}
+		} while (retval == SUCCESS);
+		retval = (retval == NO_DATA) ? SUCCESS : FAIL;
+		if (retval != SUCCESS)
+		{
+			jERR ("Fetching the source records failed");
+		}
+	}
+	return retval;
+}
+
+//! \fn int clearDbOps (CalibreDb& cDb, ReaderDb& rDb)
+//! \brief Clear the DB connections and statements.
+int clearDbOps (CalibreDb& cDb, ReaderDb& rDb)
+{
+	int retval;
+
+	jDBG ("clearDbOps");
+	retval = cDb.finalizeStmts ();
+	if (retval != SUCCESS)
+	{
+		jLOG ("cDb.finalizeStmts failed");
+	}
+
+	cDb.finalizeStateOps ();
+	if (retval != SUCCESS)
+	{
+		jLOG ("cDb.finalizeStateOps failed");
+	}
+
+	retval = cDb.disconnectDB ();
+	if (retval != SUCCESS)
+	{
+		jLOG ("cDb.disconnectDB failed");
+	}
+
+	retval = rDb.finalizeStmts ();
+	if (retval != SUCCESS)
+	{
+		jLOG ("rDb.finalizeStmts failed");
+	}
+	retval = rDb.disconnectDB ();
+	if (retval != SUCCESS)
+	{
+		jLOG ("rDb.disconnectDB failed");
+	}
+	return SUCCESS;
+}
+
+//! \fn int syncBook (SyncClass *Source, SyncClass *Dest, SyncDb *destDB,
+//! SyncClass *NewData, SyncPlan& plan, PipeQueue<BookChange> *changeQ)
+//! \brief Plan the changes for the destination book of the source title.
+//! The change is added to the plan and passed to the write stage through
+//! changeQ, changeQ is 0 in a dry run.
+//! \return NO_DATA if the book is not present in the destination DB.
+int syncBook (SyncClass *Source, SyncClass *Dest, SyncDb *destDB,
+	SyncClass *NewData, SyncPlan& plan, PipeQueue<BookChange> *changeQ)
+{
+	int retVal;
+
+	//! Fetch data from the dest Db for the source record.
+	//! The book is paired by id if it was paired in the last run, see
+	//! SyncDb::matchBook.
+	retVal = destDB->matchBook (Dest, Source);
+	if (retVal != SUCCESS)
+	{
+		// The book may not be present in the destination DB, skip it.
+		return NO_DATA;
+	}
+
+	if ( (Dest->getStdState () < Source->getStdState ()) ||
+		 (Dest->getStdRating () < Source->getStdRating ())
+	)
+	{
+		jINFO ("");
+		Source->displayData ();
+		Dest->displayData ();
+
+		BookChange change;
+		if (planUpdate (Source, Dest, NewData, change) == true)
+		{
+			plan.addChange (change);
+			NewData->displayData ();
+			if (changeQ != 0)
+			{
+				changeQ->push (change);
+			}
+
+			//! Update the book index with the planned values so that a
+			//! later source record with the same title is compared with
+			//! them, as it would be after the update.
+			destDB->refreshBookIndex (NewData);
+		}
+	}
+	return SUCCESS;
+}
+
+//! \fn void matchRecords (SyncDb *sourceDB, SyncClass *Source,
+//! SyncClass *Dest, SyncDb *destDB, SyncClass *NewData, SyncPlan *plan,
+//! PipeQueue<RecordBatch> *fetchQ, PipeQueue<BookChange> *changeQ,
+//! SyncState *syncState, bool indexSource, MergeRun *merge)
+//! \brief Match stage of the sync pipeline.
+//! Takes the source records from the fetch stage and plans the changes of
+//! the destination books, see syncBook. In an incremental sync the records
+//! that have not changed since the last sync are skipped and the values of
+//! the others are recorded in syncState, syncState is 0 otherwise.
+//! \param [in] indexSource Add the source records to the book index of
+//! the source DB, see planBack.
+//! \param [in] merge The three-way merge of -d both, 0 if not merged, see
+//! mergeBook.
+void matchRecords (SyncDb *sourceDB, SyncClass *Source, SyncClass *Dest,
+	SyncDb *destDB, SyncClass *NewData, SyncPlan *plan,
+	PipeQueue<RecordBatch> *fetchQ, PipeQueue<BookChange> *changeQ,
+	SyncState *syncState, bool indexSource, MergeRun *merge)
+{
+	RecordBatch batch;
+	BookRecord bRec;
+	int retVal;
+
+	while (fetchQ->pop (batch))
 	{
-		jTRACE ("Connected to Calibre db");
+		for (size_t i = 0; i < batch.size (); i++)
+		{
+			batch.getBook (i, bRec);
+			sourceDB->setRecord (Source, batch.getTitle (i), bRec);
+			if (indexSource == true)
+			{
+				sourceDB->addToBookIndex (Source->getTitle (), bRec);
+			}
+			if ((syncState != 0) && (syncState->unchanged (Source) == true))
+			{
+				continue;
+			}
+
+			if (merge != 0)
+			{
+				mergeBook (Source, Dest, destDB, NewData, *plan, changeQ,
+					merge);
+				continue;
+			}
+			retVal = syncBook (Source, Dest, destDB, NewData, *plan, changeQ);
+			if (syncState != 0)
+			{
+				syncState->bookSynced (Source,
+					(retVal == SUCCESS) ? Dest->getId () : -1);
+			}
+		}
 	}
+}
+
+//! \fn void writeChanges (SyncDb *destDB, SyncClass *newData,
+//! PipeQueue<BookChange> *changeQ, int *retVal)
+//! \brief Write stage of the sync pipeline.
+//! Owns the destination connection while the sync runs and writes the
+//! changes in transactions, see SyncDb::setCommitEvery. The changes are
+//! taken in windows of PIPE_DEPTH changes and the changes of the same
+//! destination book within a window are merged, see SyncPlan::addChange,
+//! so that the book is written once. If an update fails the updates since
+//! the last commit are rolled back, the remaining changes are taken from
+//! the queue and dropped so that the match stage is not blocked.
+//! \param [out] retVal SUCCESS or FAIL.
+void writeChanges (SyncDb *destDB, SyncClass *newData,
+	PipeQueue<BookChange> *changeQ, int *retVal)
+{
+	int retval;
+	bool more = true;
+	BookChange change;
+	SyncPlan window;
 
-	if (cDb.customStatePresent == true)
+	retval = destDB->beginTransaction ();
+	while (more == true)
 	{
-		// Need to proceed only if custom state is specified from command line.
-		retval = cDb.getCustomTabId (stateVal, tabId);
-		if (retval != SUCCESS)
+		more = changeQ->pop (change);
+		if ((more == true) && (retval == SUCCESS))
 		{
-			jFATAL ("Calibre getCustomTabId failed");
-			return FAIL;
+			window.addChange (change);
 		}
-		retval = cDb.setupStateOps (*tabId);
-		if (retval != SUCCESS)
+		if ((window.size () < PIPE_DEPTH) && (more == true))
 		{
-			jFATAL ("Calibre setupStateOps failed");
-			jFX ();
-			return FAIL;
+			continue;
 		}
+		for (size_t i = 0; (retval == SUCCESS) && (i < window.size ()); i++)
+		{
+			retval = updateData (window.getChange (i), destDB, newData);
+		}
+		window.clear ();
 	}
 
-	// Prepare the statements for Calibre db
-	retval = cDb.setupDbStmts ();
+	if (retval == SUCCESS)
+	{
+		retval = destDB->commitTransaction ();
+	}
 	if (retval != SUCCESS)
 	{
-		jFATAL ("Calibre setupDbStmts failed");
-		return FAIL;
+		//! Discard the updates since the last commit if any of them failed.
+		destDB->rollbackTransaction ();
+	}
+	*retVal = retval;
+}
+
+//! \fn int mergeBook (SyncClass *cRec, SyncClass *rRec, SyncDb *rDb,
+//! SyncClass *newRdrData, SyncPlan& plan, PipeQueue<BookChange> *changeQ,
+//! MergeRun *merge)
+//! \brief Merge the Calibre book and its Reader book three-way.
+//! Each value is resolved against the values the pair had after the last
+//! merge, see SyncBase::resolve, and the side that differs from the result
+//! is planned. The Reader change goes to plan and changeQ as in syncBook,
+//! the Calibre change to the Calibre plan of merge. A value the other side
+//! can not store, a Calibre rating of 0 or an unknown state, is left and
+//! the values of both sides are kept in the snapshot.
+//! \return NO_DATA if the book is not present in the Reader DB.
+int mergeBook (SyncClass *cRec, SyncClass *rRec, SyncDb *rDb,
+	SyncClass *newRdrData, SyncPlan& plan, PipeQueue<BookChange> *changeQ,
+	MergeRun *merge)
+{
+	if (rDb->matchBook (rRec, cRec) != SUCCESS)
+	{
+		return NO_DATA;
 	}
 
+	const BaseEntry *base = merge->base->findPair (cRec->getId (),
+		rRec->getId ());
+	BaseEntry after;
+	after.calId = cRec->getId ();
+	after.rdrId = rRec->getId ();
+	after.cRating = cRec->getStdRating ();
+	after.rRating = rRec->getStdRating ();
+	after.cState = cRec->getStdState ();
+	after.rState = rRec->getStdState ();
+
+	//! A value neither side has changed since the last merge is left as it
+	//! is. The sides can differ if one side can not store the value or if
+	//! the Reader book was last merged with another Calibre book of the
+	//! same title.
+	bool rateKept = ((base != 0) && (after.cRating == base->cRating) &&
+		(after.rRating == base->rRating));
+	int rating = merge->base->resolve (after.cRating, after.rRating,
+		base ? base->cRating : 0, base ? base->rRating : 0, (base != 0));
+	bool rdrRate = ((rating != after.rRating) && (rateKept != true));
+	bool calRate = ((rating != after.cRating) && (rateKept != true) &&
+		(cRec->stdRateToDBRate (rating) != 0));
+
+	bool rdrState = false;
+	bool calState = false;
+	int state = after.cState;
+	if (cRec->getCustomStatePresent () == true)
+	{
+		bool stateKept = ((base != 0) && (after.cState == base->cState) &&
+			(after.rState == base->rState));
+		state = merge->base->resolve (after.cState, after.rState,
+			base ? base->cState : 0, base ? base->rState : 0, (base != 0));
+		rdrState = ((state != after.rState) && (stateKept != true) &&
+			(rRec->textTostate (cRec->getStateText ()) >= 0));
+		calState = ((state != after.cState) && (stateKept != true) &&
+			(cRec->textTostate (rRec->getStateText ()) >= 0));
+	}
 
-	// Connect to the Reader DB
-	retval = rDb.connectToDB (RDbFile);
-	if (retval != SUCCESS)
+	//! A Reader book without flags has no values of its own, as in -d both
+	//! it is not copied to Calibre when the pair is merged the first time,
+	//! unless it gets flags from Calibre.
+	if ((base == 0) && (rRec->getFlags () == 0) && (rdrRate != true) &&
+		(rdrState != true))
 	{
-		jFATAL ("Unable to open Reader DB [" << RDbFile << "]");
-		return FAIL;
+		calRate = false;
+		calState = false;
 	}
-	else
+
+	if ((rdrRate == true) || (rdrState == true))
 	{
-		jTRACE ("Connected to Reader db");
+		jINFO ("");
+		cRec->displayData ();
+		rRec->displayData ();
+
+		BookChange change;
+		planFields (cRec, rRec, newRdrData, change, rdrRate, rdrState);
+		plan.addChange (change);
+		newRdrData->displayData ();
+		if (changeQ != 0)
+		{
+			changeQ->push (change);
+		}
+		rDb->refreshBookIndex (newRdrData);
+		after.rRating = rdrRate ? rating : after.rRating;
+		after.rState = rdrState ? state : after.rState;
 	}
 
-	// Prepare the statement for Reader db
-	retval = rDb.setupDbStmts ();
-	if (retval != SUCCESS)
+	if ((calRate == true) || (calState == true))
 	{
-		jFATAL ("Reader setupDbStmts failed");
-		return (FAIL);
+		BookChange change;
+		planFields (rRec, cRec, merge->newCalData, change, calRate, calState);
+		merge->calPlan->addChange (change);
+		merge->newCalData->displayData ();
+		after.cRating = calRate ? rating : after.cRating;
+		after.cState = calState ? state : after.cState;
 	}
 
-	jFX ();
+	merge->base->addPair (after);
 	return SUCCESS;
 }
 
-//! \fn int clearDbOps (CalibreDb& cDb, ReaderDb& rDb)
-//! \brief Clear the DB connections and statements.
-int clearDbOps (CalibreDb& cDb, ReaderDb& rDb)
+//! \fn bool planUpdate (SyncClass *Source, SyncClass *Dest,
+//! SyncClass *newData, BookChange& change)
+//! \brief Plan the update of the rating and state (if applicable) of Dest
+//! based on Source.
+//! \param [out] newData Dest with the planned rating and state.
+//! \param [out] change The planned change.
+//! \return true if Dest has to be updated.
+bool planUpdate (SyncClass *Source, SyncClass *Dest, SyncClass *newData,
+	BookChange& change)
+{
+	bool rate = (Source->getStdRating () > Dest->getStdRating ());
+	bool state = (Source->getCustomStatePresent () &&
+		(Source->getStdState () > Dest->getStdState ()));
+
+	return planFields (Source, Dest, newData, change, rate, state);
+}
+
+//! \fn bool planFields (SyncClass *Source, SyncClass *Dest,
+//! SyncClass *newData, BookChange& change, bool rate, bool state)
+//! \brief Plan the update of the rating and/or state of Dest to the values
+//! of Source.
+//! \param [in] rate, state The values to update.
+//! \param [out] newData Dest with the planned rating and state.
+//! \param [out] change The planned change.
+//! \return true if Dest has to be updated.
+bool planFields (SyncClass *Source, SyncClass *Dest, SyncClass *newData,
+	BookChange& change, bool rate, bool state)
+{
+	//! Use newData variable to store the data to be updated in
+	//! the destination DB.
+	*newData = *Dest;
+
+	change.title = Dest->getTitle ();
+	change.id = Dest->getId ();
+	change.linkId = Dest->getLinkId ();
+	change.rateChange = false;
+	change.stateChange = false;
+	change.oldRating = Dest->getRating ();
+	change.newRating = change.oldRating;
+	change.oldState = Dest->getState ();
+	change.newState = change.oldState;
+	change.oldFlags = Dest->getFlags ();
+
+	if (rate == true)
+	{
+		int srcStdRate = Source->getStdRating ();
+		int targetDbRating = Dest->stdRateToDBRate (srcStdRate);
+
+		newData->setRating (targetDbRating);
+		newData->setStdRating (srcStdRate);
+
+		change.rateChange = true;
+		change.newRating = targetDbRating;
+	}
+
+	if (state == true)
+	{
+		//! First find the state text from the Source, use it to find the
+		//! state value of destination and update it in the newData. The
+		//! translation is required as Calibre and Reader use different
+		//! values for states.
+		string sStateText = Source->getStateText ();
+		int dState = Dest->textTostate (sStateText);
+		if (dState < 0)
+		{
+			//! The destination has no such state, the state link row would
+			//! get an invalid value.
+			jWARN ("No state [" << sStateText << "] in the destination DB for "
+				<< Dest->getTitle ());
+			return change.rateChange;
+		}
+		newData->setState (dState);
+
+		// The text of dState is the source text, so is the standard state.
+		newData->setStdState (Source->getStdState ());
+
+		change.stateChange = true;
+		change.newState = dState;
+	}
+
+	return (change.rateChange || change.stateChange);
+}
+
+//! \fn int updateData (BookChange& change, SyncDb *DestDb,
+//! SyncClass *newData)
+//! \brief Write a planned change to the destination DB.
+int updateData (BookChange& change, SyncDb *DestDb, SyncClass *newData)
 {
+	// jFNTRY ();
 	int retval;
 
-	jDBG ("clearDbOps");
-	retval = cDb.finalizeStmts ();
-	if (retval != SUCCESS)
+	//! Set up newData with the values in the DB before the change.
+	BookRecord bRec;
+	bRec.id = change.id;
+	bRec.linkId = change.linkId;
+	bRec.rating = change.oldRating;
+	bRec.state = change.oldState;
+	bRec.flags = change.oldFlags;
+	DestDb->setRecord (newData, change.title, bRec);
+
+	if (change.rateChange)
 	{
-		jLOG ("cDb.finalizeStmts failed");
+		newData->setRating (change.newRating);
+	}
+	if (change.stateChange)
+	{
+		newData->setState (change.newState);
 	}
 
-	cDb.finalizeStateOps ();
+	retval = DestDb->updateBook (newData, change.rateChange,
+		change.stateChange);
 	if (retval != SUCCESS)
 	{
-		jLOG ("cDb.finalizeStateOps failed");
+		return FAIL;
 	}
 
-	retval = cDb.disconnectDB ();
+	//! Commits the batch of updates if it is full.
+	retval = DestDb->bookUpdated ();
 	if (retval != SUCCESS)
 	{
-		jLOG ("cDb.disconnectDB failed");
+		return FAIL;
 	}
 
-	retval = rDb.finalizeStmts ();
+	// jFX ();
+	return SUCCESS;
+}
+
+//! \fn int readSinceMark (string fName, string& since)
+//! \brief Read the modified since time kept by the last run.
+//! since is left empty if the file is not present, all the books are
+//! fetched.
+int readSinceMark (string fName, string& since)
+{
+	ifstream in (fName.c_str ());
+	if (!in)
+	{
+		jLOG ("No modified since time in [" << fName
+			<< "], fetching all the Calibre books.");
+		return SUCCESS;
+	}
+
+	getline (in, since);
+	if (since.length () == 0)
+	{
+		jERR ("Invalid modified since time in [" << fName << "]");
+		return FAIL;
+	}
+	return SUCCESS;
+}
+
+//! \fn int writeSinceMark (string fName, string since)
+//! \brief Keep the modified since time for the next run.
+int writeSinceMark (string fName, string since)
+{
+	ofstream out (fName.c_str ());
+	if (!out)
+	{
+		jERR ("Unable to open [" << fName << "]");
+		return FAIL;
+	}
+
+	out << since << endl;
+	out.close ();
+	if (!out)
+	{
+		jERR ("Writing [" << fName << "] failed");
+		return FAIL;
+	}
+
+	jDBG ("Modified since time [" << since << "] kept in [" << fName << "]");
+	return SUCCESS;
+}
+
+//! \fn int checkFingerprint (SyncFingerprint& fingerprint, string fpFile,
+//! char *CDbFile, char *RDbFile, string direction, string stateVal)
+//! \brief Check if the DBs have changed since the last sync.
+//! The file sizes and times are compared first, the DBs are not opened if
+//! they are the same. Otherwise the book data of both DBs is hashed on read
+//! only connections, see SyncDb::dataHash. If the hashes are the same the
+//! new file times are kept so that the next run is skipped on the file
+//! check.
+//! \return SUCCESS if the sync can be skipped, NO_DATA if not or FAIL.
+int checkFingerprint (SyncFingerprint& fingerprint, string fpFile,
+	char *CDbFile, char *RDbFile, string direction, string stateVal)
+{
+	int retval;
+
+	retval = fingerprint.loadPrint (fpFile.c_str (), direction, stateVal);
+	if (retval == SUCCESS)
+	{
+		retval = fingerprint.statFiles (CDbFile, RDbFile);
+	}
 	if (retval != SUCCESS)
 	{
-		jLOG ("rDb.finalizeStmts failed");
+		return FAIL;
 	}
-	retval = rDb.disconnectDB ();
+	if (fingerprint.filesUnchanged () == true)
+	{
+		return SUCCESS;
+	}
+	if (fingerprint.getLoaded () != true)
+	{
+		return NO_DATA;
+	}
+
+	CalibreDb cDb;
+	ReaderDb rDb;
+	string cHash;
+	string rHash;
+	int tabId;
+
+	cDb.setReadOnly (true);
+	rDb.setReadOnly (true);
+	retval = cDb.connectToDB (CDbFile);
+	if ((retval == SUCCESS) && (stateVal.length () != 0))
+	{
+		cDb.setCustomStatePresent (true);
+		retval = cDb.getCustomTabId (stateVal, &tabId);
+	}
+	if (retval == SUCCESS)
+	{
+		retval = cDb.dataHash (cHash);
+	}
+	if (retval == SUCCESS)
+	{
+		retval = rDb.connectToDB (RDbFile);
+	}
+	if (retval == SUCCESS)
+	{
+		retval = rDb.dataHash (rHash);
+	}
+	cDb.disconnectDB ();
+	rDb.disconnectDB ();
 	if (retval != SUCCESS)
 	{
-		jLOG ("rDb.disconnectDB failed");
+		//! The sync checks the DBs again and reports the errors.
+		return NO_DATA;
+	}
+
+	fingerprint.setHashes (cHash, rHash);
+	if (fingerprint.hashesUnchanged () != true)
+	{
+		return NO_DATA;
+	}
+	if (fingerprint.savePrint (fpFile.c_str ()) != SUCCESS)
+	{
+		return FAIL;
 	}
 	return SUCCESS;
 }
 
-//! \fn int updateData (SyncClass *Source, SyncClass *Dest, SyncDb *DestDb, SyncClass *newData)
-//! \brief Update the rating and state (if applicable) of Dest based on Source
-int updateData (SyncClass *Source, SyncClass *Dest, SyncDb *DestDb, SyncClass *newData)
+//! \fn int diffTrees (SyncDb *sourceDB, SyncClass *Source, SyncDb *destDB,
+//! SyncClass *Dest, vector<bool>& dirty)
+//! \brief Compare the title hash trees of the DBs and load the destination
+//! book index of the leaves that differ.
+//! The books are matched by title, the ids of the two DBs are unrelated, so
+//! the leaves are ranges of the title hash. A leaf with the same titles,
+//! standard ratings and states on both sides has nothing to sync. The leaf
+//! hashes are computed with an aggregate query on each DB, see
+//! SyncDb::leafHashes and SyncTree.
+//! \param [out] dirty The leaves that differ, the leaf filter of both DBs.
+int diffTrees (SyncDb *sourceDB, SyncClass *Source, SyncDb *destDB,
+	SyncClass *Dest, vector<bool>& dirty)
 {
-	// jFNTRY ();
 	int retval;
+	vector<TreeLeaf> sourceLeaves;
+	vector<TreeLeaf> destLeaves;
+
+	retval = sourceDB->leafHashes (Source, TREE_BITS, sourceLeaves);
+	if (retval == SUCCESS)
+	{
+		retval = destDB->leafHashes (Dest, TREE_BITS, destLeaves);
+	}
+	if (retval != SUCCESS)
+	{
+		jERR ("Hashing the title trees failed");
+		return FAIL;
+	}
+
+	SyncTree tree;
+	tree.setLeaves (sourceLeaves, destLeaves);
+	long count = tree.diff (dirty);
+	jLOG ("Title tree : " << count << " of " << dirty.size ()
+		<< " leaves differ, " << tree.getNodesCompared ()
+		<< " nodes compared.");
 
-	bool updateFlag = false;
+	retval = destDB->loadBookIndex ();
+	if (retval != SUCCESS)
+	{
+		jERR ("Loading the destination book index failed");
+		return FAIL;
+	}
+	return SUCCESS;
+}
 
+//! \fn int watchSync (char *CDbFile, char *RDbFile, bool toReader,
+//! string stateVal, int commitEvery, bool bulkFlag)
+//! \brief Sync the DBs each time one of them changes.
+//! The DBs are opened, their statements prepared and the rating and state
+//! lookups loaded once. They are synced at the start and then each time a
+//! change has settled, see DbWatch, until SIGINT or SIGTERM.
+//!
+//! If only the source DB has changed, the source books that have not
+//! changed since the last pass are skipped, see SyncState. A change in the
+//! destination DB, such as a device copy, is synced in full. A DB file
+//! replaced by another file is opened again.
+//! \return 0 when stopped, FAIL if a pass failed.
+int watchSync (char *CDbFile, char *RDbFile, bool toReader, string stateVal,
+	int commitEvery, bool bulkFlag)
+{
+	int retval;
 
-	//! Use newData variable to store the data to be updated in
-	//! the destination DB.
-	*newData = *Dest;
+	CalibreDb cDb;
+	ReaderDb rDb;
+	Calibre cData;
+	Calibre newCalData;
+	Calibre wCalData;
+	Reader rData;
+	Reader newRdrData;
+	Reader wRdrData;
 
-	//! If the source rating is greater than target, update the target rting.
-	if (Source->getStdRating () > Dest->getStdRating ())
+	if (stateVal.length () != 0)
 	{
-		//! Set the rating in newData if the destination rating is less
-		//! than that of source.
-		updateFlag = true;
+		cDb.setCustomStatePresent (true);
+		rDb.setCustomStatePresent (true);
+		cData.setCustomStatePresent (true);
+		rData.setCustomStatePresent (true);
+	}
 
-		int srcStdRate = Source->getStdRating ();
-		int targetDbRating = Dest->stdRateToDBRate (srcStdRate);
+	SyncDb *sourceDB = toReader ? (SyncDb *) &cDb : (SyncDb *) &rDb;
+	SyncDb *destDB = toReader ? (SyncDb *) &rDb : (SyncDb *) &cDb;
+	SyncClass *Source = toReader ? (SyncClass *) &cData : (SyncClass *) &rData;
+	SyncClass *Dest = toReader ? (SyncClass *) &rData : (SyncClass *) &cData;
+	SyncClass *NewData = toReader ? (SyncClass *) &newRdrData :
+		(SyncClass *) &newCalData;
+	SyncClass *WriteData = toReader ? (SyncClass *) &wRdrData :
+		(SyncClass *) &wCalData;
+	int sourceBit = toReader ? WATCH_CALIBRE : WATCH_READER;
+	int destBit = toReader ? WATCH_READER : WATCH_CALIBRE;
+
+	DbWatch watch;
+	retval = watch.startWatch (CDbFile, RDbFile);
+	if (retval != SUCCESS)
+	{
+		return FAIL;
+	}
+	jLOG ("Watching [" << CDbFile << "] and [" << RDbFile << "], syncing "
+		<< (toReader ? "Calibre DB to CoolReader DB." :
+		"CoolReader DB to Calibre DB."));
 
-		newData->setRating (targetDbRating);
-		newData->setStdRating (srcStdRate);
+	//! The books of the first pass are all synced.
+	SyncState syncState;
+	int changed = WATCH_CALIBRE_REPLACED | WATCH_READER_REPLACED |
+		WATCH_CALIBRE | WATCH_READER;
 
-		if (Dest->getLinkId () < 0)
+	while (retval == SUCCESS)
+	{
+		if ((changed & WATCH_CALIBRE_REPLACED) != 0)
 		{
-			//! Data corresponding to this book is not vailable in
-			// books_ratings_link table. Insert the data.
-			retval = DestDb->insertRating (newData);
-			if (retval != SUCCESS)
-			{
-				jWARN ("Inserting the rating data failed for "
-					<< newData->getTitle());
-			}
+			cDb.finalizeStmts ();
+			cDb.finalizeStateOps ();
+			cDb.disconnectDB ();
+			retval = setupCalibre (&cDb, &cData, CDbFile, stateVal, 0, false);
 		}
-		else
+		if ((retval == SUCCESS) && ((changed & WATCH_READER_REPLACED) != 0))
 		{
-			//! Update the existing rating data in books_ratings_link table.
-			retval = DestDb->updateRating (newData);
-			if (retval != SUCCESS)
+			rDb.finalizeStmts ();
+			rDb.disconnectDB ();
+			retval = setupReader (&rDb, RDbFile);
+		}
+		if ((retval == SUCCESS) && ((changed & (destBit << 2)) != 0))
+		{
+			destDB->setCommitEvery (commitEvery);
+			if (bulkFlag == true)
 			{
-				jWARN ("Updating the rating failed for " << newData->getTitle());
+				retval = destDB->setupStaging ();
 			}
 		}
+		if (retval != SUCCESS)
+		{
+			break;
+		}
+
+		//! The DBs are recorded before the pass, a change made while the
+		//! books are read is seen by the next wait. The destination is
+		//! recorded again after the updates of the pass.
+		watch.markSynced (WATCH_CALIBRE | WATCH_READER);
+		int books = destDB->getCommittedBooks ();
+		retval = watchPass (sourceDB, Source, destDB, Dest, NewData, WriteData,
+			syncState, ((changed & destBit) == 0));
+		if (destDB->getCommittedBooks () != books)
+		{
+			watch.markSynced (destBit);
+		}
+		if (retval != SUCCESS)
+		{
+			break;
+		}
+		jLOG ("Updated " << destDB->getCommittedBooks () - books
+			<< " books, waiting for changes.");
+
+		retval = watch.waitChange (&changed);
+		if (retval == NO_DATA)
+		{
+			clearDbOps (cDb, rDb);
+			return 0;
+		}
+		if ((changed & sourceBit) != 0)
+		{
+			jLOG ((toReader ? "Calibre" : "CoolReader") << " DB changed.");
+		}
+		if ((changed & destBit) != 0)
+		{
+			jLOG ((toReader ? "CoolReader" : "Calibre") << " DB changed.");
+		}
+	}
+
+	jERR ("Syncing failed, stopped watching.");
+	clearDbOps (cDb, rDb);
+	return FAIL;
+}
+
+//! \fn int watchPass (SyncDb *sourceDB, SyncClass *Source, SyncDb *destDB,
+//! SyncClass *Dest, SyncClass *NewData, SyncClass *WriteData,
+//! SyncState& syncState, bool incremental)
+//! \brief Sync the DBs once on the open connections, see watchSync.
+//! The destination book index is loaded again and the source books are
+//! fetched and matched against it, the changes are written in one go.
+//! \param [in,out] syncState The values of the source books at the last
+//! pass, the values of this pass are recorded in it.
+//! \param [in] incremental Skip the source books unchanged since the last
+//! pass.
+int watchPass (SyncDb *sourceDB, SyncClass *Source, SyncDb *destDB,
+	SyncClass *Dest, SyncClass *NewData, SyncClass *WriteData,
+	SyncState& syncState, bool incremental)
+{
+	int retval;
+	SyncPlan plan;
+	RecordBatch records;
+	BookRecord bRec;
+	long skipped = syncState.getUnchangedCount ();
+
+	retval = destDB->loadBookIndex ();
+	if (retval != SUCCESS)
+	{
+		jERR ("loadBookIndex failed");
+		return FAIL;
+	}
+	retval = fetchAll (sourceDB, records);
+	if (retval != SUCCESS)
+	{
+		return FAIL;
 	}
 
-	//! If destination state is lower than that of soruce, update it.
-	if (Source->getCustomStatePresent () )
+	destDB->recordIndex (Dest, &syncState);
+	for (size_t j = 0; j < records.size (); j++)
 	{
-		//! Update the state info in newData only if custom state
-		//! is provided from the command line.
-		if (Source->getStdState () > Dest->getStdState ())
+		records.getBook (j, bRec);
+		sourceDB->setRecord (Source, records.getTitle (j), bRec);
+		if ((incremental == true) && (syncState.unchanged (Source) == true))
 		{
-			//! Set the state info in newData if the standard State value is
-			//! lesser in the Dest than Source. First find the state text
-			//! from the Source, use it to find the state value of
-			//! destination and update it in the newData. The translation is
-			//! required as Calibre and Reader use different values for states.
-			string sStateText = Source->getStateText ();
-			int dState = Dest->textTostate (sStateText);
-			newData->setState (dState);
-			
-			// State text is not required for DB update, but required for the
-			// displayData function.
-			newData->setStateText (sStateText); 
-			updateFlag = true;
-
-			retval = DestDb->updateState (newData);
-			if (retval != SUCCESS)
-			{
-				jWARN ("Updating the state failed for " << newData->getTitle());
-			}
+			continue;
 		}
+		retval = syncBook (Source, Dest, destDB, NewData, plan, 0);
+		syncState.bookSynced (Source,
+			(retval == SUCCESS) ? Dest->getId () : -1);
+	}
+	destDB->recordIndex (Dest, &syncState);
+	syncState.destSynced ();
+	if (incremental == true)
+	{
+		jLOG ("Skipped " << syncState.getUnchangedCount () - skipped
+			<< " books unchanged since the last pass.");
 	}
+	jLOG ("Planned changes for " << plan.size () << " books.");
 
-	if (updateFlag)
+	if (plan.size () == 0)
 	{
-		newData->displayData ();
+		return SUCCESS;
 	}
+	return applyPlan (plan, destDB, WriteData);
+}
 
-	// jFX ();
-	return SUCCESS;
+//! \fn void planBack (SyncDb *rDb, SyncClass *rRec, SyncDb *cDb,
+//! SyncClass *cRec, SyncClass *newData, RecordBatch& rows,
+//! SyncPlan& plan)
+//! \brief Plan the Calibre changes of -d both.
+//! Runs the reader2cal sync in memory after the cal2reader pipeline. The
+//! Reader books are the rows read with the Reader book index, the first
+//! book of a title with the values planned for it. They are matched
+//! against the Calibre records fetched by the pipeline, which matchRecords
+//! added to the Calibre book index. The Calibre books are raised as by a
+//! reader2cal run after the cal2reader run, without reading either DB
+//! again.
+//! \param [in] rows The Reader books, see SyncDb::setIndexRows.
+//! \param [out] plan The Calibre changes.
+void planBack (SyncDb *rDb, SyncClass *rRec, SyncDb *cDb, SyncClass *cRec,
+	SyncClass *newData, RecordBatch& rows, SyncPlan& plan)
+{
+	BookRecord bRec;
+	BookRecord first;
+	string title;
+	for (size_t j = 0; j < rows.size (); j++)
+	{
+		string_view t = rows.getTitle (j);
+		title.assign (t.data (), t.length ());
+		rows.getBook (j, bRec);
+		if ((rDb->lookupBook (title, &first) == SUCCESS) &&
+			(first.id == bRec.id))
+		{
+			bRec = first;
+		}
+
+		// The Reader fetch skips the books without flags.
+		if (bRec.flags == 0)
+		{
+			continue;
+		}
+		rDb->setRecord (rRec, title, bRec);
+		syncBook (rRec, cRec, cDb, newData, plan, 0);
+	}
 }
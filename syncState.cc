@@ -0,0 +1,408 @@
+using namespace std;
+#include "jlog.hpp"
+#include "syncClass.hpp"
+#include "syncState.hpp"
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <sys/stat.h>
+
+//! \file syncState.cc
+//! \brief SyncState class implementation.
+
+//! With --incremental the values of every source book and of the
+//! destination book it was synced with are written to a sidecar file at
+//! the end of a successful sync. The next run skips the source books whose
+//! values and whose destination book values are the same as in the
+//! sidecar, only the pairs changed on either side since the last sync are
+//! matched again. The destination values are taken from the book index,
+//! see SyncDb::recordIndex.
+
+//! SyncState constructor.
+SyncState::SyncState (void) : unchangedCount (0), partialFetch (false)
+{
+}
+
+//! \fn int SyncState::loadState (const char *fName, string direction,
+//! string stateVal)
+//! \brief Read the baseline of the previous run.
+//! A missing file is not an error, all the books are synced and the file
+//! is created at the end. A baseline written for the other direction or
+//! another state column is not used.
+int SyncState::loadState (const char *fName, string direction,
+	string stateVal)
+{
+	key = direction + " " + stateVal;
+	books.clear ();
+
+	ifstream in (fName);
+	if (!in)
+	{
+		jLOG ("No sync state in [" << fName << "], syncing all books.");
+		return SUCCESS;
+	}
+
+	string line;
+	getline (in, line);
+	if (line != "#syncReaders " + key)
+	{
+		jWARN ("Sync state in [" << fName << "] is not for " << key
+			<< ", syncing all books.");
+		return SUCCESS;
+	}
+
+	while (getline (in, line))
+	{
+		if ((line.length () == 0) || (line[0] == '#'))
+		{
+			continue;
+		}
+
+		int srcId;
+		SyncedBook book;
+		istringstream fields (line);
+		fields >> srcId >> book.destId >> book.stdRating >> book.stdState
+			>> book.flags;
+		if (!fields)
+		{
+			jERR ("Invalid line in sync state [" << fName << "] : " << line);
+			books.clear ();
+			return FAIL;
+		}
+		//! A sidecar written without the destination values has the pairs
+		//! checked again.
+		if (!(fields >> book.destRating >> book.destState))
+		{
+			book.destRating = -1;
+			book.destState = -1;
+		}
+		book.seen = false;
+		books[srcId] = book;
+	}
+
+	jLOG ("Loaded the sync state of " << books.size () << " books from ["
+		<< fName << "]");
+	return SUCCESS;
+}
+
+//! \fn bool SyncState::unchanged (SyncClass *Source)
+//! \brief Check a source book against the baseline.
+//! \return true if the book was synced with a destination book and the
+//! values of neither book have changed since.
+bool SyncState::unchanged (SyncClass *Source)
+{
+	unordered_map<int, SyncedBook>::iterator i = books.find (Source->getId ());
+	if (i == books.end ())
+	{
+		return false;
+	}
+
+	SyncedBook& book = (*i).second;
+	book.seen = true;
+
+	//! A book that was not found in the destination is checked again, it
+	//! may have been added since.
+	if ((book.destId < 0) ||
+		(book.stdRating != Source->getStdRating ()) ||
+		(book.stdState != Source->getStdState ()) ||
+		(book.flags != Source->getFlags ()))
+	{
+		return false;
+	}
+
+	//! A destination book changed or deleted since the last sync.
+	unordered_map<int, DestBook>::iterator d = dests.find (book.destId);
+	if ((d == dests.end ()) || (book.destRating != (*d).second.stdRating) ||
+		(book.destState != (*d).second.stdState))
+	{
+		return false;
+	}
+
+	unchangedCount++;
+	return true;
+}
+
+//! \fn void SyncState::bookSynced (SyncClass *Source, int destId)
+//! \brief Record the values of a source book after it is synced.
+//! \param [in] destId The destination book id, -1 if not found.
+void SyncState::bookSynced (SyncClass *Source, int destId)
+{
+	SyncedBook& book = books[Source->getId ()];
+	book.destId = destId;
+	book.stdRating = Source->getStdRating ();
+	book.stdState = Source->getStdState ();
+	book.flags = Source->getFlags ();
+	book.destRating = -1;
+	book.destState = -1;
+	book.seen = true;
+}
+
+//! \fn void SyncState::setDest (SyncClass *Dest)
+//! \brief Record the values of a destination book in the book index.
+//! Called for every book of the destination index once it is loaded, to
+//! check the pairs against, and again after the books are matched, see
+//! destSynced.
+void SyncState::setDest (SyncClass *Dest)
+{
+	DestBook& dest = dests[Dest->getId ()];
+	dest.stdRating = Dest->getStdRating ();
+	dest.stdState = Dest->getStdState ();
+}
+
+//! \fn void SyncState::destSynced (void)
+//! \brief Record the destination values the pairs are left with.
+//! Takes the values recorded by setDest from the book index after the
+//! books are matched, which holds the planned values of the updated books.
+//! A pair whose destination book is not in the index keeps its values.
+void SyncState::destSynced (void)
+{
+	for (unordered_map<int, SyncedBook>::iterator i = books.begin ();
+		i != books.end (); ++i)
+	{
+		SyncedBook& book = (*i).second;
+		unordered_map<int, DestBook>::iterator d = dests.find (book.destId);
+		if (d != dests.end ())
+		{
+			book.destRating = (*d).second.stdRating;
+			book.destState = (*d).second.stdState;
+		}
+	}
+}
+
+//! \fn void SyncState::setPartialFetch (bool partial)
+//! \brief Keep the books not fetched in this run in the baseline.
+//! Used when the source fetch is limited to the modified books, see
+//! CalibreDb::setModifiedSince.
+void SyncState::setPartialFetch (bool partial)
+{
+	partialFetch = partial;
+}
+
+//! \fn int SyncState::saveState (const char *fName)
+//! \brief Write the baseline for the next run.
+//! Only the books fetched in this run are written, the deleted books are
+//! dropped, unless the fetch is partial. The file is written under a
+//! temporary name and renamed so that a failed write leaves the previous
+//! baseline in place.
+int SyncState::saveState (const char *fName)
+{
+	string tmpName = string (fName) + ".tmp";
+	ofstream out (tmpName.c_str ());
+	if (!out)
+	{
+		jERR ("Unable to open sync state file [" << tmpName << "]");
+		return FAIL;
+	}
+
+	long count = 0;
+	out << "#syncReaders " << key << endl;
+	out << "#srcId\tdestId\tstdRating\tstdState\tflags\tdestRating\tdestState"
+		<< endl;
+	for (unordered_map<int, SyncedBook>::iterator i = books.begin ();
+		i != books.end (); ++i)
+	{
+		SyncedBook& book = (*i).second;
+		if ((book.seen != true) && (partialFetch != true))
+		{
+			continue;
+		}
+		out << (*i).first << "\t" << book.destId << "\t" << book.stdRating
+			<< "\t" << book.stdState << "\t" << book.flags << "\t"
+			<< book.destRating << "\t" << book.destState << endl;
+		count++;
+	}
+
+	out.close ();
+	if (!out)
+	{
+		jERR ("Writing sync state file [" << tmpName << "] failed");
+		remove (tmpName.c_str ());
+		return FAIL;
+	}
+	if (rename (tmpName.c_str (), fName) != 0)
+	{
+		jERR ("Unable to rename [" << tmpName << "] to [" << fName << "]");
+		return FAIL;
+	}
+
+	jLOG ("Wrote the sync state of " << count << " books to [" << fName
+		<< "]");
+	return SUCCESS;
+}
+
+//! Number of source books found unchanged in this run.
+long SyncState::getUnchangedCount (void)
+{
+	return unchangedCount;
+}
+
+//! With --fingerprint the size and modification time of both DB files and
+//! a hash of their book data are written to a file at the end of a
+//! successful sync. If the files are the same at the next run the sync is
+//! skipped without opening the DBs. If only the file times differ, as when
+//! the files are copied back and forth, the book data is hashed and the
+//! sync is skipped if the hashes are the same.
+
+//! SyncFingerprint constructor.
+SyncFingerprint::SyncFingerprint (void) : loaded (false)
+{
+}
+
+//! \fn int SyncFingerprint::statDb (const char *fName, DbPrint& print)
+//! \brief Get the size and the modification times of a DB file and its
+//! write ahead log.
+int SyncFingerprint::statDb (const char *fName, DbPrint& print)
+{
+	struct stat st;
+
+	if (stat (fName, &st) != 0)
+	{
+		jERR ("Unable to stat [" << fName << "]");
+		return FAIL;
+	}
+	print.size = st.st_size;
+	print.mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+	string walName = string (fName) + "-wal";
+	print.walSize = 0;
+	print.walMtime = 0;
+	if (stat (walName.c_str (), &st) == 0)
+	{
+		print.walSize = st.st_size;
+		print.walMtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	}
+	return SUCCESS;
+}
+
+//! \fn int SyncFingerprint::loadPrint (const char *fName, string direction,
+//! string stateVal)
+//! \brief Read the fingerprints of the last sync.
+//! A missing file, or one written for the other direction or another state
+//! column, is not an error, the sync is not skipped.
+int SyncFingerprint::loadPrint (const char *fName, string direction,
+	string stateVal)
+{
+	key = direction + " " + stateVal;
+	loaded = false;
+
+	ifstream in (fName);
+	if (!in)
+	{
+		jDBG ("No fingerprint in [" << fName << "]");
+		return SUCCESS;
+	}
+
+	string line;
+	getline (in, line);
+	if (line != "#syncReaders " + key)
+	{
+		jDBG ("Fingerprint in [" << fName << "] is not for " << key);
+		return SUCCESS;
+	}
+
+	DbPrint *prints[] = {&cSaved, &rSaved};
+	for (int i = 0; i < 2; i++)
+	{
+		DbPrint& print = *prints[i];
+		getline (in, line);
+		istringstream fields (line);
+		fields >> print.size >> print.mtime >> print.walSize
+			>> print.walMtime >> print.hash;
+		if (!fields)
+		{
+			jERR ("Invalid fingerprint in [" << fName << "] : " << line);
+			return FAIL;
+		}
+	}
+
+	loaded = true;
+	return SUCCESS;
+}
+
+//! \fn int SyncFingerprint::statFiles (const char *CDbFile,
+//! const char *RDbFile)
+//! \brief Get the file fingerprints of the DBs.
+int SyncFingerprint::statFiles (const char *CDbFile, const char *RDbFile)
+{
+	if (statDb (CDbFile, cPrint) != SUCCESS)
+	{
+		return FAIL;
+	}
+	return statDb (RDbFile, rPrint);
+}
+
+//! Flag indicating that the fingerprints of the last sync are loaded.
+bool SyncFingerprint::getLoaded (void)
+{
+	return loaded;
+}
+
+//! \fn bool SyncFingerprint::filesUnchanged (void)
+//! \brief Check the file fingerprints against the last sync.
+bool SyncFingerprint::filesUnchanged (void)
+{
+	if (loaded != true)
+	{
+		return false;
+	}
+
+	DbPrint *now[] = {&cPrint, &rPrint};
+	DbPrint *saved[] = {&cSaved, &rSaved};
+	for (int i = 0; i < 2; i++)
+	{
+		if ((now[i]->size != saved[i]->size) ||
+			(now[i]->mtime != saved[i]->mtime) ||
+			(now[i]->walSize != saved[i]->walSize) ||
+			(now[i]->walMtime != saved[i]->walMtime))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+//! Set the data hashes of the DBs, see SyncDb::dataHash.
+void SyncFingerprint::setHashes (string cHash, string rHash)
+{
+	cPrint.hash = cHash;
+	rPrint.hash = rHash;
+}
+
+//! \fn bool SyncFingerprint::hashesUnchanged (void)
+//! \brief Check the data hashes against the last sync.
+bool SyncFingerprint::hashesUnchanged (void)
+{
+	return ((loaded == true) && (cPrint.hash == cSaved.hash) &&
+		(rPrint.hash == rSaved.hash));
+}
+
+//! \fn int SyncFingerprint::savePrint (const char *fName)
+//! \brief Write the fingerprints for the next run.
+//! statFiles and setHashes have to be called after the last update.
+int SyncFingerprint::savePrint (const char *fName)
+{
+	ofstream out (fName);
+	if (!out)
+	{
+		jERR ("Unable to open fingerprint file [" << fName << "]");
+		return FAIL;
+	}
+
+	out << "#syncReaders " << key << endl;
+	DbPrint *prints[] = {&cPrint, &rPrint};
+	for (int i = 0; i < 2; i++)
+	{
+		out << prints[i]->size << "\t" << prints[i]->mtime << "\t"
+			<< prints[i]->walSize << "\t" << prints[i]->walMtime << "\t"
+			<< prints[i]->hash << endl;
+	}
+
+	out.close ();
+	if (!out)
+	{
+		jERR ("Writing fingerprint file [" << fName << "] failed");
+		return FAIL;
+	}
+	jDBG ("Wrote the fingerprints to [" << fName << "]");
+	return SUCCESS;
+}
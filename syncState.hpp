@@ -0,0 +1,162 @@
+#ifndef __SYNCSTATE_H
+#define __SYNCSTATE_H
+//! \file syncState.hpp
+//! \brief SyncState class declaration.
+
+#include <string>
+#include <unordered_map>
+
+//! Values of a source book at the end of the last sync.
+struct SyncedBook
+{
+	//! Destination book id, -1 if the book was not found in the destination.
+	int destId;
+
+	//! Standard rating of the source book.
+	int stdRating;
+
+	//! Standard state of the source book.
+	int stdState;
+
+	//! Flags of the source book - specific to Reader.
+	int flags;
+
+	//! Standard rating of the destination book, -1 if not known.
+	int destRating;
+
+	//! Standard state of the destination book, -1 if not known.
+	int destState;
+
+	//! Flag indicating that the book was fetched in this run.
+	bool seen;
+};
+
+//! Values of a destination book in the book index, see SyncState::setDest.
+struct DestBook
+{
+	//! Standard rating of the destination book.
+	int stdRating;
+
+	//! Standard state of the destination book.
+	int stdState;
+};
+
+//! Baseline of an incremental sync, kept in a sidecar file between runs.
+class SyncState
+{
+private :
+	//! The synced books by source book id.
+	unordered_map<int, SyncedBook> books;
+
+	//! The destination books in the book index by destination book id.
+	unordered_map<int, DestBook> dests;
+
+	//! Direction and state column the baseline was written for.
+	string key;
+
+	//! Number of source books found unchanged in this run.
+	long unchangedCount;
+
+	//! Flag indicating that only some of the source books are fetched.
+	bool partialFetch;
+
+public :
+	//! SyncState constructor.
+	SyncState (void);
+
+	//! Read the baseline of the previous run.
+	int loadState (const char *fName, string direction, string stateVal);
+
+	//! Check a source book against the baseline.
+	bool unchanged (SyncClass *Source);
+
+	//! Record the values of a source book after it is synced.
+	void bookSynced (SyncClass *Source, int destId);
+
+	//! Record the values of a destination book in the book index.
+	void setDest (SyncClass *Dest);
+
+	//! Record the destination values the pairs are left with.
+	void destSynced (void);
+
+	//! Keep the books not fetched in this run in the baseline.
+	void setPartialFetch (bool partial);
+
+	//! Write the baseline for the next run.
+	int saveState (const char *fName);
+
+	//! Number of source books found unchanged in this run.
+	long getUnchangedCount (void);
+};
+
+//! File and data fingerprint of a DB, see SyncFingerprint.
+struct DbPrint
+{
+	//! Size of the DB file.
+	long long size;
+
+	//! Modification time of the DB file in nanoseconds.
+	long long mtime;
+
+	//! Size of the write ahead log, 0 if not present.
+	long long walSize;
+
+	//! Modification time of the write ahead log, 0 if not present.
+	long long walMtime;
+
+	//! Hash of the book data, see SyncDb::dataHash.
+	string hash;
+};
+
+//! Fingerprints of the Calibre and Reader DBs at the end of the last sync.
+class SyncFingerprint
+{
+private :
+	//! Direction and state column the fingerprints were written for.
+	string key;
+
+	//! Flag indicating that the fingerprints of the last sync are loaded.
+	bool loaded;
+
+	//! Calibre DB at the end of the last sync.
+	DbPrint cSaved;
+
+	//! Reader DB at the end of the last sync.
+	DbPrint rSaved;
+
+	//! Calibre DB now.
+	DbPrint cPrint;
+
+	//! Reader DB now.
+	DbPrint rPrint;
+
+	//! Get the size and the modification times of a DB file.
+	int statDb (const char *fName, DbPrint& print);
+
+public :
+	//! SyncFingerprint constructor.
+	SyncFingerprint (void);
+
+	//! Read the fingerprints of the last sync.
+	int loadPrint (const char *fName, string direction, string stateVal);
+
+	//! Get the file fingerprints of the DBs.
+	int statFiles (const char *CDbFile, const char *RDbFile);
+
+	//! Flag indicating that the fingerprints of the last sync are loaded.
+	bool getLoaded (void);
+
+	//! Check the file fingerprints against the last sync.
+	bool filesUnchanged (void);
+
+	//! Set the data hashes of the DBs.
+	void setHashes (string cHash, string rHash);
+
+	//! Check the data hashes against the last sync.
+	bool hashesUnchanged (void);
+
+	//! Write the fingerprints for the next run.
+	int savePrint (const char *fName);
+};
+
+#endif
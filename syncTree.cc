@@ -0,0 +1,124 @@
+using namespace std;
+#include "jlog.hpp"
+#include "syncClass.hpp"
+#include "syncDbClass.hpp"
+#include "syncTree.hpp"
+
+//! \file syncTree.cc
+//! \brief SyncTree class implementation.
+
+//! With --tree the leaf hashes of both DBs are computed with one aggregate
+//! query each and only the books in the leaves that differ are fetched and
+//! matched. The books and the titles of a node are counted, a node is the
+//! same only if the hashes and the counts are the same and no title is
+//! repeated, a repeated title is matched by the sync like any other.
+
+//! SyncTree constructor.
+SyncTree::SyncTree (void) : nodesCompared (0)
+{
+}
+
+//! \fn void SyncTree::buildLevels (vector<vector<TreeLeaf> >& tree)
+//! \brief Build the levels above the leaves.
+//! The leaves are the last level of tree, the levels above are inserted in
+//! front of them up to the root.
+void SyncTree::buildLevels (vector<vector<TreeLeaf> >& tree)
+{
+	while (tree.front ().size () > 1)
+	{
+		vector<TreeLeaf>& below = tree.front ();
+		size_t fanout = 1 << TREE_LEVEL_BITS;
+		if (fanout > below.size ())
+		{
+			fanout = below.size ();
+		}
+
+		vector<TreeLeaf> level (below.size () / fanout);
+		for (size_t i = 0; i < level.size (); i++)
+		{
+			level[i].hash = 0;
+			level[i].books = 0;
+			level[i].titles = 0;
+			for (size_t j = i * fanout; j < (i + 1) * fanout; j++)
+			{
+				// Wraps around like the sync_hash sum.
+				level[i].hash = (long long) ((unsigned long long) level[i].hash
+					+ (unsigned long long) below[j].hash);
+				level[i].books += below[j].books;
+				level[i].titles += below[j].titles;
+			}
+		}
+		tree.insert (tree.begin (), level);
+	}
+}
+
+//! \fn void SyncTree::setLeaves (vector<TreeLeaf>& sourceLeaves,
+//! vector<TreeLeaf>& destLeaves)
+//! \brief Set the leaves of the trees and build the levels above them.
+//! Both have 1 << TREE_BITS leaves.
+void SyncTree::setLeaves (vector<TreeLeaf>& sourceLeaves,
+	vector<TreeLeaf>& destLeaves)
+{
+	source.clear ();
+	dest.clear ();
+	source.push_back (sourceLeaves);
+	dest.push_back (destLeaves);
+	buildLevels (source);
+	buildLevels (dest);
+}
+
+//! \fn bool SyncTree::sameNode (int level, size_t node)
+//! \brief Check if a node is the same in both trees.
+bool SyncTree::sameNode (int level, size_t node)
+{
+	TreeLeaf& s = source[level][node];
+	TreeLeaf& d = dest[level][node];
+
+	nodesCompared++;
+	return ((s.hash == d.hash) && (s.books == d.books) &&
+		(s.books == s.titles) && (d.books == d.titles));
+}
+
+//! \fn void SyncTree::descend (int level, size_t node, vector<bool>& dirty,
+//! long *count)
+//! \brief Mark the differing leaves below a node.
+void SyncTree::descend (int level, size_t node, vector<bool>& dirty,
+	long *count)
+{
+	if (sameNode (level, node) == true)
+	{
+		return;
+	}
+
+	if (level == (int) source.size () - 1)
+	{
+		dirty[node] = true;
+		(*count)++;
+		return;
+	}
+
+	size_t fanout = source[level + 1].size () / source[level].size ();
+	for (size_t i = node * fanout; i < (node + 1) * fanout; i++)
+	{
+		descend (level + 1, i, dirty, count);
+	}
+}
+
+//! \fn long SyncTree::diff (vector<bool>& dirty)
+//! \brief Mark the leaves that differ.
+//! \return The number of leaves marked.
+long SyncTree::diff (vector<bool>& dirty)
+{
+	long count = 0;
+
+	nodesCompared = 0;
+	dirty.assign (source.back ().size (), false);
+	descend (0, 0, dirty, &count);
+	return count;
+}
+
+//! Number of nodes compared by diff.
+long SyncTree::getNodesCompared (void)
+{
+	return nodesCompared;
+}
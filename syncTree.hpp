@@ -0,0 +1,56 @@
+#ifndef __SYNCTREE_H
+#define __SYNCTREE_H
+//! \file syncTree.hpp
+//! \brief SyncTree class declaration.
+
+#include <vector>
+
+//! Number of title hash bits of the tree leaves.
+#define TREE_BITS 12
+
+//! Number of title hash bits added by each level of the tree.
+#define TREE_LEVEL_BITS 4
+
+//! Hash tree of the books of the Calibre and Reader DBs by title.
+//! The leaves are ranges of the title hash, each holds the sum of the
+//! hashes of the books in the range, see SyncDb::leafHashes. The nodes
+//! above add up the hashes of their children. The trees of the two DBs are
+//! compared from the root and only the leaves that differ are marked, the
+//! books of the other leaves are in sync.
+class SyncTree
+{
+private :
+	//! Nodes of the source tree, by level from the root.
+	vector<vector<TreeLeaf> > source;
+
+	//! Nodes of the destination tree, by level from the root.
+	vector<vector<TreeLeaf> > dest;
+
+	//! Number of nodes compared.
+	long nodesCompared;
+
+	//! Build the levels above the leaves.
+	void buildLevels (vector<vector<TreeLeaf> >& tree);
+
+	//! Check if a node is the same in both trees.
+	bool sameNode (int level, size_t node);
+
+	//! Mark the differing leaves below a node.
+	void descend (int level, size_t node, vector<bool>& dirty, long *count);
+
+public :
+	//! SyncTree constructor.
+	SyncTree (void);
+
+	//! Set the leaves of the trees.
+	void setLeaves (vector<TreeLeaf>& sourceLeaves,
+		vector<TreeLeaf>& destLeaves);
+
+	//! Mark the leaves that differ.
+	long diff (vector<bool>& dirty);
+
+	//! Number of nodes compared by diff.
+	long getNodesCompared (void);
+};
+
+#endif
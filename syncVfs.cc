@@ -0,0 +1,321 @@
+using namespace std;
+#include "jlog.hpp"
+#include "syncClass.hpp"
+#include "syncVfs.hpp"
+#include <sqlite3.h>
+#include <string.h>
+#include <atomic>
+
+//! \file syncVfs.cc
+//! \brief SQLite VFS shim counting the file syncs.
+
+//! SQLite does not report the number of fsyncs it makes. The sync counting
+//! VFS wraps the default VFS, passes every call through to it and counts
+//! the xSync calls on the database and journal files, so that the cost of
+//! the destination DB commits can be reported at the end of the run.
+
+//! File opened through the sync counting VFS.
+struct SyncFile
+{
+	//! Base class, must be the first member.
+	sqlite3_file base;
+
+	//! File opened by the wrapped VFS, allocated right after this struct.
+	sqlite3_file *real;
+};
+
+//! The wrapped (original default) VFS.
+static sqlite3_vfs *origVfs = 0;
+
+//! The sync counting VFS.
+static sqlite3_vfs syncVfs;
+
+//! Number of xSync calls, the DBs may be used from several threads.
+static atomic<long> syncCount (0);
+
+//! Get the wrapped file.
+#define REAL(f) (((SyncFile *) (f))->real)
+
+static int syncClose (sqlite3_file *f)
+{
+	return REAL (f)->pMethods->xClose (REAL (f));
+}
+
+static int syncRead (sqlite3_file *f, void *buf, int amt, sqlite3_int64 ofst)
+{
+	return REAL (f)->pMethods->xRead (REAL (f), buf, amt, ofst);
+}
+
+static int syncWrite (sqlite3_file *f, const void *buf, int amt,
+	sqlite3_int64 ofst)
+{
+	return REAL (f)->pMethods->xWrite (REAL (f), buf, amt, ofst);
+}
+
+static int syncTruncate (sqlite3_file *f, sqlite3_int64 size)
+{
+	return REAL (f)->pMethods->xTruncate (REAL (f), size);
+}
+
+//! Count the sync and pass it to the wrapped file.
+static int syncSync (sqlite3_file *f, int flags)
+{
+	syncCount++;
+	return REAL (f)->pMethods->xSync (REAL (f), flags);
+}
+
+static int syncFileSize (sqlite3_file *f, sqlite3_int64 *size)
+{
+	return REAL (f)->pMethods->xFileSize (REAL (f), size);
+}
+
+static int syncLock (sqlite3_file *f, int lock)
+{
+	return REAL (f)->pMethods->xLock (REAL (f), lock);
+}
+
+static int syncUnlock (sqlite3_file *f, int lock)
+{
+	return REAL (f)->pMethods->xUnlock (REAL (f), lock);
+}
+
+static int syncCheckReservedLock (sqlite3_file *f, int *res)
+{
+	return REAL (f)->pMethods->xCheckReservedLock (REAL (f), res);
+}
+
+static int syncFileControl (sqlite3_file *f, int op, void *arg)
+{
+	return REAL (f)->pMethods->xFileControl (REAL (f), op, arg);
+}
+
+static int syncSectorSize (sqlite3_file *f)
+{
+	return REAL (f)->pMethods->xSectorSize (REAL (f));
+}
+
+static int syncDeviceCharacteristics (sqlite3_file *f)
+{
+	return REAL (f)->pMethods->xDeviceCharacteristics (REAL (f));
+}
+
+static int syncShmMap (sqlite3_file *f, int pg, int pgsz, int extend,
+	void volatile **pp)
+{
+	return REAL (f)->pMethods->xShmMap (REAL (f), pg, pgsz, extend, pp);
+}
+
+static int syncShmLock (sqlite3_file *f, int offset, int n, int flags)
+{
+	return REAL (f)->pMethods->xShmLock (REAL (f), offset, n, flags);
+}
+
+static void syncShmBarrier (sqlite3_file *f)
+{
+	REAL (f)->pMethods->xShmBarrier (REAL (f));
+}
+
+static int syncShmUnmap (sqlite3_file *f, int deleteFlag)
+{
+	return REAL (f)->pMethods->xShmUnmap (REAL (f), deleteFlag);
+}
+
+static int syncFetch (sqlite3_file *f, sqlite3_int64 ofst, int amt, void **pp)
+{
+	return REAL (f)->pMethods->xFetch (REAL (f), ofst, amt, pp);
+}
+
+static int syncUnfetch (sqlite3_file *f, sqlite3_int64 ofst, void *p)
+{
+	return REAL (f)->pMethods->xUnfetch (REAL (f), ofst, p);
+}
+
+//! IO methods of the files opened through the sync counting VFS.
+static sqlite3_io_methods syncIo =
+{
+	3,
+	syncClose,
+	syncRead,
+	syncWrite,
+	syncTruncate,
+	syncSync,
+	syncFileSize,
+	syncLock,
+	syncUnlock,
+	syncCheckReservedLock,
+	syncFileControl,
+	syncSectorSize,
+	syncDeviceCharacteristics,
+	syncShmMap,
+	syncShmLock,
+	syncShmBarrier,
+	syncShmUnmap,
+	syncFetch,
+	syncUnfetch
+};
+
+//! IO methods for wrapped files that only support version 1.
+static sqlite3_io_methods syncIoV1 =
+{
+	1,
+	syncClose,
+	syncRead,
+	syncWrite,
+	syncTruncate,
+	syncSync,
+	syncFileSize,
+	syncLock,
+	syncUnlock,
+	syncCheckReservedLock,
+	syncFileControl,
+	syncSectorSize,
+	syncDeviceCharacteristics,
+	0, 0, 0, 0, 0, 0
+};
+
+//! \fn static int syncOpen (sqlite3_vfs *vfs, const char *name,
+//! sqlite3_file *f, int flags, int *outFlags)
+//! \brief Open the file through the wrapped VFS.
+static int syncOpen (sqlite3_vfs *vfs, const char *name, sqlite3_file *f,
+	int flags, int *outFlags)
+{
+	int retVal;
+	SyncFile *sFile = (SyncFile *) f;
+
+	sFile->real = (sqlite3_file *) &sFile[1];
+	retVal = origVfs->xOpen (origVfs, name, sFile->real, flags, outFlags);
+	if (sFile->real->pMethods == 0)
+	{
+		f->pMethods = 0;
+	}
+	else if (sFile->real->pMethods->iVersion >= 3)
+	{
+		f->pMethods = &syncIo;
+	}
+	else
+	{
+		f->pMethods = &syncIoV1;
+	}
+	return retVal;
+}
+
+static int syncDelete (sqlite3_vfs *vfs, const char *name, int dirSync)
+{
+	return origVfs->xDelete (origVfs, name, dirSync);
+}
+
+static int syncAccess (sqlite3_vfs *vfs, const char *name, int flags,
+	int *res)
+{
+	return origVfs->xAccess (origVfs, name, flags, res);
+}
+
+static int syncFullPathname (sqlite3_vfs *vfs, const char *name, int n,
+	char *out)
+{
+	return origVfs->xFullPathname (origVfs, name, n, out);
+}
+
+static void *syncDlOpen (sqlite3_vfs *vfs, const char *name)
+{
+	return origVfs->xDlOpen (origVfs, name);
+}
+
+static void syncDlError (sqlite3_vfs *vfs, int n, char *msg)
+{
+	origVfs->xDlError (origVfs, n, msg);
+}
+
+static void (*syncDlSym (sqlite3_vfs *vfs, void *h, const char *sym)) (void)
+{
+	return origVfs->xDlSym (origVfs, h, sym);
+}
+
+static void syncDlClose (sqlite3_vfs *vfs, void *h)
+{
+	origVfs->xDlClose (origVfs, h);
+}
+
+static int syncRandomness (sqlite3_vfs *vfs, int n, char *out)
+{
+	return origVfs->xRandomness (origVfs, n, out);
+}
+
+static int syncSleep (sqlite3_vfs *vfs, int usec)
+{
+	return origVfs->xSleep (origVfs, usec);
+}
+
+static int syncCurrentTime (sqlite3_vfs *vfs, double *t)
+{
+	return origVfs->xCurrentTime (origVfs, t);
+}
+
+static int syncGetLastError (sqlite3_vfs *vfs, int n, char *msg)
+{
+	return origVfs->xGetLastError (origVfs, n, msg);
+}
+
+static int syncCurrentTimeInt64 (sqlite3_vfs *vfs, sqlite3_int64 *t)
+{
+	return origVfs->xCurrentTimeInt64 (origVfs, t);
+}
+
+//! \fn int registerSyncVfs (void)
+//! \brief Register the sync counting VFS as the default SQLite VFS.
+//! Must be called before the databases are opened. Calling it again is
+//! harmless.
+int registerSyncVfs (void)
+{
+	int retVal;
+
+	if (origVfs != 0)
+	{
+		return SUCCESS;
+	}
+
+	origVfs = sqlite3_vfs_find (0);
+	if (origVfs == 0 || origVfs->iVersion < 2)
+	{
+		jERR ("Default SQLite VFS not usable for sync counting");
+		origVfs = 0;
+		return FAIL;
+	}
+
+	memset (&syncVfs, '\0', sizeof (syncVfs));
+	syncVfs.iVersion = 2;
+	syncVfs.szOsFile = sizeof (SyncFile) + origVfs->szOsFile;
+	syncVfs.mxPathname = origVfs->mxPathname;
+	syncVfs.zName = SYNC_VFS_NAME;
+	syncVfs.xOpen = syncOpen;
+	syncVfs.xDelete = syncDelete;
+	syncVfs.xAccess = syncAccess;
+	syncVfs.xFullPathname = syncFullPathname;
+	syncVfs.xDlOpen = syncDlOpen;
+	syncVfs.xDlError = syncDlError;
+	syncVfs.xDlSym = syncDlSym;
+	syncVfs.xDlClose = syncDlClose;
+	syncVfs.xRandomness = syncRandomness;
+	syncVfs.xSleep = syncSleep;
+	syncVfs.xCurrentTime = syncCurrentTime;
+	syncVfs.xGetLastError = syncGetLastError;
+	syncVfs.xCurrentTimeInt64 = syncCurrentTimeInt64;
+
+	retVal = sqlite3_vfs_register (&syncVfs, 1);
+	if (retVal != SQLITE_OK)
+	{
+		jERR ("Registering the sync counting VFS failed [" << retVal << "]");
+		origVfs = 0;
+		return FAIL;
+	}
+
+	jDBG ("Registered " << SYNC_VFS_NAME << " VFS over " << origVfs->zName);
+	return SUCCESS;
+}
+
+//! \fn long getSyncCount (void)
+//! \brief Get the number of file syncs made through the sync counting VFS.
+long getSyncCount (void)
+{
+	return syncCount;
+}
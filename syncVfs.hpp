@@ -0,0 +1,15 @@
+#ifndef __SYNCVFS_H
+#define __SYNCVFS_H
+//! \file syncVfs.hpp
+//! \brief SQLite VFS shim counting the file syncs.
+
+//! Name of the sync counting VFS.
+#define SYNC_VFS_NAME "syncCount"
+
+//! Register the sync counting VFS as the default SQLite VFS.
+int registerSyncVfs (void);
+
+//! Get the number of file syncs made through the sync counting VFS.
+long getSyncCount (void);
+
+#endif
@@ -0,0 +1,276 @@
+using namespace std;
+#include "jlog.hpp"
+#include "syncClass.hpp"
+#include "syncWatch.hpp"
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+//! \file syncWatch.cc
+//! \brief DbWatch class implementation.
+
+//! With --watch the DBs stay open and are synced again when one of them
+//! changes. A change is taken once no event has been seen for
+//! WATCH_SETTLE_MS, so that a copy or a burst of commits is synced once.
+//! The events are only a hint, a DB is changed if its size, modification
+//! time or inode, or those of its write ahead log, differ from the last
+//! sync. The updates of the sync itself are recorded with markSynced and
+//! do not start another sync.
+
+//! Set when SIGINT or SIGTERM is received while waiting.
+static volatile sig_atomic_t stopWatch = 0;
+
+//! Handler of SIGINT and SIGTERM.
+static void watchSignal (int sig)
+{
+	stopWatch = 1;
+}
+
+//! DbWatch constructor.
+DbWatch::DbWatch (void) : fd (-1)
+{
+	sigemptyset (&waitMask);
+}
+
+//! DbWatch destructor, closes the inotify descriptor.
+DbWatch::~DbWatch ()
+{
+	if (fd >= 0)
+	{
+		close (fd);
+	}
+}
+
+//! \fn int DbWatch::startWatch (const char *CDbFile, const char *RDbFile)
+//! \brief Start watching the Calibre and Reader DB files.
+//! Blocks SIGINT and SIGTERM, they are delivered in waitChange only.
+int DbWatch::startWatch (const char *CDbFile, const char *RDbFile)
+{
+	const char *files[2] = {CDbFile, RDbFile};
+
+	fd = inotify_init1 (IN_CLOEXEC);
+	if (fd < 0)
+	{
+		jERR ("inotify_init1 failed : " << strerror (errno));
+		return FAIL;
+	}
+
+	dbs.resize (2);
+	for (int i = 0; i < 2; i++)
+	{
+		WatchedDb& db = dbs[i];
+		db.path = files[i];
+		size_t slash = db.path.rfind ('/');
+		if (slash == string::npos)
+		{
+			db.dir = ".";
+			db.name = db.path;
+		}
+		else
+		{
+			db.dir = (slash == 0) ? "/" : db.path.substr (0, slash);
+			db.name = db.path.substr (slash + 1);
+		}
+		db.touched = false;
+		statDb (db);
+
+		//! The directory is watched, a DB file replaced by rename gets a
+		//! new inode a watch on the file would not follow. Both DBs in one
+		//! directory share the watch.
+		if (inotify_add_watch (fd, db.dir.c_str (), IN_MODIFY | IN_CLOSE_WRITE
+			| IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) < 0)
+		{
+			jERR ("Unable to watch [" << db.dir << "] : " << strerror (errno));
+			return FAIL;
+		}
+	}
+
+	struct sigaction sa;
+	memset (&sa, '\0', sizeof (sa));
+	sa.sa_handler = watchSignal;
+	sigemptyset (&sa.sa_mask);
+	sigaction (SIGINT, &sa, 0);
+	sigaction (SIGTERM, &sa, 0);
+
+	sigset_t block;
+	sigemptyset (&block);
+	sigaddset (&block, SIGINT);
+	sigaddset (&block, SIGTERM);
+	pthread_sigmask (SIG_BLOCK, &block, &waitMask);
+	sigdelset (&waitMask, SIGINT);
+	sigdelset (&waitMask, SIGTERM);
+	return SUCCESS;
+}
+
+//! \fn void DbWatch::statDb (WatchedDb& db)
+//! \brief Get the current state of a DB file.
+//! The inode is 0 if the file is not present.
+void DbWatch::statDb (WatchedDb& db)
+{
+	struct stat st;
+
+	db.ino = 0;
+	db.size = 0;
+	db.mtime = 0;
+	if (stat (db.path.c_str (), &st) == 0)
+	{
+		db.ino = st.st_ino;
+		db.size = st.st_size;
+		db.mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	}
+
+	db.walSize = 0;
+	db.walMtime = 0;
+	if (stat ((db.path + "-wal").c_str (), &st) == 0)
+	{
+		db.walSize = st.st_size;
+		db.walMtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	}
+}
+
+//! \fn void DbWatch::markSynced (int which)
+//! \brief Record the state of the DB files at a sync.
+//! \param [in] which WATCH_CALIBRE, WATCH_READER or both.
+void DbWatch::markSynced (int which)
+{
+	for (size_t i = 0; i < dbs.size (); i++)
+	{
+		if ((which & (WATCH_CALIBRE << i)) != 0)
+		{
+			statDb (dbs[i]);
+		}
+	}
+}
+
+//! \fn int DbWatch::readEvents (void)
+//! \brief Read the pending events and mark the DBs they refer to.
+int DbWatch::readEvents (void)
+{
+	char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+	ssize_t len = read (fd, buf, sizeof (buf));
+	if (len < 0)
+	{
+		if (errno == EINTR)
+		{
+			return SUCCESS;
+		}
+		jERR ("Reading the inotify events failed : " << strerror (errno));
+		return FAIL;
+	}
+
+	for (char *p = buf; p < buf + len;
+		p += sizeof (struct inotify_event) + ((struct inotify_event *) p)->len)
+	{
+		struct inotify_event *ev = (struct inotify_event *) p;
+		for (size_t i = 0; i < dbs.size (); i++)
+		{
+			//! Events were lost, all the DBs are checked.
+			if (((ev->mask & IN_Q_OVERFLOW) != 0) || ((ev->len != 0) &&
+				((dbs[i].name == ev->name) ||
+				(dbs[i].name + "-wal" == ev->name))))
+			{
+				dbs[i].touched = true;
+			}
+		}
+	}
+	return SUCCESS;
+}
+
+//! \fn int DbWatch::pollEvents (int timeout)
+//! \brief Wait for events and read them.
+//! \param [in] timeout Milliseconds to wait, -1 to wait for ever.
+//! \return SUCCESS if events were read, NO_DATA on timeout or when
+//! stopped by a signal, FAIL on error.
+int DbWatch::pollEvents (int timeout)
+{
+	struct pollfd pfd;
+	struct timespec ts;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000L;
+
+	int n = ppoll (&pfd, 1, (timeout < 0) ? 0 : &ts, &waitMask);
+	if (n < 0)
+	{
+		if (errno == EINTR)
+		{
+			return NO_DATA;
+		}
+		jERR ("Waiting for inotify events failed : " << strerror (errno));
+		return FAIL;
+	}
+	if (n == 0)
+	{
+		return NO_DATA;
+	}
+	return readEvents ();
+}
+
+//! \fn int DbWatch::waitChange (int *changed)
+//! \brief Wait until a DB file has changed and the change has settled.
+//! A DB file that is not present, as while it is copied, is not taken as
+//! changed until it is back.
+//! \param [out] changed WATCH_CALIBRE and WATCH_READER for the changed
+//! DBs, with WATCH_CALIBRE_REPLACED and WATCH_READER_REPLACED if the file
+//! has a new inode and has to be opened again.
+//! \return SUCCESS, NO_DATA when stopped by SIGINT or SIGTERM, FAIL on
+//! error.
+int DbWatch::waitChange (int *changed)
+{
+	int retVal;
+
+	*changed = 0;
+	while (*changed == 0)
+	{
+		retVal = pollEvents (-1);
+		while (retVal == SUCCESS)
+		{
+			retVal = pollEvents (WATCH_SETTLE_MS);
+		}
+		if (stopWatch != 0)
+		{
+			jLOG ("Stopped watching.");
+			return NO_DATA;
+		}
+		if (retVal == FAIL)
+		{
+			return FAIL;
+		}
+
+		for (size_t i = 0; i < dbs.size (); i++)
+		{
+			WatchedDb& db = dbs[i];
+			if (db.touched != true)
+			{
+				continue;
+			}
+
+			WatchedDb now = db;
+			statDb (now);
+			if (now.ino == 0)
+			{
+				jWARN ("[" << db.path << "] is not present, waiting for it.");
+				continue;
+			}
+			db.touched = false;
+			if ((now.ino != db.ino) || (now.size != db.size) ||
+				(now.mtime != db.mtime) || (now.walSize != db.walSize) ||
+				(now.walMtime != db.walMtime))
+			{
+				*changed |= (WATCH_CALIBRE << i);
+			}
+			if (now.ino != db.ino)
+			{
+				*changed |= (WATCH_CALIBRE_REPLACED << i);
+			}
+		}
+	}
+	return SUCCESS;
+}
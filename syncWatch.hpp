@@ -0,0 +1,100 @@
+#ifndef __SYNCWATCH_H
+#define __SYNCWATCH_H
+//! \file syncWatch.hpp
+//! \brief DbWatch class declaration.
+
+#include <string>
+#include <vector>
+#include <signal.h>
+
+//! Time without events after which a change has settled, in milliseconds.
+#define WATCH_SETTLE_MS 2000
+
+//! The Calibre DB has changed, see DbWatch::waitChange.
+#define WATCH_CALIBRE 0x01
+
+//! The Reader DB has changed, see DbWatch::waitChange.
+#define WATCH_READER 0x02
+
+//! The Calibre DB file was replaced by another file.
+#define WATCH_CALIBRE_REPLACED 0x04
+
+//! The Reader DB file was replaced by another file.
+#define WATCH_READER_REPLACED 0x08
+
+//! A watched DB file and its state when it was last synced.
+struct WatchedDb
+{
+	//! Path of the DB file.
+	string path;
+
+	//! Directory of the DB file.
+	string dir;
+
+	//! Name of the DB file in dir.
+	string name;
+
+	//! Inode of the DB file, 0 if not present.
+	long long ino;
+
+	//! Size of the DB file.
+	long long size;
+
+	//! Modification time of the DB file in nanoseconds.
+	long long mtime;
+
+	//! Size of the write ahead log, 0 if not present.
+	long long walSize;
+
+	//! Modification time of the write ahead log, 0 if not present.
+	long long walMtime;
+
+	//! Flag indicating that an event was seen for the DB since the last
+	//! wait.
+	bool touched;
+};
+
+//! Watch the Calibre and Reader DB files with inotify.
+//! The directories of the DB files are watched, so that a DB file replaced
+//! by a copy is seen as well. The events of the other files are ignored.
+//! SIGINT and SIGTERM are blocked while the DBs are synced and only
+//! delivered while waiting, they end the wait.
+class DbWatch
+{
+private :
+	//! The inotify descriptor, -1 if not started.
+	int fd;
+
+	//! The watched DBs, Calibre first.
+	vector<WatchedDb> dbs;
+
+	//! Signal mask while waiting, SIGINT and SIGTERM are not blocked.
+	sigset_t waitMask;
+
+	//! Get the current state of a DB file.
+	void statDb (WatchedDb& db);
+
+	//! Wait for events, timeout in milliseconds or -1.
+	int pollEvents (int timeout);
+
+	//! Read the pending events and mark the DBs they refer to.
+	int readEvents (void);
+
+public :
+	//! DbWatch constructor.
+	DbWatch (void);
+
+	//! DbWatch destructor, closes the inotify descriptor.
+	~DbWatch ();
+
+	//! Start watching the Calibre and Reader DB files.
+	int startWatch (const char *CDbFile, const char *RDbFile);
+
+	//! Record the state of the DB files at a sync.
+	void markSynced (int which);
+
+	//! Wait until a DB file has changed and the change has settled.
+	int waitChange (int *changed);
+};
+
+#endif